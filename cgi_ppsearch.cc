@@ -7,13 +7,34 @@ extern "C" {
 }
 
 int cgiMain() {
-  cgiHeaderContentType((char*)"text/html");
   dvc::install_segfault_handler();
   dvc::install_terminate_handler();
 
   std::filesystem::path index_file = "/opt/actcd19.idx";
   size_t nthreads = 24;
   size_t block_size = 100000;
+  std::filesystem::path cache_file = "/opt/actcd19.cache";
+  size_t cache_capacity = 256 << 20;
+  size_t num_completions = 8;
+  // Lazy, so that cache hits and completions touch only the token
+  // dictionary.
+  ppt::mmap_options mmap;
+  mmap.residency = ppt::residency_policy::lazy;
+
+  // ?complete=<query so far> answers with completed queries, one per line,
+  // for the search box as it is typed in.
+  char partial_query[256];
+  if (cgiFormStringNoNewlines((char*)"complete", partial_query, 256) !=
+      cgiFormNotFound) {
+    cgiHeaderContentType((char*)"text/plain");
+    ppt::Index index(index_file, mmap);
+    for (const std::string& completion :
+         ppt::complete_query(index.reader, partial_query, num_completions))
+      fprintf(cgiOut, "%s\n", completion.c_str());
+    return 0;
+  }
+
+  cgiHeaderContentType((char*)"text/html");
 
   fprintf(cgiOut, R"(
    <html>
@@ -26,9 +47,21 @@ int cgiMain() {
        <form method="GET" enctype="multipart/form-data" action=")");
   cgiValueEscape(cgiScriptName);
   fprintf(cgiOut, R"(">
-         <input type="text" name="q" />
+         <input type="text" name="q" list="completions" autocomplete="off" />
+         <datalist id="completions"></datalist>
          <input type="submit" name="search" value="Search" />
-       </form>)");
+       </form>
+       <script>
+         const q = document.querySelector('input[name="q"]');
+         q.addEventListener('input', async () => {
+           const response =
+               await fetch('?complete=' + encodeURIComponent(q.value));
+           const list = document.getElementById('completions');
+           list.replaceChildren();
+           for (const completion of (await response.text()).split('\n'))
+             if (completion) list.appendChild(new Option(completion));
+         });
+       </script>)");
 
   if (cgiFormSubmitClicked((char*)"search") == cgiFormSuccess) {
     char query[256];
@@ -37,18 +70,40 @@ int cgiMain() {
     cgiHtmlEscape(query);
     fprintf(cgiOut, "`</code>...</p>\n");
 
-    ppt::CodeSearchResults results =
-        ppt::codesearch(index_file, query, nthreads, block_size);
+    ppt::QueryCache cache(cache_file, cache_capacity);
+    ppt::CodeSearchResults results = ppt::codesearch(
+        index_file, query, nthreads, block_size, mmap, &cache);
 
     if (!results.error.empty()) {
       fprintf(cgiOut, "<p><b>");
       cgiHtmlEscape((char*)results.error.c_str());
       fprintf(cgiOut, "</b></p>");
+      if (!results.suggested_query.empty()) {
+        std::string url = "?search=Search&q=";
+        for (unsigned char c : results.suggested_query) {
+          if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            url += c;
+          } else {
+            char escaped[4];
+            snprintf(escaped, sizeof escaped, "%%%02X", c);
+            url += escaped;
+          }
+        }
+        fprintf(cgiOut, "<p>Search for <a href=\"");
+        cgiValueEscape((char*)url.c_str());
+        fprintf(cgiOut, "\"><code>`");
+        cgiHtmlEscape((char*)results.suggested_query.c_str());
+        fprintf(cgiOut, "`</code></a> instead.</p>");
+      }
     } else {
       fprintf(cgiOut,
               "<p>%lu source files searched.</p><p><b>%lu matches</b> "
-              "found.</p><p>Here is a random sample of matches...</p>",
+              "found",
               results.num_files, results.num_matches);
+      if (results.num_unique_matches != results.num_matches)
+        fprintf(cgiOut, ", %lu of them not in near duplicate files",
+                results.num_unique_matches);
+      fprintf(cgiOut, ".</p><p>Here is a random sample of matches...</p>");
 
       for (size_t i = 0; i < results.samples.size(); i++) {
         std::string relpath = results.samples[i].file.string().substr(5);
@@ -61,10 +116,25 @@ int cgiMain() {
 
         fprintf(cgiOut, "<p><pre>");
 
-        // uint32_t line = results.samples[i].first_line;
-        for (const std::string& line : results.samples[i].lines) {
+        const ppt::CodeSearchResults::Sample& sample = results.samples[i];
+        auto highlight = sample.highlights.begin();
+        for (size_t j = 0; j < sample.lines.size(); j++) {
+          const std::string& line = sample.lines[j];
+          uint32_t lineno = sample.first_line + j;
           fprintf(cgiOut, "    ");
-          cgiHtmlEscape((char*)line.c_str());
+          if (highlight != sample.highlights.end() &&
+              highlight->line == lineno) {
+            cgiHtmlEscapeData((char*)line.data(), highlight->begin_column);
+            fprintf(cgiOut, "<mark>");
+            cgiHtmlEscapeData((char*)line.data() + highlight->begin_column,
+                              highlight->end_column - highlight->begin_column);
+            fprintf(cgiOut, "</mark>");
+            cgiHtmlEscapeData((char*)line.data() + highlight->end_column,
+                              line.size() - highlight->end_column);
+            highlight++;
+          } else {
+            cgiHtmlEscape((char*)line.c_str());
+          }
           fprintf(cgiOut, "<br/>");
         }
         fprintf(cgiOut, "</pre></p>\n");
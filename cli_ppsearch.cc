@@ -1,26 +1,51 @@
 #include "ppsearch.h"
 
+#include <iostream>
+
 #include "dvc/opts.h"
 #include "dvc/program.h"
+#include "index_handle.h"
+#include "shard.h"
 
 namespace ppt {
 
-std::filesystem::path DVC_OPTION(index_file, -, dvc::required,
+std::filesystem::path DVC_OPTION(index_file, -, std::filesystem::path{},
                                  "input index file");
 
-std::string DVC_OPTION(query, q, dvc::required, "query");
+std::string DVC_OPTION(query, q, std::string{}, "query");
+
+bool DVC_OPTION(serve, -, false,
+                "instead of --query, answer queries read from stdin one per "
+                "line, reloading the index when it is replaced or on SIGHUP");
 
 size_t DVC_OPTION(nthreads, n, dvc::required, "number of threads");
 
 size_t DVC_OPTION(block_size, b, dvc::required, "number of blocks");
 
-void ppsearch(int argc, char** argv) {
-  dvc::program program(argc, argv);
+std::string DVC_OPTION(placement, -, "none",
+                       "numa placement: none, interleave or replicate");
 
-  CodeSearchResults results =
-      codesearch(index_file, query, nthreads, block_size);
-  if (!results.error.empty()) DVC_FAIL(results.error);
+std::string DVC_OPTION(residency, -, "mlock",
+                       "index residency: mlock, lazy, populate, advise, "
+                       "parallel_prefault, hugepage_copy or stream");
+
+size_t DVC_OPTION(prefault_threads, -, 8,
+                  "threads used to prefault or copy the index");
 
+size_t DVC_OPTION(stream_chunk_size, -, 16 << 20,
+                  "bytes per read when streaming the code section");
+
+std::filesystem::path DVC_OPTION(cache_file, -, std::filesystem::path{},
+                                 "persistent query result cache file");
+
+size_t DVC_OPTION(cache_capacity, -, 64 << 20,
+                  "maximum bytes of cached results");
+
+std::string DVC_OPTION(shards, -, std::string{},
+                       "comma-separated host:port list of ppshard workers to "
+                       "search instead of --index_file");
+
+void print_results(const CodeSearchResults& results) {
   for (size_t i = 0; i < results.samples.size(); i++) {
     DVC_DUMP(i);
     DVC_DUMP(results.samples[i].file);
@@ -29,9 +54,65 @@ void ppsearch(int argc, char** argv) {
     for (const std::string& line : results.samples[i].lines) {
       DVC_LOG("line: `", line, "`");
     }
+    for (const Highlight& highlight : results.samples[i].highlights)
+      DVC_LOG("highlight: line ", highlight.line, " columns [",
+              highlight.begin_column, ", ", highlight.end_column, ")");
   }
   DVC_DUMP(results.num_files);
   DVC_DUMP(results.num_matches);
+  DVC_DUMP(results.num_unique_matches);
+  DVC_DUMP(results.residency.ready_seconds);
+  DVC_DUMP(results.residency.length);
+  DVC_DUMP(results.residency.rss);
+  DVC_DUMP(results.residency.huge_bytes);
+  DVC_DUMP(results.residency.locked);
+  DVC_DUMP(results.residency.mmu_page_size);
+}
+
+void ppsearch(int argc, char** argv) {
+  dvc::program program(argc, argv);
+
+  mmap_options mmap;
+  mmap.residency = parse_residency_policy(residency);
+  mmap.numa = parse_numa_placement(placement);
+  mmap.prefault_threads = prefault_threads;
+  mmap.stream_chunk_size = stream_chunk_size;
+
+  std::optional<QueryCache> cache;
+  if (!cache_file.empty()) cache.emplace(cache_file, cache_capacity);
+  QueryCache* cache_ptr = cache ? &*cache : nullptr;
+
+  if (serve) {
+    IndexHandle handle(index_file, mmap);
+    handle.watch();
+    for (std::string line; std::getline(std::cin, line);) {
+      std::shared_ptr<Index> index = handle.get();
+      CodeSearchResults results =
+          codesearch(*index, line, nthreads, block_size, cache_ptr);
+      if (!results.error.empty())
+        DVC_ERROR(results.error);
+      else
+        print_results(results);
+    }
+    return;
+  }
+
+  if (!shards.empty()) {
+    std::vector<std::string> endpoints;
+    for (size_t begin = 0, end; begin <= shards.size(); begin = end + 1) {
+      end = std::min(shards.find(',', begin), shards.size());
+      endpoints.push_back(shards.substr(begin, end - begin));
+    }
+    CodeSearchResults results = shardsearch(endpoints, query);
+    if (!results.error.empty()) DVC_FAIL(results.error);
+    print_results(results);
+    return;
+  }
+
+  CodeSearchResults results =
+      codesearch(index_file, query, nthreads, block_size, mmap, cache_ptr);
+  if (!results.error.empty()) DVC_FAIL(results.error);
+  print_results(results);
 }
 
 }  // namespace ppt
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ppt {
+
+// Approximate matching of token spellings, for the token_trigrams section
+// (see index.h).
+
+// Only identifiers and keywords, at most this long, have trigrams.
+constexpr size_t max_trigram_spelling = 255;
+
+inline bool has_trigrams(std::string_view spelling) {
+  if (spelling.empty() || spelling.size() > max_trigram_spelling) return false;
+  auto identifier_char = [](unsigned char c) {
+    return c == '_' || c >= 0x80 || (c >= 'a' && c <= 'z') ||
+           (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+  };
+  if (spelling[0] >= '0' && spelling[0] <= '9') return false;
+  return std::all_of(spelling.begin(), spelling.end(), identifier_char);
+}
+
+// The distinct trigrams of `spelling` padded with \1 before and \2 after,
+// each packed big endian into the low 24 bits, in ascending order.
+inline std::vector<uint32_t> trigrams(std::string_view spelling) {
+  std::string padded = '\1' + std::string(spelling) + '\2';
+  std::vector<uint32_t> result;
+  for (size_t i = 0; i + 3 <= padded.size(); i++)
+    result.push_back(uint32_t((unsigned char)padded[i]) << 16 |
+                     uint32_t((unsigned char)padded[i + 1]) << 8 |
+                     uint32_t((unsigned char)padded[i + 2]));
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+// The key of the spellings of length `length` with trigram `trigram`.
+inline uint32_t trigram_key(uint32_t trigram, size_t length) {
+  return trigram << 8 | uint32_t(length);
+}
+
+// The optimal string alignment distance between `a` and `b` (insertions,
+// deletions, substitutions and transpositions of adjacent bytes), or
+// max_distance + 1 if it is more than max_distance.
+inline size_t edit_distance(std::string_view a, std::string_view b,
+                            size_t max_distance) {
+  if (a.size() > b.size()) std::swap(a, b);
+  if (b.size() - a.size() > max_distance) return max_distance + 1;
+  const size_t infinity = max_distance + 1;
+  thread_local std::vector<size_t> before, previous, current;
+  before.resize(b.size() + 1);
+  previous.resize(b.size() + 1);
+  current.resize(b.size() + 1);
+  for (size_t j = 0; j <= b.size(); j++) previous[j] = std::min(j, infinity);
+  for (size_t i = 1; i <= a.size(); i++) {
+    current[0] = std::min(i, infinity);
+    size_t row_min = current[0];
+    for (size_t j = 1; j <= b.size(); j++) {
+      size_t cost = a[i - 1] == b[j - 1] ? 0 : 1;
+      size_t d = std::min({previous[j] + 1, current[j - 1] + 1,
+                           previous[j - 1] + cost});
+      if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1])
+        d = std::min(d, before[j - 2] + 1);
+      current[j] = std::min(d, infinity);
+      row_min = std::min(row_min, current[j]);
+    }
+    if (row_min > max_distance) return infinity;
+    std::swap(before, previous);
+    std::swap(previous, current);
+  }
+  return previous[b.size()];
+}
+
+}  // namespace ppt
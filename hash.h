@@ -0,0 +1,39 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace ppt {
+
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+  __uint128_t r = __uint128_t(a ^ 0xa0761d6478bd642full) *
+                  (b ^ 0xe7037ed1a0b428dbull);
+  return uint64_t(r) ^ uint64_t(r >> 64);
+}
+
+// Fast non-cryptographic 64-bit hash, eight bytes at a time.  For
+// checksums and cache keys, not for anything adversarial.
+inline uint64_t hash64(const void* data, size_t length, uint64_t seed = 0) {
+  const unsigned char* p = (const unsigned char*)data;
+  uint64_t h = hash_mix(seed, length);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    uint64_t a, b;
+    std::memcpy(&a, p + i, 8);
+    std::memcpy(&b, p + i + 8, 8);
+    h = hash_mix(a ^ h, b);
+  }
+  uint64_t a = 0, b = 0;
+  std::memcpy(&a, p + i, std::min<size_t>(length - i, 8));
+  if (length - i > 8) std::memcpy(&b, p + i + 8, length - i - 8);
+  return hash_mix(h, hash_mix(a, b ^ length));
+}
+
+inline uint64_t hash64(std::string_view s, uint64_t seed = 0) {
+  return hash64(s.data(), s.size(), seed);
+}
+
+}  // namespace ppt
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "index_reader.h"
+#include "super_tokens.h"
+#include "token_codec.h"
+#include "tokenize.h"
+#include "vector_token_stream.h"
+
+namespace ppt {
+
+// Bytes [begin_column, end_column) of source line `line` (1-based).
+struct Highlight {
+  uint32_t line;
+  uint32_t begin_column, end_column;
+};
+
+// A VectorTokenStream that also records where each token is.
+struct PositionedTokenStream : VectorTokenStream {
+  void emit_token_range(uint32_t begin, uint32_t end) override {
+    ranges.emplace_back(begin, end);
+  }
+
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;  // [begin, end)
+};
+
+// Finds the matched tokens in lines [first, lines.size()) of a snippet,
+// or returns false if they cannot be aligned with the code section.
+inline bool highlight_from(idx::IndexReader& index, const std::byte* match,
+                           const MatchExtent& extent,
+                           const idx::IndexReader::FileLines& file_lines,
+                           const std::vector<std::string>& lines,
+                           size_t first, std::vector<Highlight>& highlights) {
+  std::string text;
+  std::vector<size_t> line_starts;
+  for (size_t i = first; i < lines.size(); i++) {
+    if (!line_starts.empty()) text += '\n';
+    line_starts.push_back(text.size());
+    text += lines[i];
+  }
+
+  PositionedTokenStream tokens;
+  try {
+    Tokenize(text, tokens);
+  } catch (std::exception& e) {
+    return false;
+  }
+  if (tokens.ranges.size() != tokens.tokens.size()) return false;
+
+  auto add = [&](size_t begin, size_t end) {
+    for (size_t i = 0; i < line_starts.size(); i++) {
+      size_t line_begin = line_starts[i];
+      size_t line_end = line_begin + lines[first + i].size();
+      size_t from = std::max(begin, line_begin);
+      size_t to = std::min(end, line_end);
+      if (from >= to) continue;
+      uint32_t lineno = file_lines.first_lineno + first + i;
+      if (!highlights.empty() && highlights.back().line == lineno)
+        highlights.back().end_column = to - line_begin;
+      else
+        highlights.push_back(
+            {lineno, uint32_t(from - line_begin), uint32_t(to - line_begin)});
+    }
+  };
+
+  size_t code_offset =
+      file_lines.file_info.code_offset + file_lines.lines[first].code_offset;
+  size_t match_offset = match - index.code;
+  if (code_offset > match_offset) return false;
+  std::vector<std::byte> buffer;
+  size_t length = match_offset + extent.length - code_offset;
+  const std::byte* code = index.code_bytes(code_offset, length, buffer);
+  const std::byte* code_end = code + length;
+  match = code + (match_offset - code_offset);
+  // The token ids from the first line, and which of them are matched.
+  std::vector<uint32_t> token_ids;
+  size_t match_begin = SIZE_MAX;
+  while (code < code_end) {
+    if (code == match) match_begin = token_ids.size() + extent.skip;
+    index.append_tokens(decode_token(code), token_ids);
+  }
+  if (match_begin == SIZE_MAX) return false;
+  size_t match_end = match_begin + extent.num_tokens;
+  if (match_end > token_ids.size() || match_end > tokens.tokens.size())
+    return false;
+  for (size_t i = 0; i < match_end; i++) {
+    const std::string& spelling = tokens.tokens[i].spelling;
+    if (index.spelling(token_ids[i]) != index.indexed_spelling(spelling))
+      return false;
+    if (i >= match_begin) add(tokens.ranges[i].first, tokens.ranges[i].second);
+  }
+  return true;
+}
+
+// Finds the matched tokens in a snippet, one range per line from the
+// start of the first matched token on that line to the end of the last.
+// `match` is where find_matches found the match, `extent` its extent (see
+// match_extent), and `lines` the snippet text of `file_lines`.
+//
+// The snippet alone is re-tokenized and its tokens are paired with the
+// token ids decoded from the code section at the snippet's first line,
+// so no per-token offsets are stored in the index.  If the spellings
+// disagree, as when the snippet begins inside a comment or raw string,
+// this is retried from the match line, and failing that there are no
+// highlights.
+inline std::vector<Highlight> highlight(
+    idx::IndexReader& index, const std::byte* match, const MatchExtent& extent,
+    const idx::IndexReader::FileLines& file_lines,
+    const std::vector<std::string>& lines) {
+  std::vector<Highlight> highlights;
+  if (lines.empty()) return highlights;
+  if (highlight_from(index, match, extent, file_lines, lines, 0, highlights))
+    return highlights;
+  highlights.clear();
+  size_t match_line = file_lines.match_lineno - file_lines.first_lineno;
+  if (match_line > 0 && match_line < lines.size() &&
+      highlight_from(index, match, extent, file_lines, lines, match_line,
+                     highlights))
+    return highlights;
+  return {};
+}
+
+}  // namespace ppt
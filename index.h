@@ -7,7 +7,7 @@ namespace ppt::idx {
 // 64-bit only
 static_assert(sizeof(size_t) == 8);
 
-// File starts with...
+// A version 2 file starts with...
 struct IndexHeader {
   std::array<char, 4> magic = {'p', 'p', 't', 'I'};
   uint32_t version = 2;
@@ -25,6 +25,75 @@ struct IndexHeader {
 static_assert(sizeof(IndexHeader) == 88);
 static_assert(alignof(IndexHeader) == 8);
 
+// A version 3 file instead starts with an IndexHeaderV3 (with the same
+// magic and version field), immediately followed by a directory of
+// num_sections SectionEntry records.  Each section starts on a
+// section_alignment boundary, and the code section on a
+// code_section_alignment boundary so that it can be mapped or copied
+// onto huge pages and read with O_DIRECT.  Sections are described below
+// by the IndexHeader field that locates them in version 2; the layout
+// within each is the same in both versions, and offsets stored inside
+// sections are start-of-file relative in both.
+struct IndexHeaderV3 {
+  std::array<char, 4> magic = {'p', 'p', 't', 'I'};
+  uint32_t version = 3;
+  size_t num_files;
+  size_t total_tokens;
+  size_t total_lines;
+  size_t total_bytes;
+  size_t num_tokens;
+  size_t section_alignment;
+  size_t code_section_alignment;
+  size_t checksum_chunk_size;
+  uint32_t num_sections;
+  uint32_t flags = 0;
+  uint64_t directory_checksum;  // hash64 of the directory
+};
+static_assert(sizeof(IndexHeaderV3) == 88);
+
+// IndexHeaderV3 flags.  With canonical_tokens, each alternative token and
+// digraph (see CanonicalSpelling in tokenize.h) is indexed as the token it
+// stands for, and has no token id of its own.
+constexpr uint32_t canonical_tokens = 1;
+
+enum class SectionType : uint32_t {
+  code = 1,                // code_section_offset
+  files = 2,               // file_section_offset
+  token_ids = 3,           // token_id_section_offset
+  token_alphabetical = 4,  // token_alphabetical_section_offset
+  lines = 5,               // the LineInfo arrays of all files
+  filenames = 6,           // the C strings of FileInfo.filename_cstr
+  spellings = 7,           // the C strings of TokenIdInfo.spelling_cstr
+  source = 8,              // see SourceSectionHeader
+  line_table = 9,          // see LineTableHeader; replaces lines
+  paths = 10,              // see PathDictionaryHeader; replaces filenames
+  token_hash = 11,         // see TokenHashHeader
+  token_trigrams = 12,     // see TokenTrigramHeader
+  next_tokens = 13,        // see NextTokenHeader
+  code_blocks = 14,        // see CodeBlocksHeader; replaces code
+  super_tokens = 15,       // see SuperTokenHeader
+  token_kinds = 16,        // see TokenKindInfo
+  file_clusters = 17,      // see FileInfo
+  include_graph = 18,      // see IncludeGraphHeader
+};
+
+// A section a reader does not know may be ignored if it is optional;
+// otherwise the reader must refuse the file.
+constexpr uint32_t section_optional = 1;
+
+// The checksum of a section is the hash64 (see hash.h), seeded with the
+// section type, of the array of hash64s of each checksum_chunk_size chunk
+// of the section, each seeded with its chunk index.  So chunks can be
+// verified in parallel, and any one section without the others.
+struct SectionEntry {
+  SectionType type;
+  uint32_t flags;
+  size_t offset;  // start-of-file relative
+  size_t length;  // bytes
+  uint64_t checksum;
+};
+static_assert(sizeof(SectionEntry) == 32);
+
 // At code_section_offset there is an array of code_section_length bytes
 // that is the encoded source code of the dataset.  The encoding is
 // a variable-length encoding of the token ids of the sequence of tokens
@@ -37,9 +106,43 @@ static_assert(alignof(IndexHeader) == 8);
 // basis without logical error.  For details of the code section encoding
 // see token_codec.h
 
+// Version 3 files may instead have a code_blocks section, which starts
+// with a CodeBlocksHeader, then an array of num_blocks + 1 size_t block
+// offsets (start-of-file relative), then the blocks.  Block i holds code
+// bytes [i * block_size, (i + 1) * block_size) compressed as the blocks of
+// the source section are (see SourceSectionHeader).  Offsets into the code
+// section elsewhere in the index are offsets into the uncompressed code.
+struct CodeBlocksHeader {
+  size_t code_length;
+  size_t block_size;
+  size_t num_blocks;
+};
+static_assert(sizeof(CodeBlocksHeader) == 24);
+
+// With a super_tokens section, the code section instead encodes code ids,
+// each of which stands for either one token or a run of several tokens (a
+// super token) that often occur together within a line.  Each line is
+// encoded greedily, with the longest super token that starts at each
+// point, so super tokens never span lines and LineInfo.code_offset is
+// still the start of the line's code.  Lower code ids are again assigned
+// to more frequent codes.  The section is a SuperTokenHeader, then
+// num_tokens + 1 uint32_t code ids, that of each token id alone (0 for
+// EOF), then num_super uint32_t code ids, that of each super token, then
+// num_codes + 1 uint32_t units, that of each code id, then num_super + 1
+// uint32_t offsets, then the uint32_t token ids of the super tokens.  A
+// unit is the code id's token id, or super_token_unit | i for super token
+// i, whose token ids are [offsets[i], offsets[i + 1]).
+struct SuperTokenHeader {
+  uint32_t num_codes;
+  uint32_t num_super;
+};
+static_assert(sizeof(SuperTokenHeader) == 8);
+
+constexpr uint32_t super_token_unit = uint32_t(1) << 31;
+
 // At file_section_offset there is an array of num_files FileInfo...
 struct FileInfo {
-  size_t filename_cstr;  // offset start-of-file relative (C string)
+  size_t filename_cstr;  // offset start-of-file relative (C string), or 0
   size_t file_length;
   size_t code_offset;  // relative to IndexHeader.code_section_offset
   size_t code_length;  // bytes
@@ -49,6 +152,11 @@ struct FileInfo {
 static_assert(sizeof(FileInfo) == 48);
 static_assert(alignof(FileInfo) == 8);
 
+// An optional file_clusters section is an array of num_files uint32_t,
+// the cluster of each file in FileInfo order: the index of the first file
+// of its cluster, which it is a near duplicate of (by the similarity of
+// their token 4-grams), or its own index if it is the first.
+
 // At token_id_section_offset there is an array of num_tokens TokenInfo
 // in token id order.  The first is token id 1 (token id 0 means EOF)
 struct TokenIdInfo {
@@ -61,11 +169,157 @@ struct TokenAlphabeticalInfo {
   uint32_t token_id;
 };
 
-// At each FileInfo.lineinfo_offset there is an array of FileInfo.num_lines
+// An optional token_hash section is a minimal perfect hash from spelling
+// to token id: a TokenHashHeader, then num_buckets uint32_t displacements,
+// then num_tokens TokenHashSlots.  A spelling with hash64 h (seeded with
+// seed) is in bucket token_hash_bucket(h) and, if present, in slot
+// token_hash_slot(h, the bucket's displacement); see index_reader.h.  The
+// slot's fingerprint is the low 32 bits of h.
+struct TokenHashHeader {
+  uint32_t num_buckets;
+  uint32_t reserved = 0;
+  uint64_t seed;
+};
+static_assert(sizeof(TokenHashHeader) == 16);
+
+struct TokenHashSlot {
+  uint32_t token_id;
+  uint32_t fingerprint;
+};
+
+// An optional token_trigrams section indexes the identifier and keyword
+// spellings (see has_trigrams in fuzzy.h) for approximate lookup.  It is
+// a TokenTrigramHeader, then num_keys ascending uint32_t keys, then
+// num_keys + 1 uint32_t posting offsets, then num_postings uint32_t token
+// ids.  Key trigram_key(t, n) is present if some spelling of length n has
+// trigram t (see fuzzy.h), and the ids of those spellings are postings
+// [offsets[i], offsets[i + 1]) of the key at i, in ascending order.
+struct TokenTrigramHeader {
+  uint32_t num_keys;
+  uint32_t num_postings;
+};
+static_assert(sizeof(TokenTrigramHeader) == 8);
+
+// An optional next_tokens section holds the tokens that most often follow
+// each token, and each frequent pair of tokens, in the code section.  It
+// is a NextTokenHeader, then num_contexts NextTokenContexts in ascending
+// order, then num_contexts + 1 uint32_t offsets, then num_next NextTokens.
+// The tokens that follow context i are [offsets[i], offsets[i + 1]), most
+// frequent first.  A context of one token has second == 0.
+struct NextTokenHeader {
+  uint32_t num_contexts;
+  uint32_t num_next;
+};
+static_assert(sizeof(NextTokenHeader) == 8);
+
+struct NextTokenContext {
+  uint32_t first, second;  // token ids
+};
+
+struct NextToken {
+  uint32_t token_id;
+  uint32_t count;  // occurrences after the context, saturating
+};
+
+// An optional token_kinds section is an array of num_tokens + 1
+// TokenKindInfo, that of each token id (EOF's is zeroed).  kind is the
+// TokenKind (see vector_token_stream.h) the token was tokenized as, other
+// than HEADER_NAME if it also occurs as another kind, and then flags says
+// so.  Token classes can be tested with these without the spellings.
+struct TokenKindInfo {
+  uint8_t kind;
+  uint8_t flags;
+};
+static_assert(sizeof(TokenKindInfo) == 2);
+
+constexpr uint8_t token_keyword = 1;      // spelled as a C++ keyword
+constexpr uint8_t token_header_name = 2;  // occurs as a header name
+
+// An optional include_graph section holds the header names each file
+// includes, as token ids (the spelling with its delimiters, as in <vector>
+// or "foo.h").  It is an IncludeGraphHeader, then:
+//
+//   num_files + 1 uint32_t include offsets, then num_edges header ids,
+//   the headers file i includes at [offsets[i], offsets[i + 1]) ascending;
+//
+//   num_headers ascending header ids, then num_headers + 1 uint32_t
+//   includer offsets, then num_edges file indexes, the files that include
+//   the header at i at [offsets[i], offsets[i + 1]) ascending;
+//
+//   num_headers + 1 uint32_t resolved offsets, then num_resolved file
+//   indexes, the files the header at i may name at [offsets[i],
+//   offsets[i + 1]) ascending: those whose path ends with "/" and the
+//   spelling between the delimiters, less any leading "./" and "../".
+struct IncludeGraphHeader {
+  uint32_t num_headers;
+  uint32_t num_edges;
+  uint32_t num_resolved;
+  uint32_t reserved = 0;
+};
+static_assert(sizeof(IncludeGraphHeader) == 16);
+
+// In version 2, and in version 3 files with a lines section, at each
+// FileInfo.lineinfo_offset there is an array of FileInfo.num_lines
 // LineInfo records.
 struct LineInfo {
   uint32_t file_offset;  // relative to start of source file
   uint32_t code_offset;  // relative to start of code for file in code section
 };
 
+// Version 3 files may instead have a line_table section, which starts
+// with a LineTableHeader.  At each FileInfo.lineinfo_offset (4-aligned,
+// within the section) there is then an array of
+//
+//   ceil(FileInfo.num_lines / checkpoint_interval)
+//
+// LineCheckpoint records, the LineInfo of every checkpoint_interval'th
+// line, followed by the varint (see varint.h) deltas of the file_offset
+// and then code_offset of each other line from the line before it.
+// The deltas of the lines after checkpoint i start delta_offset bytes
+// after the end of the checkpoint array.
+struct LineTableHeader {
+  uint32_t checkpoint_interval;
+  uint32_t reserved = 0;
+};
+static_assert(sizeof(LineTableHeader) == 8);
+
+struct LineCheckpoint {
+  uint32_t file_offset;
+  uint32_t code_offset;
+  uint32_t delta_offset;
+};
+static_assert(sizeof(LineCheckpoint) == 12);
+
+// Version 3 files may instead have a paths section, in which case every
+// FileInfo.filename_cstr is 0.  It starts with a PathDictionaryHeader,
+// then an array of num_files uint32_t ranks, the position of each file's
+// path (in FileInfo order) among all paths sorted bytewise, then the
+// inverse array of num_files uint32_t file indexes in path order, then an
+// array of num_buckets + 1 size_t bucket offsets (start-of-file
+// relative), then the buckets.  Bucket i front-codes the paths of ranks
+// [i * bucket_size, (i + 1) * bucket_size): the first as its varint
+// length and bytes, and each other as the varint length of the prefix it
+// shares with the path before it, the varint length of the rest, and the
+// rest.
+struct PathDictionaryHeader {
+  uint32_t bucket_size;
+  uint32_t num_buckets;
+};
+static_assert(sizeof(PathDictionaryHeader) == 8);
+
+// The source section starts with a SourceSectionHeader, then an array
+// of num_files size_t text offsets (the start of each file's source in
+// the concatenated text of all files, in FileInfo order), then an array
+// of num_blocks + 1 size_t block offsets (start-of-file relative), then
+// the blocks.  Block i holds text bytes [i * block_size, (i + 1) *
+// block_size) compressed with lz_compress (see lz.h), or stored verbatim
+// if that would not be smaller, which is the case exactly when its
+// stored length equals its text length.
+struct SourceSectionHeader {
+  size_t text_length;
+  size_t block_size;
+  size_t num_blocks;
+};
+static_assert(sizeof(SourceSectionHeader) == 24);
+
 }  // namespace ppt::idx
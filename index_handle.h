@@ -0,0 +1,196 @@
+#pragma once
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "dvc/log.h"
+#include "ppsearch.h"
+
+namespace ppt {
+
+// Why the index file at `path` cannot be read, or empty if it can; see
+// idx::check_index.  Reported rather than failed on.
+inline std::string check_index_file(const std::filesystem::path& path,
+                                    size_t nthreads) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return dvc::concat("Unable to open: ", strerror(errno));
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    std::string error = dvc::concat("Unable to stat: ", strerror(errno));
+    ::close(fd);
+    return error;
+  }
+  size_t length = st.st_size;
+  if (length == 0) {
+    ::close(fd);
+    return "Index truncated";
+  }
+  void* addr = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  int mmap_errno = errno;
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return dvc::concat("Unable to mmap: ", strerror(mmap_errno));
+  std::string error = idx::check_index({(const char*)addr, length},
+                                       std::max<size_t>(nthreads, 1));
+  ::munmap(addr, length);
+  return error;
+}
+
+// RCU-style handle to the current Index.  Each query takes a reference
+// with get() and keeps using that Index even if a reload swaps in a new
+// one meanwhile; an Index is unmapped when its last reference drops.
+// reload() checks, maps and prefaults the new index fully before
+// publishing it, so queries never wait on it, and keeps the current index
+// if the new one is truncated or corrupt.
+class IndexHandle {
+ public:
+  IndexHandle(const std::filesystem::path& path,
+              const mmap_options& options = {})
+      : path(path), options(options) {
+    current = open();
+  }
+
+  std::shared_ptr<Index> get() const {
+    std::lock_guard lock(mu);
+    return current;
+  }
+
+  // Swaps in the index now at `path`, unless it cannot be read, in which
+  // case that is logged and the current index is kept.
+  void reload() {
+    DVC_LOG("Reloading index ", path);
+    std::string error = check_index_file(path, options.prefault_threads);
+    if (!error.empty()) {
+      DVC_ERROR("Keeping the current index: ", path, ": ", error);
+      return;
+    }
+    std::shared_ptr<Index> index;
+    try {
+      index = open();
+    } catch (std::exception& e) {
+      DVC_ERROR("Keeping the current index: ", path, ": ", e.what());
+      return;
+    }
+    // Dropped outside the lock: unmapping can be slow.
+    std::shared_ptr<Index> old;
+    {
+      std::lock_guard lock(mu);
+      old = std::move(current);
+      current = std::move(index);
+    }
+    DVC_LOG("Reloaded index ", path);
+  }
+
+  // Starts a thread that calls reload() whenever the index file is
+  // replaced or rewritten, or the process receives `reload_signal`
+  // (0 for none).  Replace the index with a rename (as ppindex does) so
+  // the watcher never sees a half-written file.
+  void watch(int reload_signal = SIGHUP) {
+    DVC_ASSERT(!watcher.joinable(), "Already watching ", path);
+    DVC_ASSERT_EQ(0, ::pipe(wake_pipe), "pipe failed: ", strerror(errno));
+    inotify_fd = ::inotify_init1(IN_CLOEXEC);
+    DVC_ASSERT_NE(inotify_fd, -1, "inotify_init1 failed: ", strerror(errno));
+    std::filesystem::path dir = path.parent_path().empty()
+                                    ? std::filesystem::path(".")
+                                    : path.parent_path();
+    DVC_ASSERT_NE(-1,
+                  ::inotify_add_watch(inotify_fd, dir.c_str(),
+                                      IN_CLOSE_WRITE | IN_MOVED_TO),
+                  "Unable to watch ", dir, ": ", strerror(errno));
+    if (reload_signal != 0) {
+      // The handler has one pipe to write to, so one handle per process.
+      int none = -1;
+      DVC_ASSERT(signal_pipe.compare_exchange_strong(none, wake_pipe[1]),
+                 "Another IndexHandle already reloads on signals");
+      struct sigaction action = {};
+      action.sa_handler = [](int) {
+        char c = 'r';
+        int fd = signal_pipe;
+        if (fd != -1) (void)!::write(fd, &c, 1);
+      };
+      action.sa_flags = SA_RESTART;
+      DVC_ASSERT_EQ(0, ::sigaction(reload_signal, &action, nullptr),
+                    "sigaction failed: ", strerror(errno));
+    }
+    watcher = std::thread([this] { watch_loop(); });
+  }
+
+  ~IndexHandle() {
+    if (!watcher.joinable()) return;
+    char c = 'q';
+    DVC_ASSERT_EQ(1, ::write(wake_pipe[1], &c, 1));
+    watcher.join();
+    int ours = wake_pipe[1];
+    signal_pipe.compare_exchange_strong(ours, -1);
+    ::close(inotify_fd);
+    ::close(wake_pipe[0]);
+    ::close(wake_pipe[1]);
+  }
+
+ private:
+  // Handles serve many queries, so their indexes keep MatchSets to refine
+  // queries from; see refine_matches.
+  std::shared_ptr<Index> open() const {
+    auto index = std::make_shared<Index>(path, options);
+    index->match_sets.emplace();
+    return index;
+  }
+
+  void watch_loop() {
+    alignas(inotify_event) char buf[4096];
+    while (true) {
+      pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+      if (::poll(fds, 2, -1) < 0) {
+        DVC_ASSERT_EQ(errno, EINTR, "poll failed: ", strerror(errno));
+        continue;
+      }
+      bool changed = false;
+      if (fds[1].revents & POLLIN) {
+        char c;
+        DVC_ASSERT_EQ(1, ::read(wake_pipe[0], &c, 1));
+        if (c == 'q') return;
+        changed = true;
+      }
+      if (fds[0].revents & POLLIN) {
+        ssize_t n = ::read(inotify_fd, buf, sizeof buf);
+        DVC_ASSERT_GT(n, 0, "inotify read failed: ", strerror(errno));
+        for (char* p = buf; p < buf + n;) {
+          const inotify_event* event = (const inotify_event*)p;
+          if (event->len > 0 && path.filename() == event->name) changed = true;
+          p += sizeof(inotify_event) + event->len;
+        }
+      }
+      if (changed) reload();
+    }
+  }
+
+  const std::filesystem::path path;
+  const mmap_options options;
+
+  mutable std::mutex mu;
+  std::shared_ptr<Index> current;
+
+  std::thread watcher;
+  int inotify_fd = -1;
+  int wake_pipe[2] = {-1, -1};
+  // The wake_pipe of the handle that reloads on signals, if any.
+  static inline std::atomic<int> signal_pipe = -1;
+
+  IndexHandle(IndexHandle&&) = delete;
+  IndexHandle(const IndexHandle&) = delete;
+};
+
+}  // namespace ppt
@@ -1,36 +1,192 @@
 #pragma once
 
+#include <sys/mman.h>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <initializer_list>
+#include <mutex>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
 
+#include "fuzzy.h"
+#include "hash.h"
 #include "index.h"
+#include "lz.h"
+#include "tokenize.h"
+#include "varint.h"
 
 #include "dvc/log.h"
+#include "dvc/string.h"
 
 namespace ppt::idx {
 
 class File;
 
+// The checksum of a section (see SectionEntry), hashing its chunks on up
+// to `nthreads` threads.
+inline uint64_t section_checksum(SectionType type, const std::byte* data,
+                                 size_t length, size_t chunk_size,
+                                 size_t nthreads) {
+  size_t num_chunks = (length + chunk_size - 1) / chunk_size;
+  std::vector<uint64_t> chunk_hashes(num_chunks);
+  std::atomic_size_t next_chunk = 0;
+  auto worker = [&] {
+    for (size_t i = next_chunk++; i < num_chunks; i = next_chunk++)
+      chunk_hashes[i] =
+          hash64(data + i * chunk_size,
+                 std::min(chunk_size, length - i * chunk_size), i);
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(nthreads, num_chunks); i++)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread& t : threads) t.join();
+  return hash64(chunk_hashes.data(), num_chunks * sizeof(uint64_t),
+                uint64_t(type));
+}
+
+// Why `index` cannot be read, or empty if it can.  The header and the
+// bounds of each section are checked, and for version 3 the directory and
+// the checksum of each section, on up to `nthreads` threads.  IndexReader
+// fails on a truncated or corrupt index; this reports it instead, so that
+// a server can keep serving the index it has.
+inline std::string check_index(std::string_view index, size_t nthreads) {
+  if (index.size() < sizeof(IndexHeader)) return "Index truncated";
+  IndexHeader header;
+  ::memcpy(&header, index.data(), sizeof header);
+  if (header.magic != IndexHeader{}.magic) return "Not an index";
+  auto fits = [&](size_t offset, size_t length) {
+    return offset <= index.size() && length <= index.size() - offset;
+  };
+  if (header.version == 2) {
+    if (!fits(header.code_section_offset, header.code_section_length) ||
+        !fits(header.file_section_offset,
+              header.num_files * sizeof(FileInfo)) ||
+        !fits(header.token_id_section_offset,
+              header.num_tokens * sizeof(TokenIdInfo)) ||
+        !fits(header.token_alphabetical_section_offset,
+              header.num_tokens * sizeof(TokenAlphabeticalInfo)))
+      return "Index truncated";
+    return "";
+  }
+  if (header.version != 3)
+    return dvc::concat("Unsupported index version ", header.version);
+
+  if (index.size() < sizeof(IndexHeaderV3)) return "Index truncated";
+  IndexHeaderV3 header3;
+  ::memcpy(&header3, index.data(), sizeof header3);
+  size_t directory_length = header3.num_sections * sizeof(SectionEntry);
+  if (!fits(sizeof(IndexHeaderV3), directory_length)) return "Index truncated";
+  std::vector<SectionEntry> sections(header3.num_sections);
+  ::memcpy(sections.data(), index.data() + sizeof(IndexHeaderV3),
+           directory_length);
+  if (hash64(sections.data(), directory_length) !=
+      header3.directory_checksum)
+    return "Corrupt index section directory";
+  if (header3.checksum_chunk_size == 0) return "Corrupt index header";
+  uint32_t found = 0;
+  for (const SectionEntry& section : sections) {
+    uint32_t type = uint32_t(section.type);
+    if (!fits(section.offset, section.length)) return "Index truncated";
+    if (type < 32) found |= 1u << type;
+    if ((type == 0 || type > uint32_t(SectionType::include_graph)) &&
+        !(section.flags & section_optional))
+      return dvc::concat("Index needs a newer reader for section type ",
+                         type);
+    if (section_checksum(section.type,
+                         (const std::byte*)index.data() + section.offset,
+                         section.length, header3.checksum_chunk_size,
+                         nthreads) != section.checksum)
+      return dvc::concat("Checksum mismatch in section type ", type);
+  }
+  auto has = [&](std::initializer_list<SectionType> types) {
+    for (SectionType type : types)
+      if (found & (1u << uint32_t(type))) return true;
+    return false;
+  };
+  for (SectionType required :
+       {SectionType::files, SectionType::token_ids,
+        SectionType::token_alphabetical, SectionType::spellings})
+    if (!has({required}))
+      return dvc::concat("Index lacks section type ", uint32_t(required));
+  if (!has({SectionType::code, SectionType::code_blocks}))
+    return "Index lacks a code section";
+  if (!has({SectionType::lines, SectionType::line_table}))
+    return "Index lacks a line section";
+  if (!has({SectionType::filenames, SectionType::paths}))
+    return "Index lacks a path section";
+  return "";
+}
+
+// The token hash (see TokenHashHeader) bucket of a spelling with hash `h`.
+inline size_t token_hash_bucket(uint64_t h, size_t num_buckets) {
+  return ((h >> 32) * num_buckets) >> 32;
+}
+
+// Displacements with the high bit set place the single spelling of their
+// bucket directly in the slot given by the other bits.
+constexpr uint32_t token_hash_direct = uint32_t(1) << 31;
+
+// The token hash slot of a spelling with hash `h` in a bucket with
+// displacement `displacement`.
+inline size_t token_hash_slot(uint64_t h, uint32_t displacement,
+                              size_t num_slots) {
+  if (displacement & token_hash_direct)
+    return displacement & ~token_hash_direct;
+  return (uint64_t(uint32_t(hash_mix(h, displacement))) * num_slots) >> 32;
+}
+
 class IndexReader {
  public:
-  IndexReader(std::string_view index)
-      : index_(index), header_(to_ptr<IndexHeader>(0)) {
-    DVC_ASSERT(IndexHeader{}.magic == header_->magic);
-    DVC_ASSERT_EQ(IndexHeader{}.version, header_->version);
-    file_infos = to_ptr<FileInfo>(header_->file_section_offset);
-    num_files = header_->num_files;
-
-    token_ids = to_ptr<TokenIdInfo>(header_->token_id_section_offset);
-    token_alphas = to_ptr<TokenAlphabeticalInfo>(
-        header_->token_alphabetical_section_offset);
-    num_tokens = header_->num_tokens;
+  // Reads version 2 and 3 indexes.  Opening only reads the header and,
+  // for version 3, checks the section directory; see verify().
+  IndexReader(std::string_view index) : index_(index) {
+    DVC_ASSERT_GE(index_.size(), sizeof(IndexHeader), "Index truncated");
+    const IndexHeader* header = to_ptr<IndexHeader>(0);
+    DVC_ASSERT(IndexHeader{}.magic == header->magic, "Not an index");
+    version = header->version;
+    if (version == 2)
+      read_v2(*header);
+    else if (version == 3)
+      read_v3();
+    else
+      DVC_FAIL("Unsupported index version ", version);
+  }
+
+  ~IndexReader() {
+    if (code_blocks_) ::munmap((void*)code, code_reservation_length_);
+  }
+
+  uint32_t version;
 
-    code = to_ptr<std::byte>(header_->code_section_offset);
-    code_length = header_->code_section_length;
+  // The section directory; empty for version 2.
+  const SectionEntry* sections = nullptr;
+  size_t num_sections = 0;
+  uint64_t directory_checksum = 0;
 
-    total_bytes = header_->total_bytes;
-    total_tokens = header_->total_tokens;
-    total_lines = header_->total_lines;
+  // Checks the checksum of each section, or just of those of `types` if
+  // given, each on up to `nthreads` threads.  Returns a description of
+  // each mismatch.  Version 2 indexes have no checksums.
+  std::vector<std::string> verify(size_t nthreads,
+                                  const std::vector<SectionType>& types = {}) {
+    std::vector<std::string> errors;
+    for (size_t i = 0; i < num_sections; i++) {
+      const SectionEntry& section = sections[i];
+      if (!types.empty() &&
+          std::find(types.begin(), types.end(), section.type) == types.end())
+        continue;
+      uint64_t checksum = section_checksum(
+          section.type, to_ptr<std::byte>(section.offset), section.length,
+          checksum_chunk_size_, nthreads);
+      if (checksum != section.checksum)
+        errors.push_back(dvc::concat("Checksum mismatch in section ", i,
+                                     " (type ", uint32_t(section.type), ")"));
+    }
+    return errors;
   }
 
   const FileInfo* file_infos;
@@ -41,15 +197,101 @@ class IndexReader {
   size_t total_lines;
 
   std::filesystem::path filename(const FileInfo& file_info) {
-    return cstr(file_info.filename_cstr);
+    if (!path_header_) return cstr(file_info.filename_cstr);
+    std::string path;
+    for_each_path(path_ranks_[&file_info - file_infos],
+                  [&](size_t, const std::string& p) {
+                    path = p;
+                    return false;
+                  });
+    return path;
+  }
+
+  // The file whose path is the `rank`th in bytewise order.
+  const FileInfo& file_by_rank(size_t rank) {
+    DVC_ASSERT_LT(rank, num_files);
+    if (path_header_) return file_infos[path_files_[rank]];
+    build_path_order();
+    return file_infos[path_order_[rank]];
   }
 
+  // The ranks [begin, end) of the paths that start with `prefix`, so with
+  // a trailing '/' the files under a directory.
+  std::pair<size_t, size_t> prefix_range(std::string_view prefix) {
+    size_t begin = partition_rank(
+        [&](std::string_view path) { return path < prefix; });
+    size_t end = partition_rank([&](std::string_view path) {
+      return path < prefix || path.substr(0, prefix.size()) == prefix;
+    });
+    return {begin, end};
+  }
+
+  // The position of the code of `file_info`, unreadable if the code
+  // section is compressed; see code.
   const std::byte* filecode(const FileInfo& file_info) {
     return code + file_info.code_offset;
   }
 
-  const LineInfo* line_infos(const FileInfo& file_info) {
-    return to_ptr<LineInfo>(file_info.lineinfo_offset);
+  // Lines [first, first + count) of `file_info`, decoded from the line
+  // table if the index has one.
+  std::vector<LineInfo> line_infos(const FileInfo& file_info, size_t first,
+                                   size_t count) {
+    DVC_ASSERT_LE(first + count, file_info.num_lines);
+    std::vector<LineInfo> lines;
+    lines.reserve(count);
+    if (count > 0)
+      for_each_line(file_info, first, [&](size_t, const LineInfo& line) {
+        lines.push_back(line);
+        return lines.size() < count;
+      });
+    return lines;
+  }
+
+  std::vector<LineInfo> line_infos(const FileInfo& file_info) {
+    return line_infos(file_info, 0, file_info.num_lines);
+  }
+
+  LineInfo line_info(const FileInfo& file_info, size_t i) {
+    return line_infos(file_info, i, 1)[0];
+  }
+
+  // Whether the index has a source section (ppindex --store_source).
+  bool has_source() { return source_header_ != nullptr; }
+
+  // Bytes [begin, end) of the source file of `file_info`, decompressed
+  // from the source section.
+  std::string source(const FileInfo& file_info, size_t begin, size_t end) {
+    DVC_ASSERT(has_source());
+    DVC_ASSERT_LE(begin, end);
+    DVC_ASSERT_LE(end, file_info.file_length);
+    size_t block_size = source_header_->block_size;
+    size_t text_begin = source_text_offsets_[&file_info - file_infos] + begin;
+    size_t text_end = text_begin + (end - begin);
+
+    std::string result;
+    result.reserve(end - begin);
+    std::string decompressed;
+    for (size_t block = text_begin / block_size; block * block_size < text_end;
+         block++) {
+      size_t block_begin = block * block_size;
+      size_t block_length =
+          std::min(block_size, source_header_->text_length - block_begin);
+      const char* stored = to_ptr<char>(source_block_offsets_[block]);
+      size_t stored_length =
+          source_block_offsets_[block + 1] - source_block_offsets_[block];
+      const char* text = stored;
+      if (stored_length != block_length) {
+        decompressed.resize(block_length);
+        DVC_ASSERT(lz_decompress(stored, stored_length, decompressed.data(),
+                                 block_length),
+                   "Corrupt source block ", block);
+        text = decompressed.data();
+      }
+      size_t from = std::max(text_begin, block_begin) - block_begin;
+      size_t to = std::min(text_end, block_begin + block_length) - block_begin;
+      result.append(text + from, to - from);
+    }
+    return result;
   }
 
   const TokenIdInfo* token_ids;
@@ -63,7 +305,33 @@ class IndexReader {
     return cstr(token_ids[i].spelling_cstr);
   }
 
+  // Whether alternative tokens and digraphs are indexed as the tokens they
+  // stand for; see idx::canonical_tokens.
+  bool has_canonical_tokens() { return canonical_tokens_; }
+
+  // The spelling that a token spelled `token_spelling` is indexed as.
+  std::string_view indexed_spelling(std::string_view token_spelling) {
+    return canonical_tokens_ ? CanonicalSpelling(token_spelling)
+                             : token_spelling;
+  }
+
+  // With a token_hash section, one slot probe and one spelling compare;
+  // otherwise a binary search of token_alphas.  Alternative tokens and
+  // digraphs are looked up as indexed_spelling().
   uint32_t token_id(std::string_view token_spelling) {
+    token_spelling = indexed_spelling(token_spelling);
+    if (token_hash_) {
+      if (num_tokens == 0) return 0;
+      uint64_t h = hash64(token_spelling, token_hash_->seed);
+      uint32_t displacement = token_hash_displacements_[token_hash_bucket(
+          h, token_hash_->num_buckets)];
+      const TokenHashSlot& slot =
+          token_hash_slots_[token_hash_slot(h, displacement, num_tokens)];
+      if (slot.fingerprint != uint32_t(h) ||
+          spelling(slot.token_id) != token_spelling)
+        return 0;
+      return slot.token_id;
+    }
     const TokenAlphabeticalInfo* candidate =
         std::partition_point(token_alphas, token_alphas + num_tokens,
                              [&](const TokenAlphabeticalInfo& info) {
@@ -77,25 +345,959 @@ class IndexReader {
       return 0;
   }
 
+  struct SimilarToken {
+    uint32_t token_id;
+    uint32_t distance;  // see edit_distance in fuzzy.h
+  };
+
+  // Up to `max_results` identifier or keyword tokens whose spelling is
+  // within edit distance 1 of `spelling` (2 if it is longer than 8), by
+  // distance and then by frequency.  Spellings of up to
+  // max_enumerated_spelling bytes try every ASCII spelling at distance 1.
+  // Longer ones take the candidates that share enough trigrams from the
+  // token_trigrams section, and have no similar tokens without one.
+  std::vector<SimilarToken> similar_tokens(std::string_view spelling,
+                                           size_t max_results) {
+    if (!has_trigrams(spelling)) return {};
+    std::vector<SimilarToken> result;
+    auto finish = [&] {
+      std::sort(result.begin(), result.end(),
+                [](const SimilarToken& a, const SimilarToken& b) {
+                  return std::tie(a.distance, a.token_id) <
+                         std::tie(b.distance, b.token_id);
+                });
+      result.erase(std::unique(result.begin(), result.end(),
+                               [](const SimilarToken& a,
+                                  const SimilarToken& b) {
+                                 return a.token_id == b.token_id;
+                               }),
+                   result.end());
+      if (result.size() > max_results) result.resize(max_results);
+      return result;
+    };
+    if (spelling.size() <= max_enumerated_spelling) {
+      static constexpr std::string_view alphabet =
+          "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+      std::string edited;
+      auto try_edited = [&](std::string_view a, std::string_view b,
+                            std::string_view c = {}, std::string_view d = {}) {
+        edited.assign(a).append(b).append(c).append(d);
+        if (!has_trigrams(edited)) return;
+        if (uint32_t token_id = this->token_id(edited))
+          result.push_back({token_id, 1});
+      };
+      for (size_t i = 0; i <= spelling.size(); i++) {
+        std::string_view before = spelling.substr(0, i);
+        std::string_view after = spelling.substr(i);
+        for (const char& c : alphabet) {
+          try_edited(before, {&c, 1}, after);  // insertion
+          if (!after.empty())
+            try_edited(before, {&c, 1}, after.substr(1));  // substitution
+        }
+        if (!after.empty()) try_edited(before, after.substr(1));  // deletion
+        if (after.size() >= 2)
+          try_edited(before, after.substr(1, 1), after.substr(0, 1),
+                     after.substr(2));  // transposition
+      }
+      return finish();
+    }
+    if (!token_trigrams_) return {};
+    size_t max_distance = spelling.size() <= 8 ? 1 : 2;
+    std::vector<uint32_t> spelling_trigrams = trigrams(spelling);
+    // Each edit removes at most four trigrams.
+    size_t min_shared = spelling_trigrams.size() > 4 * max_distance
+                            ? spelling_trigrams.size() - 4 * max_distance
+                            : 1;
+
+    const uint32_t* keys = (const uint32_t*)(token_trigrams_ + 1);
+    const uint32_t* offsets = keys + token_trigrams_->num_keys;
+    const uint32_t* postings = offsets + token_trigrams_->num_keys + 1;
+    // A token in min_shared of the posting lists of the trigrams is in
+    // one of the shortest lists.size() - min_shared + 1, so only those
+    // are merged, and the others binary searched for the tokens in them.
+    using PostingList = std::pair<const uint32_t*, const uint32_t*>;
+    size_t min_length =
+        std::max(spelling.size(), max_distance + 1) - max_distance;
+    size_t max_length =
+        std::min(spelling.size() + max_distance, max_trigram_spelling);
+    // Keys are ordered by trigram and then length, so the keys of each
+    // trigram for all lengths are found with one search.
+    std::vector<std::vector<PostingList>> lists_by_length(max_length -
+                                                          min_length + 1);
+    const uint32_t* keys_end = keys + token_trigrams_->num_keys;
+    for (uint32_t trigram : spelling_trigrams) {
+      for (const uint32_t* it = std::lower_bound(
+               keys, keys_end, trigram_key(trigram, min_length));
+           it < keys_end && *it <= trigram_key(trigram, max_length); it++) {
+        size_t i = it - keys;
+        lists_by_length[(*it & 0xff) - min_length].emplace_back(
+            postings + offsets[i], postings + offsets[i + 1]);
+      }
+    }
+
+    std::vector<uint32_t> candidates, merged;
+    // Counts of the merged lists by token id, left zeroed.
+    thread_local std::vector<uint8_t> shared;
+    if (shared.size() <= num_tokens) shared.resize(num_tokens + 1);
+    for (std::vector<PostingList>& lists : lists_by_length) {
+      if (lists.size() < min_shared) continue;
+      std::sort(lists.begin(), lists.end(),
+                [](const PostingList& a, const PostingList& b) {
+                  return a.second - a.first < b.second - b.first;
+                });
+      size_t num_merged = lists.size() - min_shared + 1;
+      for (size_t l = 0; l < num_merged; l++)
+        for (const uint32_t* p = lists[l].first; p < lists[l].second; p++)
+          if (shared[*p]++ == 0) merged.push_back(*p);
+      for (uint32_t token_id : merged) {
+        size_t count = shared[token_id];
+        shared[token_id] = 0;
+        for (size_t l = num_merged;
+             count < min_shared && count + (lists.size() - l) >= min_shared;
+             l++)
+          count += std::binary_search(lists[l].first, lists[l].second,
+                                      token_id);
+        if (count >= min_shared) candidates.push_back(token_id);
+      }
+      merged.clear();
+    }
+
+    for (uint32_t token_id : candidates) {
+      size_t distance =
+          edit_distance(this->spelling(token_id), spelling, max_distance);
+      if (distance <= max_distance)
+        result.push_back({token_id, uint32_t(distance)});
+    }
+    return finish();
+  }
+
+  static constexpr size_t max_enumerated_spelling = 4;
+
+  // The tokens that most often follow `last` in the code section, most
+  // frequent first, or those that follow `before_last` then `last` if that
+  // pair is frequent enough to have its own.  Empty without a next_tokens
+  // section.
+  std::vector<NextToken> next_tokens(uint32_t before_last, uint32_t last) {
+    if (!next_tokens_ || last == 0) return {};
+    const NextTokenContext* contexts =
+        (const NextTokenContext*)(next_tokens_ + 1);
+    const NextTokenContext* contexts_end =
+        contexts + next_tokens_->num_contexts;
+    const uint32_t* offsets = (const uint32_t*)contexts_end;
+    const NextToken* next =
+        (const NextToken*)(offsets + next_tokens_->num_contexts + 1);
+    auto find = [&](uint32_t first, uint32_t second) {
+      const NextTokenContext* it = std::partition_point(
+          contexts, contexts_end, [&](const NextTokenContext& context) {
+            return std::tie(context.first, context.second) <
+                   std::tie(first, second);
+          });
+      if (it == contexts_end || it->first != first || it->second != second)
+        return std::vector<NextToken>();
+      size_t i = it - contexts;
+      return std::vector<NextToken>(next + offsets[i], next + offsets[i + 1]);
+    };
+    if (before_last != 0) {
+      std::vector<NextToken> result = find(before_last, last);
+      if (!result.empty()) return result;
+    }
+    return find(last, 0);
+  }
+
+  // Whether the index has a token_kinds section.
+  bool has_token_kinds() { return token_kinds_ != nullptr; }
+
+  // Up to `max_results` tokens whose spelling starts with `prefix`, most
+  // frequent first.  Those spellings are a range of token_alphas.  The ids
+  // of a short range are all compared; with a long one, the most frequent
+  // tokens are tested in turn instead, as about one in num_tokens / range
+  // of them have the prefix.
+  std::vector<uint32_t> tokens_with_prefix(std::string_view prefix,
+                                           size_t max_results) {
+    const TokenAlphabeticalInfo* begin =
+        std::partition_point(token_alphas, token_alphas + num_tokens,
+                             [&](const TokenAlphabeticalInfo& info) {
+                               return spelling(info.token_id) < prefix;
+                             });
+    const TokenAlphabeticalInfo* end =
+        std::partition_point(begin, token_alphas + num_tokens,
+                             [&](const TokenAlphabeticalInfo& info) {
+                               return spelling(info.token_id)
+                                          .substr(0, prefix.size()) == prefix;
+                             });
+    size_t range = end - begin;
+    std::vector<uint32_t> result;
+    if (range * range > prefix_scan_cost * max_results * num_tokens) {
+      for (uint32_t token_id = 1;
+           token_id <= num_tokens && result.size() < max_results; token_id++)
+        if (spelling(token_id).substr(0, prefix.size()) == prefix)
+          result.push_back(token_id);
+      return result;
+    }
+    for (const TokenAlphabeticalInfo* it = begin; it < end; it++)
+      result.push_back(it->token_id);
+    if (result.size() > max_results) {
+      std::nth_element(result.begin(), result.begin() + max_results,
+                       result.end());
+      result.resize(max_results);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  // The cost of testing a spelling for a prefix, relative to comparing an
+  // id from token_alphas.
+  static constexpr size_t prefix_scan_cost = 32;
+
+  // If the code section is compressed (ppindex --compress_code), code is
+  // the start of an inaccessible reservation of code_length bytes, so that
+  // positions in the code section are still pointers.  Its bytes are then
+  // read with read_code() or code_bytes().
   const std::byte* code;
   size_t code_length;
 
+  // Whether the code section encodes code ids rather than token ids; see
+  // SuperTokenHeader.
+  bool has_super_tokens() { return super_tokens_ != nullptr; }
+
+  // The code id of `token_id` alone.
+  uint32_t token_code(uint32_t token_id) {
+    if (!super_tokens_) return token_id;
+    DVC_ASSERT_LE(token_id, num_tokens);
+    return token_codes_[token_id];
+  }
+
+  // The largest code id.
+  uint32_t max_code() {
+    return super_tokens_ ? super_tokens_->num_codes : num_tokens;
+  }
+
+  // The token ids that code id `code` stands for, none for EOF.  Only with
+  // super tokens.
+  std::pair<const uint32_t*, const uint32_t*> code_tokens(uint32_t code) {
+    DVC_ASSERT(super_tokens_);
+    DVC_ASSERT_LE(code, super_tokens_->num_codes);
+    const uint32_t* unit = code_units_ + code;
+    if (*unit == 0) return {unit, unit};
+    if (!(*unit & super_token_unit)) return {unit, unit + 1};
+    uint32_t i = *unit & ~super_token_unit;
+    return {super_token_ids_ + super_offsets_[i],
+            super_token_ids_ + super_offsets_[i + 1]};
+  }
+
+  // The index of the super token that code id `code` stands for, or -1 if
+  // it stands for a single token.  Only with super tokens.
+  uint32_t super_token(uint32_t code) {
+    DVC_ASSERT_LE(code, super_tokens_->num_codes);
+    uint32_t unit = code_units_[code];
+    return unit & super_token_unit ? unit & ~super_token_unit : -1;
+  }
+
+  // Appends the token ids that code id `code` stands for to `token_ids`.
+  void append_tokens(uint32_t code, std::vector<uint32_t>& token_ids) {
+    if (!super_tokens_) {
+      if (code != 0) token_ids.push_back(code);
+      return;
+    }
+    auto [begin, end] = code_tokens(code);
+    token_ids.insert(token_ids.end(), begin, end);
+  }
+
+  // The code ids of the super tokens.
+  std::vector<uint32_t> super_token_codes() {
+    if (!super_tokens_) return {};
+    return {super_codes_, super_codes_ + super_tokens_->num_super};
+  }
+
+  bool code_compressed() { return code_blocks_ != nullptr; }
+  size_t code_block_size() { return code_blocks_->block_size; }
+
+  // Copies code section bytes [offset, offset + length) to `out`,
+  // decompressing them if need be.  Blocks are read from the copy of the
+  // index at `index_data` if given, as for a numa placement.  A range that
+  // starts a block decodes only as much of it as the range needs.
+  void read_code(size_t offset, size_t length, std::byte* out,
+                 const char* index_data = nullptr) {
+    DVC_ASSERT_LE(offset + length, code_length);
+    if (!index_data) index_data = index_.data();
+    if (!code_blocks_) {
+      std::memcpy(out, code + (index_data - index_.data()) + offset, length);
+      return;
+    }
+    size_t block_size = code_blocks_->block_size;
+    size_t end = offset + length;
+    thread_local std::vector<std::byte> decompressed;
+    for (size_t block = offset / block_size; block * block_size < end;
+         block++) {
+      size_t block_begin = block * block_size;
+      size_t block_length = std::min(block_size, code_length - block_begin);
+      const char* stored = index_data + code_block_offsets_[block];
+      size_t stored_length =
+          code_block_offsets_[block + 1] - code_block_offsets_[block];
+      size_t from = std::max(offset, block_begin) - block_begin;
+      size_t to = std::min(end, block_begin + block_length) - block_begin;
+      if (stored_length == block_length) {
+        std::memcpy(out, stored + from, to - from);
+      } else {
+        std::byte* dest = out;
+        if (from != 0) {
+          decompressed.resize(to);
+          dest = decompressed.data();
+        }
+        DVC_ASSERT(lz_decompress_prefix(stored, stored_length, dest,
+                                        block_length, to),
+                   "Corrupt code block ", block);
+        if (from != 0) std::memcpy(out, dest + from, to - from);
+      }
+      out += to - from;
+    }
+  }
+
+  // Code section bytes [offset, offset + length): in place, or decompressed
+  // into `buffer` if the code section is compressed.
+  const std::byte* code_bytes(size_t offset, size_t length,
+                              std::vector<std::byte>& buffer) {
+    if (!code_blocks_) return code + offset;
+    buffer.resize(length);
+    read_code(offset, length, buffer.data());
+    return buffer.data();
+  }
+
+  // Whether the index has a file_clusters section.
+  bool has_file_clusters() { return file_clusters_ != nullptr; }
+
+  // The cluster of near duplicates that file `file_index` is in; see
+  // SectionType::file_clusters.
+  uint32_t file_cluster(size_t file_index) {
+    DVC_ASSERT(has_file_clusters());
+    DVC_ASSERT_LT(file_index, num_files);
+    return file_clusters_[file_index];
+  }
+
+  // The code ranges [begin, end) of the files that are near duplicates of
+  // others, not first in their clusters, in ascending order with adjacent
+  // ones merged.  Empty without a file_clusters section.  Thread-safe.
+  const std::vector<std::pair<size_t, size_t>>& duplicate_ranges() {
+    std::call_once(duplicate_ranges_once_, [&] {
+      if (!file_clusters_) return;
+      for (size_t i = 0; i < num_files; i++) {
+        if (file_clusters_[i] == i) continue;
+        size_t begin = file_infos[i].code_offset;
+        duplicate_ranges_.emplace_back(begin,
+                                       begin + file_infos[i].code_length);
+      }
+      std::sort(duplicate_ranges_.begin(), duplicate_ranges_.end());
+      size_t n = 0;
+      for (const auto& range : duplicate_ranges_)
+        if (n > 0 && duplicate_ranges_[n - 1].second == range.first)
+          duplicate_ranges_[n - 1].second = range.second;
+        else
+          duplicate_ranges_[n++] = range;
+      duplicate_ranges_.resize(n);
+    });
+    return duplicate_ranges_;
+  }
+
+  // Whether the index has an include_graph section.
+  bool has_include_graph() { return include_graph_ != nullptr; }
+
+  using FileIndexes = std::pair<const uint32_t*, const uint32_t*>;
+
+  // The token ids of the header names file `file_index` includes, in
+  // ascending order.
+  FileIndexes includes(size_t file_index) {
+    DVC_ASSERT(has_include_graph());
+    DVC_ASSERT_LT(file_index, num_files);
+    return {include_ids_ + include_offsets_[file_index],
+            include_ids_ + include_offsets_[file_index + 1]};
+  }
+
+  // The files that include the header name `header_id` (a token id), in
+  // ascending order, or none if no file does.
+  FileIndexes includers(uint32_t header_id) {
+    size_t i = header_index(header_id);
+    if (i == SIZE_MAX) return {nullptr, nullptr};
+    return {includer_files_ + includer_offsets_[i],
+            includer_files_ + includer_offsets_[i + 1]};
+  }
+
+  // The files that the header name `header_id` may name, in ascending
+  // order; see SectionType::include_graph.
+  FileIndexes header_files(uint32_t header_id) {
+    size_t i = header_index(header_id);
+    if (i == SIZE_MAX) return {nullptr, nullptr};
+    return {resolved_files_ + resolved_offsets_[i],
+            resolved_files_ + resolved_offsets_[i + 1]};
+  }
+
+  // The files that include the header name `header_id`, directly or
+  // through the files it and their own included header names may name, in
+  // ascending order.  Thread-safe.
+  std::vector<uint32_t> transitive_includers(uint32_t header_id) {
+    build_file_headers();
+    std::vector<bool> seen(num_files);
+    std::vector<uint32_t> result;
+    std::vector<uint32_t> pending = {header_id};
+    while (!pending.empty()) {
+      auto [begin, end] = includers(pending.back());
+      pending.pop_back();
+      for (const uint32_t* file = begin; file < end; file++) {
+        if (seen[*file]) continue;
+        seen[*file] = true;
+        result.push_back(*file);
+        pending.insert(pending.end(),
+                       file_headers_.begin() + file_header_offsets_[*file],
+                       file_headers_.begin() +
+                           file_header_offsets_[*file + 1]);
+      }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  // Up to `n` of the header names included by the most files, as their
+  // token ids and numbers of includers, most included first.
+  std::vector<std::pair<uint32_t, uint32_t>> top_headers(size_t n) {
+    DVC_ASSERT(has_include_graph());
+    std::vector<std::pair<uint32_t, uint32_t>> result;
+    for (size_t i = 0; i < include_graph_->num_headers; i++)
+      result.emplace_back(header_ids_[i],
+                          includer_offsets_[i + 1] - includer_offsets_[i]);
+    n = std::min(n, result.size());
+    std::partial_sort(result.begin(), result.begin() + n, result.end(),
+                      [](const auto& a, const auto& b) {
+                        return std::tie(b.second, a.first) <
+                               std::tie(a.second, b.first);
+                      });
+    result.resize(n);
+    return result;
+  }
+
   struct FileLines {
     const idx::FileInfo& file_info;
     uint32_t first_lineno;
     uint32_t match_lineno;
-    const idx::LineInfo* lines;
+    std::vector<idx::LineInfo> lines;  // num_lines + 1, from first_lineno
     uint32_t num_lines;
   };
 
-  FileLines symbolize(const std::byte* pos, uint32_t len, uint32_t context) {
-    size_t pos_offset = pos - code;
-    DVC_ASSERT_LT(pos_offset, code_length, "symbolize out of bounds");
-    const FileInfo* file_info = std::partition_point(
+  // The file containing code offset `pos_offset`.
+  const FileInfo* find_file(size_t pos_offset) {
+    if (file_ends_built_) return find_file_eytzinger(pos_offset);
+    return std::partition_point(
         file_infos, file_infos + num_files, [&](const FileInfo& info) {
           return info.code_offset + info.code_length <= pos_offset;
         });
+  }
+
+  FileLines symbolize(const std::byte* pos, uint32_t len, uint32_t context) {
+    size_t pos_offset = pos - code;
+    DVC_ASSERT_LT(pos_offset, code_length, "symbolize out of bounds");
+    return symbolize_in(find_file(pos_offset), pos_offset, len, context, 0);
+  }
+
+  // As symbolize() for each of `positions`, in the same order.  Positions
+  // are resolved in ascending order in one sweep: a position in the same
+  // file as the previous one needs no file lookup, and its line lookup
+  // gallops forward from the previous match line.  Batches of at least
+  // kFileTableMinBatch positions also build (once) an Eytzinger-ordered
+  // copy of the file end offsets, which later lookups then use.
+  std::vector<FileLines> symbolize(
+      const std::vector<const std::byte*>& positions, uint32_t len,
+      uint32_t context) {
+    return symbolize(positions, std::vector<uint32_t>(positions.size(), len),
+                     context);
+  }
+
+  // As above, with a length for each position.
+  std::vector<FileLines> symbolize(
+      const std::vector<const std::byte*>& positions,
+      const std::vector<uint32_t>& lens, uint32_t context) {
+    DVC_ASSERT_EQ(lens.size(), positions.size());
+    std::vector<std::pair<size_t, size_t>> order;  // code offset, index
+    order.reserve(positions.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+      size_t pos_offset = positions[i] - code;
+      DVC_ASSERT_LT(pos_offset, code_length, "symbolize out of bounds");
+      order.emplace_back(pos_offset, i);
+    }
+    std::sort(order.begin(), order.end());
+    if (positions.size() >= kFileTableMinBatch) build_file_table();
+
+    std::vector<FileLines> sorted;
+    sorted.reserve(order.size());
+    std::vector<size_t> rank(order.size());
+    const FileInfo* file_info = nullptr;
+    for (auto [pos_offset, i] : order) {
+      size_t hint = 0;
+      if (file_info &&
+          pos_offset < file_info->code_offset + file_info->code_length)
+        hint = sorted.back().match_lineno - 1;
+      else
+        file_info = find_file(pos_offset);
+      rank[i] = sorted.size();
+      sorted.push_back(
+          symbolize_in(file_info, pos_offset, lens[i], context, hint));
+    }
+
+    std::vector<FileLines> result;
+    result.reserve(sorted.size());
+    for (size_t r : rank) result.push_back(std::move(sorted[r]));
+    return result;
+  }
+
+  static constexpr size_t kFileTableMinBatch = 1024;
 
+  // Builds the Eytzinger file table used by find_file().  Costs one pass
+  // over the FileInfo section, so it is only worth it for large batches
+  // or long-lived readers.  Thread-safe.
+  void build_file_table() {
+    std::call_once(file_table_once_, [&] {
+      file_ends_.resize(num_files + 1);
+      file_ranks_.resize(num_files + 1);
+      size_t i = 0;
+      auto fill = [&](auto& self, size_t k) -> void {
+        if (k > num_files) return;
+        self(self, 2 * k);
+        file_ends_[k] = file_infos[i].code_offset + file_infos[i].code_length;
+        file_ranks_[k] = i++;
+        self(self, 2 * k + 1);
+      };
+      fill(fill, 1);
+      file_ends_built_ = true;
+    });
+  }
+
+ private:
+  void read_v2(const IndexHeader& header) {
+    file_infos = to_ptr<FileInfo>(header.file_section_offset);
+    num_files = header.num_files;
+
+    token_ids = to_ptr<TokenIdInfo>(header.token_id_section_offset);
+    token_alphas = to_ptr<TokenAlphabeticalInfo>(
+        header.token_alphabetical_section_offset);
+    num_tokens = header.num_tokens;
+
+    code = to_ptr<std::byte>(header.code_section_offset);
+    code_length = header.code_section_length;
+
+    total_bytes = header.total_bytes;
+    total_tokens = header.total_tokens;
+    total_lines = header.total_lines;
+  }
+
+  void read_v3() {
+    DVC_ASSERT_GE(index_.size(), sizeof(IndexHeaderV3), "Index truncated");
+    const IndexHeaderV3* header = to_ptr<IndexHeaderV3>(0);
+    num_sections = header->num_sections;
+    DVC_ASSERT_GE(index_.size(),
+                  sizeof(IndexHeaderV3) + num_sections * sizeof(SectionEntry),
+                  "Index truncated");
+    sections = to_ptr<SectionEntry>(sizeof(IndexHeaderV3));
+    directory_checksum =
+        hash64(sections, num_sections * sizeof(SectionEntry));
+    DVC_ASSERT_EQ(directory_checksum, header->directory_checksum,
+                  "Corrupt index section directory");
+    checksum_chunk_size_ = header->checksum_chunk_size;
+
+    num_files = header->num_files;
+    num_tokens = header->num_tokens;
+    total_bytes = header->total_bytes;
+    total_tokens = header->total_tokens;
+    total_lines = header->total_lines;
+    canonical_tokens_ = header->flags & canonical_tokens;
+
+    auto expect_length = [](const SectionEntry& section, size_t length) {
+      DVC_ASSERT_EQ(section.length, length, "Section type ",
+                    uint32_t(section.type), " has the wrong length");
+    };
+    uint32_t found = 0;
+    for (size_t i = 0; i < num_sections; i++) {
+      const SectionEntry& section = sections[i];
+      DVC_ASSERT_LE(section.offset + section.length, index_.size(),
+                    "Index truncated");
+      if (uint32_t(section.type) < 32) found |= 1u << uint32_t(section.type);
+      switch (section.type) {
+        case SectionType::code:
+          code = to_ptr<std::byte>(section.offset);
+          code_length = section.length;
+          break;
+        case SectionType::code_blocks:
+          read_code_blocks(section.offset);
+          break;
+        case SectionType::files:
+          file_infos = to_ptr<FileInfo>(section.offset);
+          expect_length(section, num_files * sizeof(FileInfo));
+          break;
+        case SectionType::token_ids:
+          token_ids = to_ptr<TokenIdInfo>(section.offset);
+          expect_length(section, num_tokens * sizeof(TokenIdInfo));
+          break;
+        case SectionType::token_alphabetical:
+          token_alphas = to_ptr<TokenAlphabeticalInfo>(section.offset);
+          expect_length(section, num_tokens * sizeof(TokenAlphabeticalInfo));
+          break;
+        case SectionType::line_table:
+          line_table_ = to_ptr<LineTableHeader>(section.offset);
+          DVC_ASSERT_GT(line_table_->checkpoint_interval, 0);
+          break;
+        case SectionType::lines:
+        case SectionType::filenames:
+        case SectionType::spellings:
+          break;  // reached through offsets in other sections
+        case SectionType::source:
+          read_source(section.offset);
+          break;
+        case SectionType::paths:
+          read_paths(section.offset);
+          break;
+        case SectionType::token_trigrams:
+          token_trigrams_ = to_ptr<TokenTrigramHeader>(section.offset);
+          expect_length(section,
+                        sizeof(TokenTrigramHeader) +
+                            (2 * token_trigrams_->num_keys + 1 +
+                             token_trigrams_->num_postings) *
+                                sizeof(uint32_t));
+          break;
+        case SectionType::next_tokens:
+          next_tokens_ = to_ptr<NextTokenHeader>(section.offset);
+          expect_length(section,
+                        sizeof(NextTokenHeader) +
+                            next_tokens_->num_contexts *
+                                (sizeof(NextTokenContext) + sizeof(uint32_t)) +
+                            sizeof(uint32_t) +
+                            next_tokens_->num_next * sizeof(NextToken));
+          break;
+        case SectionType::super_tokens:
+          read_super_tokens(section);
+          break;
+        case SectionType::file_clusters:
+          file_clusters_ = to_ptr<uint32_t>(section.offset);
+          expect_length(section, num_files * sizeof(uint32_t));
+          break;
+        case SectionType::include_graph:
+          read_include_graph(section);
+          break;
+        case SectionType::token_kinds:
+          token_kinds_ = to_ptr<TokenKindInfo>(section.offset);
+          expect_length(section, (num_tokens + 1) * sizeof(TokenKindInfo));
+          break;
+        case SectionType::token_hash:
+          token_hash_ = to_ptr<TokenHashHeader>(section.offset);
+          token_hash_displacements_ = (const uint32_t*)(token_hash_ + 1);
+          token_hash_slots_ = (const TokenHashSlot*)(token_hash_displacements_ +
+                                                     token_hash_->num_buckets);
+          expect_length(section,
+                        sizeof(TokenHashHeader) +
+                            token_hash_->num_buckets * sizeof(uint32_t) +
+                            num_tokens * sizeof(TokenHashSlot));
+          break;
+        default:
+          DVC_ASSERT(section.flags & section_optional,
+                     "Index needs a newer reader for section type ",
+                     uint32_t(section.type));
+      }
+    }
+    for (SectionType required :
+         {SectionType::files, SectionType::token_ids,
+          SectionType::token_alphabetical, SectionType::spellings})
+      DVC_ASSERT(found & (1u << uint32_t(required)),
+                 "Index lacks section type ", uint32_t(required));
+    DVC_ASSERT(found & ((1u << uint32_t(SectionType::code)) |
+                        (1u << uint32_t(SectionType::code_blocks))),
+               "Index lacks a code section");
+    DVC_ASSERT(found & ((1u << uint32_t(SectionType::lines)) |
+                        (1u << uint32_t(SectionType::line_table))),
+               "Index lacks a line section");
+    DVC_ASSERT(found & ((1u << uint32_t(SectionType::filenames)) |
+                        (1u << uint32_t(SectionType::paths))),
+               "Index lacks a path section");
+  }
+
+  void read_code_blocks(size_t offset) {
+    DVC_ASSERT_EQ(offset % alignof(CodeBlocksHeader), 0);
+    code_blocks_ = to_ptr<CodeBlocksHeader>(offset);
+    code_block_offsets_ = (const size_t*)(code_blocks_ + 1);
+    code_length = code_blocks_->code_length;
+    DVC_ASSERT_GT(code_blocks_->block_size, 0);
+    DVC_ASSERT_EQ(code_blocks_->num_blocks,
+                  (code_length + code_blocks_->block_size - 1) /
+                      code_blocks_->block_size);
+    code_reservation_length_ = std::max<size_t>(code_length, 1);
+    void* reservation =
+        ::mmap(nullptr, code_reservation_length_, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    DVC_ASSERT_NE(reservation, MAP_FAILED, "Unable to reserve ",
+                  code_reservation_length_, " bytes: ", strerror(errno));
+    code = (const std::byte*)reservation;
+  }
+
+  void read_super_tokens(const SectionEntry& section) {
+    super_tokens_ = to_ptr<SuperTokenHeader>(section.offset);
+    size_t num_codes = super_tokens_->num_codes;
+    size_t num_super = super_tokens_->num_super;
+    token_codes_ = (const uint32_t*)(super_tokens_ + 1);
+    super_codes_ = token_codes_ + num_tokens + 1;
+    code_units_ = super_codes_ + num_super;
+    super_offsets_ = code_units_ + num_codes + 1;
+    super_token_ids_ = super_offsets_ + num_super + 1;
+    size_t header_length = (const std::byte*)super_token_ids_ -
+                           to_ptr<std::byte>(section.offset);
+    DVC_ASSERT_LE(header_length, section.length, "Index truncated");
+    DVC_ASSERT_EQ(section.length,
+                  header_length + super_offsets_[num_super] * sizeof(uint32_t),
+                  "Section type ", uint32_t(section.type),
+                  " has the wrong length");
+  }
+
+  void read_include_graph(const SectionEntry& section) {
+    include_graph_ = to_ptr<IncludeGraphHeader>(section.offset);
+    size_t num_headers = include_graph_->num_headers;
+    size_t num_edges = include_graph_->num_edges;
+    include_offsets_ = (const uint32_t*)(include_graph_ + 1);
+    include_ids_ = include_offsets_ + num_files + 1;
+    header_ids_ = include_ids_ + num_edges;
+    includer_offsets_ = header_ids_ + num_headers;
+    includer_files_ = includer_offsets_ + num_headers + 1;
+    resolved_offsets_ = includer_files_ + num_edges;
+    resolved_files_ = resolved_offsets_ + num_headers + 1;
+    DVC_ASSERT_EQ(section.length,
+                  sizeof(IncludeGraphHeader) +
+                      (num_files + 3 * num_headers + 2 * num_edges + 3 +
+                       include_graph_->num_resolved) *
+                          sizeof(uint32_t),
+                  "Section type ", uint32_t(section.type),
+                  " has the wrong length");
+  }
+
+  // The index of header name `header_id` in the include graph, or
+  // SIZE_MAX if no file includes it.
+  size_t header_index(uint32_t header_id) {
+    DVC_ASSERT(has_include_graph());
+    const uint32_t* end = header_ids_ + include_graph_->num_headers;
+    const uint32_t* it = std::lower_bound(header_ids_, end, header_id);
+    if (it == end || *it != header_id) return SIZE_MAX;
+    return it - header_ids_;
+  }
+
+  // Inverts the resolved files of the include graph, for
+  // transitive_includers().  Thread-safe.
+  void build_file_headers() {
+    DVC_ASSERT(has_include_graph());
+    std::call_once(file_headers_once_, [&] {
+      size_t num_headers = include_graph_->num_headers;
+      file_header_offsets_.assign(num_files + 1, 0);
+      for (size_t i = 0; i < include_graph_->num_resolved; i++)
+        file_header_offsets_[resolved_files_[i] + 1]++;
+      for (size_t i = 0; i < num_files; i++)
+        file_header_offsets_[i + 1] += file_header_offsets_[i];
+      file_headers_.resize(include_graph_->num_resolved);
+      std::vector<uint32_t> next(file_header_offsets_.begin(),
+                                 file_header_offsets_.end() - 1);
+      for (size_t i = 0; i < num_headers; i++)
+        for (size_t j = resolved_offsets_[i]; j < resolved_offsets_[i + 1];
+             j++)
+          file_headers_[next[resolved_files_[j]]++] = header_ids_[i];
+    });
+  }
+
+  void read_source(size_t offset) {
+    DVC_ASSERT_EQ(offset % alignof(SourceSectionHeader), 0);
+    source_header_ = to_ptr<SourceSectionHeader>(offset);
+    source_text_offsets_ = (const size_t*)(source_header_ + 1);
+    source_block_offsets_ = source_text_offsets_ + num_files;
+  }
+
+  void read_paths(size_t offset) {
+    DVC_ASSERT_EQ(offset % alignof(size_t), 0);
+    path_header_ = to_ptr<PathDictionaryHeader>(offset);
+    DVC_ASSERT_GT(path_header_->bucket_size, 0);
+    DVC_ASSERT_EQ(path_header_->num_buckets,
+                  (num_files + path_header_->bucket_size - 1) /
+                      path_header_->bucket_size);
+    path_ranks_ = (const uint32_t*)(path_header_ + 1);
+    path_files_ = path_ranks_ + num_files;
+    path_bucket_offsets_ = (const size_t*)(path_files_ + num_files);
+  }
+
+  // Without a paths section, sorts the file indexes by path once, for
+  // file_by_rank() and prefix_range().  Thread-safe.
+  void build_path_order() {
+    std::call_once(path_order_once_, [&] {
+      path_order_.resize(num_files);
+      for (size_t i = 0; i < num_files; i++) path_order_[i] = i;
+      std::sort(path_order_.begin(), path_order_.end(),
+                [&](uint32_t a, uint32_t b) {
+                  return cstr(file_infos[a].filename_cstr) <
+                         cstr(file_infos[b].filename_cstr);
+                });
+    });
+  }
+
+  // Calls f(rank, path) for each path from rank `first` on, in order,
+  // until f returns false.
+  template <typename F>
+  void for_each_path(size_t first, F&& f) {
+    if (!path_header_) {
+      build_path_order();
+      for (size_t rank = first; rank < num_files; rank++) {
+        std::string path(cstr(file_infos[path_order_[rank]].filename_cstr));
+        if (!f(rank, path)) return;
+      }
+      return;
+    }
+    size_t bucket_size = path_header_->bucket_size;
+    std::string path;
+    for (size_t rank = first / bucket_size * bucket_size; rank < num_files;) {
+      const uint8_t* p =
+          to_ptr<uint8_t>(path_bucket_offsets_[rank / bucket_size]);
+      size_t end = std::min(rank + bucket_size, num_files);
+      path.clear();
+      for (; rank < end; rank++) {
+        size_t shared = rank % bucket_size == 0 ? 0 : get_varint(p);
+        size_t length = get_varint(p);
+        DVC_ASSERT_LE(shared, path.size(), "Corrupt path dictionary");
+        path.resize(shared);
+        path.append((const char*)p, length);
+        p += length;
+        if (rank >= first && !f(rank, path)) return;
+      }
+    }
+  }
+
+  // The first rank whose path does not satisfy `pred`, given that the
+  // paths that do are a prefix of the ranks.  Binary searches the first
+  // path of each bucket, then decodes at most one bucket.
+  template <typename Pred>
+  size_t partition_rank(Pred pred) {
+    if (!path_header_) {
+      build_path_order();
+      return std::partition_point(path_order_.begin(), path_order_.end(),
+                                  [&](uint32_t file) {
+                                    return pred(cstr(
+                                        file_infos[file].filename_cstr));
+                                  }) -
+             path_order_.begin();
+    }
+    size_t bucket_size = path_header_->bucket_size;
+    auto bucket_head = [&](size_t bucket) {
+      const uint8_t* p = to_ptr<uint8_t>(path_bucket_offsets_[bucket]);
+      size_t length = get_varint(p);
+      return std::string_view((const char*)p, length);
+    };
+    size_t low = 0, high = path_header_->num_buckets;
+    while (low < high) {
+      size_t mid = low + (high - low) / 2;
+      if (pred(bucket_head(mid)))
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    if (low == 0) return 0;
+    size_t result = std::min(low * bucket_size, num_files);
+    for_each_path((low - 1) * bucket_size + 1,
+                  [&](size_t rank, const std::string& path) {
+                    if (rank >= result) return false;
+                    if (pred(path)) return true;
+                    result = rank;
+                    return false;
+                  });
+    return result;
+  }
+
+  // Descends the implicit tree breadth-first, so the first few levels
+  // share cache lines and the next levels can be prefetched.
+  const FileInfo* find_file_eytzinger(size_t pos_offset) {
+    size_t k = 1;
+    while (k <= num_files) {
+      __builtin_prefetch(file_ends_.data() + 8 * k);
+      k = 2 * k + (file_ends_[k] <= pos_offset);
+    }
+    k >>= __builtin_ffsll(~k);
+    return k == 0 ? file_infos + num_files : file_infos + file_ranks_[k];
+  }
+
+  // As std::partition_point, but probes first + 0, 1, 3, 7, ... so it is
+  // cheap when the partition point is near `first`.
+  template <typename T, typename Pred>
+  static const T* gallop_partition_point(const T* first, const T* last,
+                                         Pred pred) {
+    size_t step = 1;
+    while (step <= size_t(last - first) && pred(first[step - 1])) {
+      first += step;
+      step *= 2;
+    }
+    return std::partition_point(
+        first, first + std::min(step, size_t(last - first)), pred);
+  }
+
+  // Calls f(i, line) for each line i of `file_info` from `first` on,
+  // until f returns false.
+  template <typename F>
+  void for_each_line(const FileInfo& file_info, size_t first, F&& f) {
+    size_t num_lines = file_info.num_lines;
+    if (!line_table_) {
+      const LineInfo* lines = to_ptr<LineInfo>(file_info.lineinfo_offset);
+      for (size_t i = first; i < num_lines && f(i, lines[i]); i++) continue;
+      return;
+    }
+    size_t interval = line_table_->checkpoint_interval;
+    const LineCheckpoint* checkpoints =
+        to_ptr<LineCheckpoint>(file_info.lineinfo_offset);
+    const uint8_t* deltas =
+        (const uint8_t*)(checkpoints + (num_lines + interval - 1) / interval);
+    for (size_t i = first / interval * interval; i < num_lines;) {
+      const LineCheckpoint& checkpoint = checkpoints[i / interval];
+      LineInfo line{checkpoint.file_offset, checkpoint.code_offset};
+      const uint8_t* delta = deltas + checkpoint.delta_offset;
+      size_t end = std::min(i + interval, num_lines);
+      while (true) {
+        if (i >= first && !f(i, line)) return;
+        if (++i == end) break;
+        line.file_offset += get_varint(delta);
+        line.code_offset += get_varint(delta);
+      }
+    }
+  }
+
+  // The first line of `file_info` at or after `from` for which `pred` is
+  // false, given that it is true of every line before that one.  With a
+  // line table, gallops over the checkpoints and then decodes at most one
+  // checkpoint interval of deltas.
+  template <typename Pred>
+  size_t partition_line(const FileInfo& file_info, size_t from, Pred pred) {
+    size_t num_lines = file_info.num_lines;
+    if (!line_table_) {
+      const LineInfo* lines = to_ptr<LineInfo>(file_info.lineinfo_offset);
+      return gallop_partition_point(lines + from, lines + num_lines, pred) -
+             lines;
+    }
+    size_t interval = line_table_->checkpoint_interval;
+    const LineCheckpoint* checkpoints =
+        to_ptr<LineCheckpoint>(file_info.lineinfo_offset);
+    size_t num_checkpoints = (num_lines + interval - 1) / interval;
+    size_t k = gallop_partition_point(
+                   checkpoints + from / interval, checkpoints + num_checkpoints,
+                   [&](const LineCheckpoint& checkpoint) {
+                     return pred(LineInfo{checkpoint.file_offset,
+                                          checkpoint.code_offset});
+                   }) -
+               checkpoints;
+    if (k == 0) return 0;
+    size_t result = std::min(k * interval, num_lines);
+    for_each_line(file_info, std::max((k - 1) * interval + 1, from),
+                  [&](size_t i, const LineInfo& line) {
+                    if (i >= result) return false;
+                    if (pred(line)) return true;
+                    result = i;
+                    return false;
+                  });
+    return result;
+  }
+
+  // `hint` is a line of `file_info` at or before the match.
+  FileLines symbolize_in(const FileInfo* file_info, size_t pos_offset,
+                         uint32_t len, uint32_t context, size_t hint) {
     DVC_ASSERT_GE(file_info, file_infos);
     DVC_ASSERT_LT(file_info, file_infos + num_files);
     DVC_ASSERT_GE(pos_offset, file_info->code_offset);
@@ -103,59 +1305,116 @@ class IndexReader {
     DVC_ASSERT_LT(begin_code, file_info->code_length);
     uint32_t end_code = begin_code + len;
     DVC_ASSERT_LT(end_code, file_info->code_length);
-    const idx::LineInfo* file_line_infos = line_infos(*file_info);
-
-    auto find_line = [&](uint32_t code_offset, bool first) -> const LineInfo* {
-      const LineInfo* line_info =
-          std::partition_point(file_line_infos + 1,
-                               file_line_infos + file_info->num_lines,
-                               [&](const LineInfo& info) {
-                                 return info.code_offset <= code_offset;
-                               }) -
-          1;
-      DVC_ASSERT_GE(line_info, file_line_infos);
-      DVC_ASSERT_LT(line_info, file_line_infos + file_info->num_lines);
-      if (!first) {
-        while (line_info > file_line_infos &&
-               (line_info - 1)->code_offset == code_offset)
-          line_info--;
-      }
-      DVC_ASSERT_GE(line_info, file_line_infos);
-      DVC_ASSERT_LT(line_info, file_line_infos + file_info->num_lines);
-      return line_info;
+    size_t num_lines = file_info->num_lines;
+
+    // The last line starting at or before code_offset, or if !first and
+    // some lines start exactly there, the first of those.
+    auto find_line = [&](uint32_t code_offset, bool first, size_t from) {
+      size_t line = partition_line(*file_info, std::max<size_t>(from, 1),
+                                   [&](const LineInfo& info) {
+                                     return info.code_offset <= code_offset;
+                                   }) -
+                    1;
+      DVC_ASSERT_LT(line, num_lines);
+      if (!first && line_info(*file_info, line).code_offset == code_offset)
+        line = partition_line(*file_info, from, [&](const LineInfo& info) {
+          return info.code_offset < code_offset;
+        });
+      DVC_ASSERT_LT(line, num_lines);
+      return line;
     };
 
-    const LineInfo* first_line = find_line(begin_code, true);
-    const LineInfo* last_line = find_line(end_code, false);
+    size_t first_line = find_line(begin_code, true, hint);
+    size_t last_line = find_line(end_code, false, first_line);
     if (first_line == last_line) last_line++;
-    DVC_ASSERT_LT(last_line, file_line_infos + file_info->num_lines);
+    DVC_ASSERT_LT(last_line, num_lines);
 
-    uint32_t match_lineno = 1 + (first_line - file_line_infos);
+    uint32_t match_lineno = 1 + first_line;
 
-    for (size_t i = 0; i < context; i++) {
-      if (first_line > file_line_infos) first_line--;
-      if (last_line < file_line_infos + file_info->num_lines - 1) last_line++;
-    }
-    DVC_ASSERT_GE(first_line, file_line_infos);
-    DVC_ASSERT_LT(first_line, file_line_infos + file_info->num_lines);
-    DVC_ASSERT_GE(last_line, file_line_infos);
-    DVC_ASSERT_LT(last_line, file_line_infos + file_info->num_lines);
-
-    uint32_t first_lineno = 1 + (first_line - file_line_infos);
-    const idx::LineInfo* lines = first_line;
-    uint32_t num_lines = last_line - first_line;
+    first_line -= std::min<size_t>(first_line, context);
+    last_line = std::min<size_t>(last_line + context, num_lines - 1);
 
-    return {*file_info, first_lineno, match_lineno, lines, num_lines};
+    return {*file_info, uint32_t(1 + first_line), match_lineno,
+            line_infos(*file_info, first_line, last_line - first_line + 1),
+            uint32_t(last_line - first_line)};
   }
 
- private:
   std::string_view cstr(size_t offset) { return to_ptr<char>(offset); }
   template <typename T>
   const T* to_ptr(size_t offset) {
     return (const T*)(index_.data() + offset);
   }
   std::string_view index_;
-  const IndexHeader* header_;
+  size_t checksum_chunk_size_ = 0;
+  bool canonical_tokens_ = false;
+
+  // Null if each file's lines are a plain LineInfo array.
+  const LineTableHeader* line_table_ = nullptr;
+
+  // Null if paths are C strings at FileInfo.filename_cstr, in which case
+  // path_order_ is built when first needed.
+  const PathDictionaryHeader* path_header_ = nullptr;
+  const uint32_t* path_ranks_ = nullptr;         // num_files
+  const uint32_t* path_files_ = nullptr;         // num_files
+  const size_t* path_bucket_offsets_ = nullptr;  // num_buckets + 1
+  std::once_flag path_order_once_;
+  std::vector<uint32_t> path_order_;
+
+  // Null without a token_hash section.
+  const TokenHashHeader* token_hash_ = nullptr;
+  const uint32_t* token_hash_displacements_ = nullptr;  // num_buckets
+  const TokenHashSlot* token_hash_slots_ = nullptr;     // num_tokens
+
+  // Null without a token_trigrams section.
+  const TokenTrigramHeader* token_trigrams_ = nullptr;
+
+  // Null without a next_tokens section.
+  const NextTokenHeader* next_tokens_ = nullptr;
+
+  // Null without a file_clusters section.
+  const uint32_t* file_clusters_ = nullptr;  // num_files
+  std::once_flag duplicate_ranges_once_;
+  std::vector<std::pair<size_t, size_t>> duplicate_ranges_;
+
+  // Null without a token_kinds section.
+  const TokenKindInfo* token_kinds_ = nullptr;  // num_tokens + 1
+
+  // Null without an include_graph section.
+  const IncludeGraphHeader* include_graph_ = nullptr;
+  const uint32_t* include_offsets_ = nullptr;   // num_files + 1
+  const uint32_t* include_ids_ = nullptr;       // num_edges
+  const uint32_t* header_ids_ = nullptr;        // num_headers
+  const uint32_t* includer_offsets_ = nullptr;  // num_headers + 1
+  const uint32_t* includer_files_ = nullptr;    // num_edges
+  const uint32_t* resolved_offsets_ = nullptr;  // num_headers + 1
+  const uint32_t* resolved_files_ = nullptr;    // num_resolved
+  std::once_flag file_headers_once_;
+  std::vector<uint32_t> file_header_offsets_;  // num_files + 1
+  std::vector<uint32_t> file_headers_;         // num_resolved
+
+  // Null without a super_tokens section.
+  const SuperTokenHeader* super_tokens_ = nullptr;
+  const uint32_t* token_codes_ = nullptr;      // num_tokens + 1
+  const uint32_t* super_codes_ = nullptr;      // num_super
+  const uint32_t* code_units_ = nullptr;       // num_codes + 1
+  const uint32_t* super_offsets_ = nullptr;    // num_super + 1
+  const uint32_t* super_token_ids_ = nullptr;
+
+  // Null unless the code section is compressed.
+  const CodeBlocksHeader* code_blocks_ = nullptr;
+  const size_t* code_block_offsets_ = nullptr;  // num_blocks + 1
+  size_t code_reservation_length_ = 0;
+
+  const SourceSectionHeader* source_header_ = nullptr;
+  const size_t* source_text_offsets_ = nullptr;   // num_files
+  const size_t* source_block_offsets_ = nullptr;  // num_blocks + 1
+
+  // Eytzinger (breadth-first) order, 1-based: file_ends_[k] is the end
+  // code offset of file file_ranks_[k].
+  std::once_flag file_table_once_;
+  std::atomic_bool file_ends_built_ = false;
+  std::vector<uint64_t> file_ends_;
+  std::vector<uint32_t> file_ranks_;
 };
 
 }  // namespace ppt::idx
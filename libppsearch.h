@@ -0,0 +1,136 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "index_handle.h"
+#include "ppsearch.h"
+
+namespace ppt {
+
+// Embedding API: open an index once and run any number of searches in
+// process.  Results reference the index they were found in, which stays
+// mapped until the last SearchResults for it is gone, even if the
+// Searcher reloads a newer index meanwhile.
+
+// One sampled match.  It keeps its index mapped, like SearchResults.  The
+// snippet is read, from the index's stored source if it has one and
+// otherwise from the source tree, only when lines() is called.
+class SearchMatch {
+ public:
+  std::string file() const {
+    return index->reader.filename(file_lines.file_info).string();
+  }
+  size_t offset() const { return offset_; }  // within the code section
+  uint32_t first_line() const { return file_lines.first_lineno; }
+  uint32_t match_line() const { return file_lines.match_lineno; }
+  uint32_t num_lines() const { return file_lines.num_lines; }
+
+  // Lines first_line() .. first_line() + num_lines() - 1 of file().
+  std::vector<std::string> lines() const {
+    return index->snippets.read(std::filesystem::path(file()), file_lines);
+  }
+
+  // The matched tokens within `lines`, as returned by lines().
+  std::vector<Highlight> highlights(
+      const std::vector<std::string>& lines) const {
+    return highlight(index->reader, index->reader.code + offset_, extent,
+                     file_lines, lines);
+  }
+
+ private:
+  friend class SearchResults;
+  SearchMatch(std::shared_ptr<Index> index,
+              idx::IndexReader::FileLines file_lines, size_t offset,
+              MatchExtent extent)
+      : index(std::move(index)),
+        file_lines(file_lines),
+        offset_(offset),
+        extent(extent) {}
+
+  std::shared_ptr<Index> index;
+  idx::IndexReader::FileLines file_lines;
+  size_t offset_;
+  MatchExtent extent;
+};
+
+class SearchResults {
+ public:
+  const std::string& error() const { return error_; }  // empty on success
+  // See CodeSearchResults::suggested_query.
+  const std::string& suggested_query() const { return suggested_query_; }
+  size_t num_files() const { return index->reader.num_files; }
+  size_t num_matches() const { return matches.num_matches; }
+  // Of num_matches(), those not in near duplicates of other files, which
+  // are the ones sampled.
+  size_t num_unique_matches() const {
+    return matches.num_matches - matches.num_duplicates;
+  }
+
+  // Sampled matches.
+  size_t size() const { return matches.samples.size(); }
+  SearchMatch operator[](size_t i) const {
+    const std::byte* sample = matches.samples.at(i);
+    MatchExtent extent = match_extent(index->reader, sample, encoded);
+    return SearchMatch(
+        index, index->reader.symbolize(sample, extent.length, context),
+        sample - index->reader.code, extent);
+  }
+
+ private:
+  friend class Searcher;
+  std::shared_ptr<Index> index;
+  std::string error_;
+  std::string suggested_query_;
+  Matches matches = {0, {}};
+  std::vector<std::byte> encoded;  // the query
+  uint32_t context = 2;
+};
+
+class Searcher {
+ public:
+  Searcher(const std::filesystem::path& index_file,
+           const mmap_options& options = {},
+           size_t nthreads = std::thread::hardware_concurrency(),
+           size_t block_size = 100000)
+      : handle(index_file, options),
+        nthreads(nthreads),
+        block_size(block_size) {}
+
+  // Reload when the index file is replaced (see IndexHandle::watch).  No
+  // signal handler is installed; that belongs to the host process.
+  void watch() { handle.watch(0); }
+
+  // `context` lines are included either side of each match.  A query
+  // that extends a recent one is only looked for where that one was
+  // found; see refine_matches.
+  SearchResults search(const std::string& query, uint32_t context = 2) const {
+    SearchResults results;
+    results.index = handle.get();
+    results.context = context;
+    results.error_ = encode_query(results.index->reader, query,
+                                  results.encoded, &results.suggested_query_);
+    if (!results.error_.empty()) return results;
+    results.matches =
+        refine_matches(*results.index, results.encoded, nthreads, block_size);
+    return results;
+  }
+
+  // See complete_query.
+  std::vector<std::string> complete(const std::string& query,
+                                    size_t max_results = 8) const {
+    std::shared_ptr<Index> index = handle.get();
+    return complete_query(index->reader, query, max_results);
+  }
+
+ private:
+  IndexHandle handle;
+  size_t nthreads;
+  size_t block_size;
+};
+
+}  // namespace ppt
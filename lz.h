@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace ppt {
+
+// A small LZ77 byte codec in the style of LZ4, for compressing index
+// sections in independently decodable blocks.  Favours decode speed over
+// ratio: greedy matching with one hash probe per position.
+//
+// A block is a sequence of
+//
+//   u8  token: literal count (high nibble), match length - 4 (low nibble)
+//   ... 255-continued extra literal count, if the high nibble is 15
+//   ... the literals
+//   u16 match offset (little endian, 1..65535)
+//   ... 255-continued extra match length, if the low nibble is 15
+//
+// except that the last sequence stops after its literals.
+
+constexpr size_t lz_min_match = 4;
+
+namespace lz_detail {
+
+inline uint32_t load32(const unsigned char* p) {
+  uint32_t x;
+  std::memcpy(&x, p, 4);
+  return x;
+}
+
+inline void put_length(std::string& out, size_t length) {
+  while (length >= 255) {
+    out += char(255);
+    length -= 255;
+  }
+  out += char(length);
+}
+
+inline bool get_length(const unsigned char*& in, const unsigned char* end,
+                       size_t& length) {
+  while (true) {
+    if (in == end) return false;
+    unsigned char b = *in++;
+    length += b;
+    if (b != 255) return true;
+  }
+}
+
+}  // namespace lz_detail
+
+// Appends the compression of [data, data + length) to out.
+inline void lz_compress(const void* data, size_t length, std::string& out) {
+  using namespace lz_detail;
+  const unsigned char* begin = (const unsigned char*)data;
+  const unsigned char* end = begin + length;
+  constexpr int hash_bits = 14;
+  std::vector<uint32_t> table(size_t(1) << hash_bits, 0);
+  auto hash = [](uint32_t x) { return (x * 2654435761u) >> (32 - hash_bits); };
+
+  const unsigned char* literals = begin;
+  auto emit = [&](const unsigned char* match, size_t offset,
+                  size_t match_length) {
+    size_t num_literals = match - literals;
+    size_t extra_match = match_length - lz_min_match;
+    out += char((std::min<size_t>(num_literals, 15) << 4) |
+                std::min<size_t>(extra_match, 15));
+    if (num_literals >= 15) put_length(out, num_literals - 15);
+    out.append((const char*)literals, num_literals);
+    if (match_length == 0) return;
+    out += char(offset & 0xff);
+    out += char(offset >> 8);
+    if (extra_match >= 15) put_length(out, extra_match - 15);
+  };
+
+  const unsigned char* p = begin;
+  while (p + lz_min_match <= end) {
+    uint32_t& slot = table[hash(load32(p))];
+    const unsigned char* candidate = begin + slot;
+    slot = p - begin;
+    if (candidate < p && size_t(p - candidate) <= 0xffff &&
+        load32(candidate) == load32(p)) {
+      size_t match_length = lz_min_match;
+      while (p + match_length < end &&
+             candidate[match_length] == p[match_length])
+        match_length++;
+      emit(p, p - candidate, match_length);
+      p += match_length;
+      literals = p;
+    } else {
+      p++;
+    }
+  }
+  // Final literals; a zero low nibble and no offset follow.
+  size_t num_literals = end - literals;
+  out += char(std::min<size_t>(num_literals, 15) << 4);
+  if (num_literals >= 15) put_length(out, num_literals - 15);
+  out.append((const char*)literals, num_literals);
+}
+
+// Decodes the first prefix_length bytes of the compressed block [data,
+// data + length), whose decompressed length is output_length, to output.
+// Only as much of the block as they need is decoded.  Returns false if the
+// block is corrupt.
+inline bool lz_decompress_prefix(const void* data, size_t length,
+                                 void* output, size_t output_length,
+                                 size_t prefix_length) {
+  using namespace lz_detail;
+  const unsigned char* in = (const unsigned char*)data;
+  const unsigned char* in_end = in + length;
+  unsigned char* out = (unsigned char*)output;
+  unsigned char* out_begin = out;
+  unsigned char* out_end = out + output_length;
+  unsigned char* prefix_end = out + std::min(prefix_length, output_length);
+  // Whole blocks are decoded to the end of the input, so that trailing
+  // garbage is caught.
+  bool partial = prefix_end != out_end;
+  while (true) {
+    // Every block ends with a literals-only sequence, so one that stops
+    // after a match has lost its end.
+    if (in == in_end) return false;
+    unsigned char token = *in++;
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && !get_length(in, in_end, num_literals))
+      return false;
+    if (size_t(in_end - in) < num_literals ||
+        size_t(out_end - out) < num_literals)
+      return false;
+    if (partial && size_t(prefix_end - out) <= num_literals) {
+      std::memcpy(out, in, prefix_end - out);
+      return true;
+    }
+    // Most runs are short, and copying a fixed 16 bytes is much faster
+    // than an exact copy where there is room to.
+    if (num_literals <= 16 && in_end - in >= 16 && prefix_end - out >= 16)
+      std::memcpy(out, in, 16);
+    else
+      std::memcpy(out, in, num_literals);
+    in += num_literals;
+    out += num_literals;
+    if (in == in_end) break;  // last sequence
+
+    if (in_end - in < 2) return false;
+    size_t offset = in[0] | (size_t(in[1]) << 8);
+    in += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15 && !get_length(in, in_end, match_length))
+      return false;
+    match_length += lz_min_match;
+    if (offset == 0 || size_t(out - out_begin) < offset ||
+        size_t(out_end - out) < match_length)
+      return false;
+    bool last = partial && size_t(prefix_end - out) <= match_length;
+    if (last) match_length = prefix_end - out;
+    const unsigned char* from = out - offset;
+    if (match_length <= 16 && offset >= 16 && prefix_end - out >= 16) {
+      std::memcpy(out, from, 16);
+    } else if (offset >= match_length) {
+      std::memcpy(out, from, match_length);
+    } else {
+      // Overlaps itself, so byte by byte.
+      for (size_t i = 0; i < match_length; i++) out[i] = from[i];
+    }
+    out += match_length;
+    if (last) return true;
+  }
+  return out == out_end;
+}
+
+// Decodes the compressed block [data, data + length) into exactly
+// output_length bytes at output.  Returns false if the block is corrupt.
+inline bool lz_decompress(const void* data, size_t length, void* output,
+                          size_t output_length) {
+  return lz_decompress_prefix(data, length, output, output_length,
+                              output_length);
+}
+
+}  // namespace ppt
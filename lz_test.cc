@@ -0,0 +1,182 @@
+#include "lz.h"
+
+#include <random>
+
+#include "dvc/log.h"
+#include "dvc/program.h"
+
+namespace {
+
+std::mt19937 rand_engine(42);
+
+std::string random_bytes(size_t length) {
+  std::string s(length, 0);
+  for (char& c : s) c = char(rand_engine());
+  return s;
+}
+
+// The decompressed position at which each sequence of `block` starts and
+// its literals end, and the largest match offset, found by walking the
+// block format directly.
+struct Sequences {
+  std::vector<size_t> boundaries;
+  size_t max_offset = 0;
+};
+
+Sequences parse_sequences(const std::string& block) {
+  Sequences sequences;
+  const unsigned char* in = (const unsigned char*)block.data();
+  const unsigned char* end = in + block.size();
+  size_t out = 0;
+  while (in < end) {
+    sequences.boundaries.push_back(out);
+    unsigned char token = *in++;
+    size_t num_literals = token >> 4;
+    if (num_literals == 15)
+      DVC_ASSERT(ppt::lz_detail::get_length(in, end, num_literals));
+    in += num_literals;
+    out += num_literals;
+    sequences.boundaries.push_back(out);
+    if (in == end) break;
+    size_t offset = in[0] | (size_t(in[1]) << 8);
+    in += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15)
+      DVC_ASSERT(ppt::lz_detail::get_length(in, end, match_length));
+    DVC_ASSERT_GT(offset, 0);
+    DVC_ASSERT_LE(offset, out);
+    sequences.max_offset = std::max(sequences.max_offset, offset);
+    out += match_length + ppt::lz_min_match;
+  }
+  DVC_ASSERT(in == end);
+  sequences.boundaries.push_back(out);
+  return sequences;
+}
+
+// Decodes the first prefix_length bytes of `block` into a buffer filled
+// with a marker, and checks that exactly those bytes were written.
+void test_prefix(const std::string& data, const std::string& block,
+                 size_t prefix_length) {
+  constexpr char marker = char(0xa5);
+  std::string output(data.size(), marker);
+  DVC_ASSERT(ppt::lz_decompress_prefix(block.data(), block.size(),
+                                       output.data(), output.size(),
+                                       prefix_length),
+             prefix_length);
+  size_t n = std::min(prefix_length, data.size());
+  DVC_ASSERT(output.compare(0, n, data, 0, n) == 0, prefix_length);
+  for (size_t i = n; i < output.size(); i++)
+    DVC_ASSERT_EQ(output[i], marker, "wrote past prefix ", prefix_length);
+}
+
+// Compresses `data`, checks that it decompresses whole and at every
+// prefix_length within a byte of a sequence boundary, and returns the
+// compressed block.
+std::string test_round_trip(const std::string& data) {
+  std::string block;
+  ppt::lz_compress(data.data(), data.size(), block);
+  std::string output(data.size(), 0);
+  DVC_ASSERT(ppt::lz_decompress(block.data(), block.size(), output.data(),
+                                output.size()));
+  DVC_ASSERT(output == data);
+
+  for (size_t boundary : parse_sequences(block).boundaries)
+    for (size_t prefix_length = boundary > 0 ? boundary - 1 : 0;
+         prefix_length <= boundary + 1; prefix_length++)
+      test_prefix(data, block, prefix_length);
+  test_prefix(data, block, data.size() + 100);
+  return block;
+}
+
+// Checks that decoding `block` fails.
+void test_corrupt(const std::string& block, size_t output_length) {
+  std::string output(output_length, 0);
+  DVC_ASSERT(!ppt::lz_decompress(block.data(), block.size(), output.data(),
+                                 output.size()));
+}
+
+void test_round_trips() {
+  test_round_trip("");
+  for (size_t length : {1, 3, 4, 14, 15, 16, 17, 269, 270, 271, 525, 4096})
+    test_round_trip(random_bytes(length));
+
+  // Long runs, which match at offset 1 with 255-continued lengths.
+  for (size_t length : {5, 18, 19, 20, 273, 274, 275, 1 << 20})
+    test_round_trip(std::string(length, 'x'));
+
+  // Overlapping matches at small offsets.
+  for (size_t period = 2; period < 40; period++) {
+    std::string unit = random_bytes(period);
+    std::string data;
+    while (data.size() < 1000) data += unit;
+    test_round_trip(random_bytes(period) + data);
+  }
+
+  // A mixture of literal runs and matches of every length.
+  std::string mixed;
+  while (mixed.size() < 20000) {
+    if (mixed.size() > 100 && rand_engine() % 2) {
+      size_t from = rand_engine() % (mixed.size() - 50);
+      mixed += mixed.substr(from, 4 + rand_engine() % 40);
+    } else {
+      mixed += random_bytes(rand_engine() % 40);
+    }
+  }
+  test_round_trip(mixed);
+}
+
+// A random 64 bytes that recur `distance` bytes later, separated by a run
+// of zeros that adds few hash table entries, so the repeat is found at
+// offsets up to 0xffff and not beyond.
+void test_far_offsets() {
+  for (size_t distance : {0xfff0, 0xfffe, 0xffff, 0x10000, 0x10001}) {
+    std::string repeated = random_bytes(64);
+    std::string data =
+        repeated + std::string(distance - repeated.size(), 0) + repeated;
+    Sequences sequences = parse_sequences(test_round_trip(data));
+    if (distance <= 0xffff)
+      DVC_ASSERT_EQ(sequences.max_offset, distance);
+    else
+      DVC_ASSERT_LT(sequences.max_offset, distance);
+  }
+}
+
+void test_rejects_corrupt_blocks() {
+  std::string data = random_bytes(300) + std::string(300, 'y');
+  for (int i = 0; i < 20; i++) data += data.substr(rand_engine() % 500, 50);
+  std::string block;
+  ppt::lz_compress(data.data(), data.size(), block);
+
+  for (size_t length = 0; length < block.size(); length++)
+    test_corrupt(block.substr(0, length), data.size());
+  test_corrupt(block + '\0', data.size());
+  test_corrupt(block, data.size() - 1);
+  test_corrupt(block, data.size() + 1);
+
+  // Hand-made blocks: a match before any output, at offset 0, longer than
+  // the output, and literals longer than the input.
+  test_corrupt(std::string("\x00\x01\x00", 3), 4);
+  test_corrupt(std::string("\x10" "a" "\x00\x00", 4), 5);
+  test_corrupt(std::string("\x10" "a" "\x01\x00", 4), 4);
+  test_corrupt(std::string("\x20" "a", 2), 2);
+  test_corrupt(std::string("\xf0\xff", 2), 300);
+
+  // Random damage must be caught or decode to something, never crash.
+  std::string output(data.size(), 0);
+  for (int i = 0; i < 10000; i++) {
+    std::string damaged = block;
+    damaged[rand_engine() % damaged.size()] ^= char(1 + rand_engine() % 255);
+    ppt::lz_decompress_prefix(damaged.data(), damaged.size(), output.data(),
+                              output.size(), rand_engine() % data.size());
+  }
+}
+
+}  // namespace
+
+int main() {
+  dvc::program program;
+
+  test_round_trips();
+  test_far_offsets();
+  test_rejects_corrupt_blocks();
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "token_codec.h"
+#include "varint.h"
+
+namespace ppt {
+
+// Up to this many matches of a query are kept by offset; see MatchSet.
+constexpr size_t max_match_set_offsets = 1 << 20;
+
+// The range_size of MatchSet bitmaps of a code section not compressed.
+constexpr size_t match_set_range_size = 1 << 16;
+
+// Bytes of match sets an Index keeps for refinement; see MatchSetCache.
+constexpr size_t match_set_cache_capacity = 64 << 20;
+
+// Up to this many matches of a query are persisted by offset; see
+// serialize_match_set.
+constexpr size_t max_persisted_match_set_offsets = 1 << 16;
+
+// Where find_matches found the matches of a query, so that a longer query
+// that starts with it need only look there: every match of the longer
+// query is found at the same place as one of this query.  If there are
+// at most max_match_set_offsets, these are their code offsets, ascending
+// and with a repeat for each further match found at the same offset (see
+// SuperTokenQuery).  Otherwise they are only a bitmap of which ranges of
+// range_size bytes of the code section hold any, which bounds the memory
+// of a frequent query to a bit per range.
+struct MatchSet {
+  size_t num_matches = 0;
+  std::vector<size_t> offsets;  // if exact()
+  size_t range_size = 0;
+  std::vector<uint64_t> ranges;  // unless exact()
+
+  bool exact() const { return ranges.empty(); }
+
+  bool in_range(size_t range) const {
+    return ranges[range / 64] >> (range % 64) & 1;
+  }
+
+  size_t bytes() const {
+    return sizeof(MatchSet) + offsets.size() * sizeof(size_t) +
+           ranges.size() * sizeof(uint64_t);
+  }
+};
+
+// The number of 64-bit words of a MatchSet bitmap of `code_length` bytes
+// of code in ranges of `range_size`.
+inline size_t match_set_words(size_t code_length, size_t range_size) {
+  return (code_length / range_size + 64) / 64;
+}
+
+// Collects the MatchSet of a scan from the matches of each of its blocks.
+// Thread-safe.
+class MatchSetBuilder {
+ public:
+  MatchSetBuilder(size_t code_length, size_t range_size)
+      : range_size_(range_size),
+        ranges_(match_set_words(code_length, range_size)) {}
+
+  size_t range_size() const { return range_size_; }
+
+  // Whether there are too many matches to keep their offsets, in which
+  // case blocks may stop recording them.
+  bool overflowed() const { return overflowed_; }
+
+  // Adds the matches of one block: `num_matches` of them, in the ranges
+  // `ranges`, at `offsets` unless the block stopped recording them.
+  void add(size_t num_matches, const std::vector<size_t>& offsets,
+           const std::vector<size_t>& ranges) {
+    if (num_matches == 0) return;
+    std::lock_guard lock(mu_);
+    num_matches_ += num_matches;
+    for (size_t range : ranges)
+      ranges_[range / 64] |= uint64_t(1) << range % 64;
+    if (num_matches_ > max_match_set_offsets || offsets.size() < num_matches)
+      overflowed_ = true;
+    if (overflowed_)
+      std::vector<size_t>().swap(offsets_);
+    else
+      offsets_.insert(offsets_.end(), offsets.begin(), offsets.end());
+  }
+
+  MatchSet build() {
+    std::lock_guard lock(mu_);
+    MatchSet set;
+    set.num_matches = num_matches_;
+    if (overflowed_) {
+      set.range_size = range_size_;
+      set.ranges = std::move(ranges_);
+    } else {
+      std::sort(offsets_.begin(), offsets_.end());
+      set.offsets = std::move(offsets_);
+    }
+    return set;
+  }
+
+ private:
+  const size_t range_size_;
+  std::mutex mu_;
+  size_t num_matches_ = 0;
+  std::atomic_bool overflowed_ = false;
+  std::vector<size_t> offsets_;
+  std::vector<uint64_t> ranges_;
+};
+
+// The lengths of the queries that `encoded` starts with (including
+// itself), shortest first.  Codes are self-delimiting, so those are the
+// prefixes of `encoded` that end after one of its codes.
+inline std::vector<size_t> query_prefix_lengths(
+    const std::vector<std::byte>& encoded) {
+  std::vector<size_t> ends;
+  for (const std::byte* p = encoded.data();
+       p < encoded.data() + encoded.size();) {
+    decode_token(p);
+    ends.push_back(p - encoded.data());
+  }
+  return ends;
+}
+
+// Byte encoding of `set`, for QueryCache.  If it has more than
+// max_persisted_match_set_offsets offsets, only the bitmap of ranges of
+// `range_size` bytes of the `code_length` bytes of code that hold them is
+// kept, which bounds the encoding to a bit per range.
+inline std::string serialize_match_set(const MatchSet& set,
+                                       size_t code_length,
+                                       size_t range_size) {
+  std::string out;
+  auto put = [&](uint64_t x) { out.append((const char*)&x, sizeof x); };
+  put(set.num_matches);
+  if (set.exact() && set.offsets.size() <= max_persisted_match_set_offsets) {
+    put(0);
+    put(set.offsets.size());
+    size_t last = 0;
+    for (size_t offset : set.offsets) {
+      put_varint64(out, offset - last);
+      last = offset;
+    }
+  } else if (set.exact()) {
+    std::vector<uint64_t> ranges(match_set_words(code_length, range_size));
+    for (size_t offset : set.offsets) {
+      size_t range = offset / range_size;
+      ranges[range / 64] |= uint64_t(1) << range % 64;
+    }
+    put(range_size);
+    put(ranges.size());
+    out.append((const char*)ranges.data(), ranges.size() * sizeof(uint64_t));
+  } else {
+    put(set.range_size);
+    put(set.ranges.size());
+    out.append((const char*)set.ranges.data(),
+               set.ranges.size() * sizeof(uint64_t));
+  }
+  return out;
+}
+
+// Decodes a serialize_match_set of an index with `code_length` bytes of
+// code, or returns nullopt if `in` is not one.
+inline std::optional<MatchSet> deserialize_match_set(std::string_view in,
+                                                     size_t code_length) {
+  auto get = [&](uint64_t& x) {
+    if (in.size() < sizeof x) return false;
+    ::memcpy(&x, in.data(), sizeof x);
+    in.remove_prefix(sizeof x);
+    return true;
+  };
+  MatchSet set;
+  uint64_t num_matches, range_size, count;
+  if (!get(num_matches) || !get(range_size) || !get(count))
+    return std::nullopt;
+  set.num_matches = num_matches;
+  if (range_size == 0) {
+    if (count > in.size()) return std::nullopt;
+    const uint8_t* p = (const uint8_t*)in.data();
+    const uint8_t* end = p + in.size();
+    set.offsets.resize(count);
+    size_t offset = 0;
+    for (size_t& out : set.offsets) {
+      uint64_t delta;
+      if (!get_varint64(p, end, delta) || delta >= code_length - offset)
+        return std::nullopt;
+      out = offset += delta;
+    }
+    if (p != end) return std::nullopt;
+  } else {
+    if (count != match_set_words(code_length, range_size) ||
+        in.size() != count * sizeof(uint64_t))
+      return std::nullopt;
+    set.range_size = range_size;
+    set.ranges.resize(count);
+    ::memcpy(set.ranges.data(), in.data(), in.size());
+  }
+  return set;
+}
+
+// Size-bounded LRU map from encoded query (see encode_query) to its
+// MatchSet, held in memory by an Index that serves many queries (see
+// IndexHandle), so a query refined by typing more tokens is found from the
+// matches of the one before.  Thread-safe.
+class MatchSetCache {
+ public:
+  explicit MatchSetCache(size_t capacity = match_set_cache_capacity)
+      : capacity_(capacity) {}
+
+  // The MatchSet of the longest query that `encoded` starts with (see
+  // query_prefix_lengths), or null if none is cached.
+  std::shared_ptr<const MatchSet> find_prefix(
+      const std::vector<std::byte>& encoded) {
+    std::vector<size_t> ends = query_prefix_lengths(encoded);
+    std::lock_guard lock(mu_);
+    for (auto end = ends.rbegin(); end != ends.rend(); end++) {
+      auto it =
+          entries_.find(std::string((const char*)encoded.data(), *end));
+      if (it == entries_.end()) continue;
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->second;
+    }
+    return nullptr;
+  }
+
+  void insert(const std::vector<std::byte>& encoded, MatchSet set) {
+    std::string key((const char*)encoded.data(), encoded.size());
+    size_t bytes = key.size() + set.bytes();
+    if (bytes > capacity_) return;
+    std::lock_guard lock(mu_);
+    if (auto it = entries_.find(key); it != entries_.end()) {
+      total_bytes_ -= it->first.size() + it->second->second->bytes();
+      lru_.erase(it->second);
+      entries_.erase(it);
+    }
+    lru_.emplace_front(key, std::make_shared<const MatchSet>(std::move(set)));
+    entries_.emplace(std::move(key), lru_.begin());
+    total_bytes_ += bytes;
+    while (total_bytes_ > capacity_) {
+      const auto& [oldest, oldest_set] = lru_.back();
+      total_bytes_ -= oldest.size() + oldest_set->bytes();
+      entries_.erase(oldest);
+      lru_.pop_back();
+    }
+  }
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<const MatchSet>>;
+
+  const size_t capacity_;
+  std::mutex mu_;
+  std::list<Entry> lru_;  // most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+  size_t total_bytes_ = 0;  // keys plus sets
+};
+
+}  // namespace ppt
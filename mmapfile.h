@@ -7,27 +7,206 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <string_view>
+#include <thread>
+#include <vector>
 #include "dvc/log.h"
+#include "numa.h"
 
 namespace ppt {
 
+// Where the pages of an mmapfile live on a multi-socket host.
+//   none:       wherever the page cache put them.
+//   interleave: one anonymous copy, pages interleaved across all nodes.
+//               Consecutive pages alternate nodes, so no block of a scan
+//               is local to any one node; workers are left unpinned and
+//               memory bandwidth is spread evenly instead.
+//   replicate:  one anonymous copy bound to each node, each scanned by
+//               workers pinned to its node.
+enum class numa_placement { none, interleave, replicate };
+
+inline numa_placement parse_numa_placement(std::string_view s) {
+  if (s == "none") return numa_placement::none;
+  if (s == "interleave") return numa_placement::interleave;
+  if (s == "replicate") return numa_placement::replicate;
+  DVC_FATAL("Unknown numa placement `", s, "`");
+}
+
+// How an mmapfile is made resident before it is used.
+//   mlock:             mmap then mlock the whole file (needs RLIMIT_MEMLOCK).
+//   lazy:              plain mmap, pages fault in on first touch.
+//   populate:          mmap with MAP_POPULATE.
+//   advise:            mmap with MADV_WILLNEED and MADV_HUGEPAGE.
+//   parallel_prefault: mmap then touch every page from prefault_threads.
+//   hugepage_copy:     copy into a 2MB-aligned MADV_HUGEPAGE anonymous
+//                      mapping, so scans take far fewer TLB misses.
+//   stream:            plain mmap like lazy, but codesearch() streams the
+//                      code section from disk rather than scanning the
+//                      mapping, for indexes larger than RAM.  (A compressed
+//                      code section is always read through the mapping.)
+enum class residency_policy {
+  mlock,
+  lazy,
+  populate,
+  advise,
+  parallel_prefault,
+  hugepage_copy,
+  stream
+};
+
+// The residency_policy named `s`, or nullopt if there is none.
+inline std::optional<residency_policy> find_residency_policy(
+    std::string_view s) {
+  if (s == "mlock") return residency_policy::mlock;
+  if (s == "lazy") return residency_policy::lazy;
+  if (s == "populate") return residency_policy::populate;
+  if (s == "advise") return residency_policy::advise;
+  if (s == "parallel_prefault") return residency_policy::parallel_prefault;
+  if (s == "hugepage_copy") return residency_policy::hugepage_copy;
+  if (s == "stream") return residency_policy::stream;
+  return std::nullopt;
+}
+
+inline residency_policy parse_residency_policy(std::string_view s) {
+  std::optional<residency_policy> policy = find_residency_policy(s);
+  if (!policy) DVC_FATAL("Unknown residency `", s, "`");
+  return *policy;
+}
+
+struct mmap_options {
+  residency_policy residency = residency_policy::mlock;
+  numa_placement numa = numa_placement::none;
+  size_t prefault_threads = 8;
+  size_t stream_chunk_size = 16 << 20;
+};
+
+// Residency of the primary mapping, from /proc/self/smaps.
+struct residency_stats {
+  double ready_seconds = 0;   // time from open to usable
+  size_t length = 0;          // bytes mapped
+  size_t rss = 0;             // bytes resident
+  size_t huge_bytes = 0;      // bytes backed by huge pages (anon or file)
+  size_t locked = 0;          // bytes mlocked
+  size_t mmu_page_size = 0;   // smallest MMU page size over the mapping
+};
+
 class mmapfile {
  public:
-  mmapfile(const std::filesystem::path& path) : path(path) {
+  mmapfile(const std::filesystem::path& path, const mmap_options& options = {})
+      : path(path), options(options) {
+    auto start = std::chrono::steady_clock::now();
     DVC_ASSERT(exists(path), "File not found: ", path);
     fd = ::open(path.string().c_str(), O_RDONLY);
     DVC_ASSERT_NE(fd, -1, "Unable to open ", path, ": ", strerror(errno));
     length = file_size(path);
-    addr = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    int flags = MAP_SHARED;
+    if (options.residency == residency_policy::populate)
+      flags |= MAP_POPULATE;
+    addr = ::mmap(nullptr, length, PROT_READ, flags, fd, 0);
     DVC_ASSERT_NE(addr, MAP_FAILED, "Unable to mmap ", path, ": ",
                   strerror(errno));
-    DVC_ASSERT_EQ(::mlock(addr, length), 0, "Unable to mlock ", path, ": ",
-                  strerror(errno));
+
+    // Page cache pages ignore mbind, so placed copies are anonymous.
+    if (options.numa == numa_placement::interleave) {
+      copies.push_back(copy_to(MPOL_INTERLEAVE, numa::online_nodes()));
+    } else if (options.numa == numa_placement::replicate) {
+      nodes = numa::online_nodes();
+      for (size_t node : nodes) copies.push_back(copy_to(MPOL_BIND, {node}));
+    } else if (options.residency == residency_policy::hugepage_copy) {
+      copies.push_back(copy_to(MPOL_DEFAULT, {}));
+    }
+
+    if (!copies.empty()) {
+      DVC_ASSERT_EQ(::munmap(addr, length), 0, "munmap ", path,
+                    "failed: ", strerror(errno));
+      addr = nullptr;
+    } else if (options.residency == residency_policy::mlock) {
+      DVC_ASSERT_EQ(::mlock(addr, length), 0, "Unable to mlock ", path, ": ",
+                    strerror(errno));
+    } else if (options.residency == residency_policy::advise) {
+      DVC_ASSERT_EQ(::madvise(addr, length, MADV_WILLNEED), 0,
+                    "Unable to madvise ", path, ": ", strerror(errno));
+      // Only honoured by kernels with CONFIG_READ_ONLY_THP_FOR_FS.
+      ::madvise(addr, length, MADV_HUGEPAGE);
+    } else if (options.residency == residency_policy::parallel_prefault) {
+      parallel_for_pages([&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i += page_size())
+          (void)*(volatile const char*)((const char*)addr + i);
+      });
+    }
+    ready_seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  }
+
+  std::string_view get() {
+    return {(const char*)(copies.empty() ? addr : copies[0]), length};
   }
 
-  std::string_view get() { return {(const char*)addr, length}; }
+  // The copy local to the `i`th of the nodes when replicated, otherwise
+  // get().
+  std::string_view get(size_t i) {
+    if (copies.size() <= 1) return get();
+    return {(const char*)copies[i % copies.size()], length};
+  }
+
+  // Number of NUMA nodes to pin workers to, one per copy (1 unless
+  // replicated).
+  size_t num_nodes() const { return std::max<size_t>(nodes.size(), 1); }
+
+  // The id of the `i`th of them, for numa::pin_to_node.
+  size_t node_id(size_t i) const { return nodes[i % nodes.size()]; }
+
+  // Residency when first asked for, which is measured only then: parsing
+  // /proc/self/smaps costs more the more the process maps, so later calls,
+  // such as one per query, return the same copy.  See measure_stats.
+  residency_stats stats() {
+    std::call_once(stats_once, [&] { first_stats = measure_stats(); });
+    return first_stats;
+  }
+
+  // Residency now.
+  residency_stats measure_stats() {
+    residency_stats stats;
+    stats.ready_seconds = ready_seconds;
+    stats.length = length;
+    uintptr_t begin = (uintptr_t)get().data();
+    uintptr_t end = begin + length;
+    std::ifstream smaps("/proc/self/smaps");
+    bool in_range = false;
+    for (std::string line; std::getline(smaps, line);) {
+      std::istringstream fields(line);
+      std::string key;
+      fields >> key;
+      if (key.empty()) continue;
+      if (key.back() != ':') {
+        size_t dash = key.find('-');
+        if (dash == std::string::npos) continue;
+        uintptr_t vma_begin = std::stoull(key.substr(0, dash), nullptr, 16);
+        uintptr_t vma_end = std::stoull(key.substr(dash + 1), nullptr, 16);
+        in_range = vma_begin < end && begin < vma_end;
+        continue;
+      }
+      if (!in_range) continue;
+      size_t kb = 0;
+      fields >> kb;
+      if (key == "Rss:") stats.rss += kb << 10;
+      if (key == "AnonHugePages:" || key == "FilePmdMapped:")
+        stats.huge_bytes += kb << 10;
+      if (key == "Locked:") stats.locked += kb << 10;
+      if (key == "MMUPageSize:" &&
+          (stats.mmu_page_size == 0 || (kb << 10) < stats.mmu_page_size))
+        stats.mmu_page_size = kb << 10;
+    }
+    return stats;
+  }
 
   void lock() {
     DVC_ASSERT_EQ(0, ::flock(fd, LOCK_EX),
@@ -40,19 +219,88 @@ class mmapfile {
   }
 
   ~mmapfile() {
-    DVC_ASSERT_EQ(::munlock(addr, length), 0, "Unable to mlock ", path, ": ",
-                  strerror(errno));
-    DVC_ASSERT_EQ(::munmap(addr, length), 0, "munmap ", path,
-                  "failed: ", strerror(errno));
+    bool locked = options.residency == residency_policy::mlock;
+    for (size_t i = 0; i < copies.size(); i++) {
+      if (locked)
+        DVC_ASSERT_EQ(::munlock(copies[i], length), 0,
+                      "Unable to munlock copy of ", path, ": ",
+                      strerror(errno));
+      DVC_ASSERT_EQ(::munmap(copies[i], copy_lengths[i]), 0, "munmap copy of ",
+                    path, "failed: ", strerror(errno));
+    }
+    if (addr) {
+      if (locked)
+        DVC_ASSERT_EQ(::munlock(addr, length), 0, "Unable to mlock ", path,
+                      ": ", strerror(errno));
+      DVC_ASSERT_EQ(::munmap(addr, length), 0, "munmap ", path,
+                    "failed: ", strerror(errno));
+    }
     DVC_ASSERT_EQ(::close(fd), 0, "close ", path,
                   " failed: ", ::strerror(errno));
   }
 
  private:
+  static constexpr size_t huge_page_size = 2 << 20;
+
+  static size_t page_size() { return ::sysconf(_SC_PAGESIZE); }
+
+  // Calls f(begin, end) over page-aligned stripes of [0, length), one
+  // stripe per prefault thread.
+  template <typename F>
+  void parallel_for_pages(F f) {
+    size_t nthreads = std::max<size_t>(options.prefault_threads, 1);
+    size_t stripe = (length / nthreads + page_size()) & ~(page_size() - 1);
+    std::vector<std::thread> threads;
+    for (size_t begin = 0; begin < length; begin += stripe)
+      threads.emplace_back(f, begin, std::min(begin + stripe, length));
+    for (std::thread& t : threads) t.join();
+  }
+
+  // Copies the file into a fresh anonymous mapping with memory policy
+  // `mode` over `policy_nodes` (MPOL_DEFAULT for none).
+  void* copy_to(int mode, const std::vector<size_t>& policy_nodes) {
+    bool huge = options.residency == residency_policy::hugepage_copy;
+    size_t align = huge ? huge_page_size : page_size();
+    size_t copy_length = (length + align - 1) & ~(align - 1);
+    // Over-allocate so the copy can start on an alignment boundary.
+    size_t map_length = copy_length + (huge ? align : 0);
+    char* map = (char*)::mmap(nullptr, map_length, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    DVC_ASSERT_NE((void*)map, MAP_FAILED, "Unable to mmap copy of ", path,
+                  ": ", strerror(errno));
+    char* copy = (char*)(((uintptr_t)map + align - 1) & ~(align - 1));
+    if (copy != map) ::munmap(map, copy - map);
+    if (copy + copy_length != map + map_length)
+      ::munmap(copy + copy_length, (map + map_length) - (copy + copy_length));
+
+    if (mode != MPOL_DEFAULT)
+      numa::mbind(copy, copy_length, mode, policy_nodes);
+    if (huge)
+      DVC_ASSERT_EQ(::madvise(copy, copy_length, MADV_HUGEPAGE), 0,
+                    "Unable to madvise copy of ", path, ": ", strerror(errno));
+    parallel_for_pages([&](size_t begin, size_t end) {
+      ::memcpy(copy + begin, (const char*)addr + begin, end - begin);
+    });
+    DVC_ASSERT_EQ(::mprotect(copy, copy_length, PROT_READ), 0,
+                  "Unable to mprotect copy of ", path, ": ", strerror(errno));
+    if (options.residency == residency_policy::mlock)
+      DVC_ASSERT_EQ(::mlock(copy, length), 0, "Unable to mlock copy of ", path,
+                    ": ", strerror(errno));
+    copy_lengths.push_back(copy_length);
+    return copy;
+  }
+
   std::filesystem::path path;
+  mmap_options options;
   int fd = -1;
   size_t length = 0;
   void* addr = nullptr;
+  std::vector<void*> copies;
+  std::vector<size_t> copy_lengths;
+  std::vector<size_t> nodes;  // ids of the nodes copies are bound to
+  double ready_seconds = 0;
+  std::once_flag stats_once;
+  residency_stats first_stats;
 
   mmapfile(mmapfile&&) = delete;
   mmapfile(const mmapfile&) = delete;
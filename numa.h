@@ -0,0 +1,85 @@
+#pragma once
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cctype>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dvc/log.h"
+
+namespace ppt::numa {
+
+// Parses a sysfs list such as "0-3,8-11" into {0,1,2,3,8,9,10,11}.
+inline std::vector<size_t> parse_list(std::string_view list) {
+  std::vector<size_t> result;
+  while (!list.empty()) {
+    size_t comma = list.find(',');
+    std::string range(list.substr(0, comma));
+    list = comma == std::string_view::npos ? "" : list.substr(comma + 1);
+    while (!range.empty() && std::isspace(range.back())) range.pop_back();
+    if (range.empty()) continue;
+    size_t dash = range.find('-');
+    size_t first = std::stoul(range.substr(0, dash));
+    size_t last =
+        dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+    for (size_t i = first; i <= last; i++) result.push_back(i);
+  }
+  return result;
+}
+
+inline std::string read_sysfs(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+// Ids of the NUMA nodes online, which need not be contiguous (e.g. 0 and
+// 2), or just node 0 if the kernel has no NUMA support.
+inline std::vector<size_t> online_nodes() {
+  std::vector<size_t> nodes =
+      parse_list(read_sysfs("/sys/devices/system/node/online"));
+  if (nodes.empty()) nodes.push_back(0);
+  return nodes;
+}
+
+inline std::vector<size_t> node_cpus(size_t node) {
+  return parse_list(read_sysfs("/sys/devices/system/node/node" +
+                               std::to_string(node) + "/cpulist"));
+}
+
+// Restricts the calling thread to the cpus of `node`.
+inline void pin_to_node(size_t node) {
+  std::vector<size_t> cpus = node_cpus(node);
+  if (cpus.empty()) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t cpu : cpus) CPU_SET(cpu, &set);
+  DVC_ASSERT_EQ(0, ::sched_setaffinity(0, sizeof(set), &set),
+                "Unable to pin thread to node ", node, ": ", strerror(errno));
+}
+
+// Sets the memory policy `mode` (MPOL_BIND, MPOL_INTERLEAVE...) over
+// `nodes` for the anonymous range [addr, addr+length).  Must be called
+// before the range is faulted in.
+inline void mbind(void* addr, size_t length, int mode,
+                  const std::vector<size_t>& nodes) {
+  constexpr size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(1);
+  for (size_t node : nodes) {
+    if (node / bits >= mask.size()) mask.resize(node / bits + 1);
+    mask[node / bits] |= 1ul << (node % bits);
+  }
+  DVC_ASSERT_EQ(0,
+                ::syscall(SYS_mbind, addr, length, mode, mask.data(),
+                          mask.size() * bits + 1, 0),
+                "Unable to mbind: ", strerror(errno));
+}
+
+}  // namespace ppt::numa
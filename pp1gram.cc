@@ -29,22 +29,28 @@ void ppverify(int argc, char** argv) {
 	  if ((i & (i-1)) == 0) DVC_DUMP(i);
     const idx::FileInfo& file_info = index.file_infos[i];
 
-    const std::byte* code = index.filecode(file_info);
+    std::vector<std::byte> buffer;
+    const std::byte* file_code = index.code_bytes(
+        file_info.code_offset, file_info.code_length, buffer);
+    const std::byte* code = file_code;
 
     std::unordered_set<uint32_t> tokens;
+    std::vector<uint32_t> token_ids;
 
     while (true) {
-      uint32_t token = decode_token(code);
-      if (token == 0)
+      uint32_t code_id = decode_token(code);
+      if (code_id == 0)
 	      break;
 
-      tokens.insert(token);
+      token_ids.clear();
+      index.append_tokens(code_id, token_ids);
+      tokens.insert(token_ids.begin(), token_ids.end());
     }
 
     for (uint32_t token : tokens)
       token_counts[token]++;
 
-    DVC_ASSERT_EQ(code - index.filecode(file_info), ssize_t(file_info.code_length));
+    DVC_ASSERT_EQ(code - file_code, ssize_t(file_info.code_length));
   }
 
   std::multimap<double, uint32_t, std::greater<double>> counts_tokens;
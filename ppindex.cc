@@ -1,11 +1,19 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <filesystem>
 #include <map>
 #include <mutex>
+#include <optional>
 #include <random>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "dvc/file.h"
 #include "dvc/log.h"
@@ -13,9 +21,14 @@
 #include "dvc/opts.h"
 #include "dvc/program.h"
 #include "dvc/sha3.h"
+#include "fuzzy.h"
+#include "hash.h"
 #include "index.h"
+#include "index_reader.h"
+#include "lz.h"
 #include "token_codec.h"
 #include "tokenize.h"
+#include "varint.h"
 #include "vector_token_stream.h"
 
 namespace ppt {
@@ -38,288 +51,1322 @@ size_t DVC_OPTION(nthreads, -, 20, "number of threads");
 
 size_t DVC_OPTION(max_file_size, -, 300000, "maximum source file size");
 
-void ppindex(int argc, char** argv) {
-  dvc::program program(argc, argv);
+size_t DVC_OPTION(num_shards, -, 1,
+                  "number of index shards, written to <output_index>.<i> "
+                  "when more than one");
+
+bool DVC_OPTION(store_source, -, false,
+                "store the source text in the index, compressed, so that "
+                "snippets can be served without the source tree");
+
+bool DVC_OPTION(compress_code, -, false,
+                "compress the code section in blocks, which searches "
+                "decompress as they scan, so that less of it is resident");
+
+size_t DVC_OPTION(super_tokens, -, 0,
+                  "number of super tokens, codes for runs of tokens that "
+                  "often occur together within a line, to encode the code "
+                  "section with so that it is smaller to scan");
+
+bool DVC_OPTION(canonical_tokens, -, false,
+                "index each alternative token and digraph, such as and or "
+                "<:, as the token it stands for, so that a search for either "
+                "spelling finds both");
+
+// The order of files in the code section.
+//   shuffle: random, the default.
+//   path:    by path, so that files of a directory are together.
+//   similar: by FileSketch, so that files with similar token sets are
+//            together, as are their super tokens and compressed blocks.
+enum class file_layout { shuffle, path, similar };
+
+file_layout parse_file_layout(std::string_view s) {
+  if (s == "shuffle") return file_layout::shuffle;
+  if (s == "path") return file_layout::path;
+  if (s == "similar") return file_layout::similar;
+  DVC_FATAL("Unknown layout `", s, "`");
+}
 
-  DVC_ASSERT(exists(srcdir) && is_directory(srcdir),
-             "No such directory: ", srcdir);
+std::string DVC_OPTION(layout, -, "shuffle",
+                       "order of files in the code section: shuffle, path "
+                       "or similar (see file_layout)");
+
+size_t DVC_OPTION(near_duplicate_percent, -, 0,
+                  "percent similarity of token 4-grams at which files are "
+                  "clustered as near duplicates, whose matches searches "
+                  "count but do not sample; 0 for no clustering");
+
+bool DVC_OPTION(drop_near_duplicates, -, false,
+                "index only the first file of each cluster of near "
+                "duplicates (see near_duplicate_percent)");
+
+constexpr size_t source_block_size = 32 << 10;
+
+// Small enough for a block to be decompressed and scanned in L2.
+constexpr size_t code_block_size = 64 << 10;
+
+constexpr size_t token_hash_bucket_load = 2;  // mean spellings per bucket
+
+// Writes the token_hash section (see index.h) of the spellings
+// inv_token_vec[1..] at the current position of `index`.  Hash and
+// displace: buckets are placed largest first, each with the first
+// displacement that sends all of its spellings to free slots, except that
+// single spellings go straight to the next free slot.  If two spellings
+// in a bucket hash equal, the seed is changed and the whole hash rebuilt.
+void write_token_hash_section(
+    dvc::file_writer& index,
+    const std::vector<const std::string*>& inv_token_vec) {
+  size_t num_tokens = inv_token_vec.size() - 1;
+  DVC_ASSERT_LT(num_tokens, idx::token_hash_direct);
+  idx::TokenHashHeader header;
+  header.num_buckets = num_tokens / token_hash_bucket_load + 1;
+  constexpr uint32_t max_displacement = 1 << 20;
+  std::vector<uint32_t> displacements;
+  std::vector<idx::TokenHashSlot> slots;
+  for (header.seed = 0;; header.seed++) {
+    DVC_ASSERT_LT(header.seed, 16, "Unable to build token hash");
+    std::vector<uint64_t> hashes(num_tokens + 1);
+    std::vector<std::vector<uint32_t>> buckets(header.num_buckets);
+    for (size_t token_id = 1; token_id <= num_tokens; token_id++) {
+      hashes[token_id] = hash64(*inv_token_vec[token_id], header.seed);
+      buckets[idx::token_hash_bucket(hashes[token_id], header.num_buckets)]
+          .push_back(token_id);
+    }
+    std::vector<uint32_t> order(header.num_buckets);
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return buckets[a].size() > buckets[b].size();
+    });
 
-  std::optional<dvc::file_writer> skipped_files;
+    displacements.assign(header.num_buckets, 0);
+    slots.assign(num_tokens, {});
+    std::vector<bool> taken(num_tokens);
+    auto place = [&](uint32_t token_id, size_t slot) {
+      taken[slot] = true;
+      slots[slot] = {token_id, uint32_t(hashes[token_id])};
+    };
+    size_t next_free = 0;
+    bool placed_all = true;
+    std::vector<size_t> placed;
+    for (uint32_t bucket : order) {
+      const std::vector<uint32_t>& token_ids = buckets[bucket];
+      if (token_ids.empty()) break;
+      if (token_ids.size() == 1) {
+        while (taken[next_free]) next_free++;
+        displacements[bucket] = idx::token_hash_direct | next_free;
+        place(token_ids[0], next_free);
+        continue;
+      }
+      uint32_t displacement = 0;
+      for (; displacement < max_displacement; displacement++) {
+        placed.clear();
+        for (uint32_t token_id : token_ids) {
+          size_t slot =
+              idx::token_hash_slot(hashes[token_id], displacement, num_tokens);
+          if (taken[slot] ||
+              std::find(placed.begin(), placed.end(), slot) != placed.end())
+            break;
+          placed.push_back(slot);
+        }
+        if (placed.size() == token_ids.size()) break;
+      }
+      if (displacement == max_displacement) {
+        placed_all = false;
+        break;
+      }
+      displacements[bucket] = displacement;
+      for (size_t i = 0; i < token_ids.size(); i++)
+        place(token_ids[i], placed[i]);
+    }
+    if (placed_all) break;
+  }
 
-  if (!output_skipped_files.empty())
-    skipped_files = dvc::file_writer(output_skipped_files, dvc::truncate);
+  index.rwrite(header);
+  index.write(displacements.data(), displacements.size() * sizeof(uint32_t));
+  index.write(slots.data(), slots.size() * sizeof(idx::TokenHashSlot));
+}
 
-  size_t nskipped_files = 0;
+// Writes the token_trigrams section (see index.h) of the spellings
+// inv_token_vec[1..] at the current position of `index`.
+void write_token_trigram_section(
+    dvc::file_writer& index,
+    const std::vector<const std::string*>& inv_token_vec) {
+  std::vector<std::pair<uint32_t, uint32_t>> entries;  // key, token id
+  for (size_t token_id = 1; token_id < inv_token_vec.size(); token_id++) {
+    const std::string& spelling = *inv_token_vec[token_id];
+    if (!has_trigrams(spelling)) continue;
+    for (uint32_t trigram : trigrams(spelling))
+      entries.emplace_back(trigram_key(trigram, spelling.size()), token_id);
+  }
+  std::sort(entries.begin(), entries.end());
 
-  std::map<std::string, size_t> skipped_reasons;
-  auto skip_file = [&](const std::filesystem::path& skipped_file,
-                       const std::string& reason) {
-    nskipped_files++;
-    if (skipped_files) skipped_files->println(skipped_file.string());
-    skipped_reasons[reason]++;
-  };
+  std::vector<uint32_t> keys, offsets, postings;
+  for (const auto& [key, token_id] : entries) {
+    if (keys.empty() || keys.back() != key) {
+      keys.push_back(key);
+      offsets.push_back(postings.size());
+    }
+    postings.push_back(token_id);
+  }
+  offsets.push_back(postings.size());
 
-  std::vector<std::filesystem::path> files1;
+  index.rwrite(idx::TokenTrigramHeader{uint32_t(keys.size()),
+                                       uint32_t(postings.size())});
+  index.write(keys.data(), keys.size() * sizeof(uint32_t));
+  index.write(offsets.data(), offsets.size() * sizeof(uint32_t));
+  index.write(postings.data(), postings.size() * sizeof(uint32_t));
+}
 
-  DVC_LOG("Pass 1: Analyzing ", srcdir, ".");
-  for (const std::filesystem::directory_entry& dirent :
-       std::filesystem::recursive_directory_iterator(srcdir)) {
-    if (dirent.is_directory()) continue;
+// Whether `spelling` is a C++20 keyword.
+bool is_keyword(const std::string& spelling) {
+  static const std::unordered_set<std::string> keywords = {
+      "alignas", "alignof", "asm", "auto", "bool", "break", "case", "catch",
+      "char", "char8_t", "char16_t", "char32_t", "class", "concept", "const",
+      "consteval", "constexpr", "constinit", "const_cast", "continue",
+      "co_await", "co_return", "co_yield", "decltype", "default", "delete",
+      "do", "double", "dynamic_cast", "else", "enum", "explicit", "export",
+      "extern", "false", "float", "for", "friend", "goto", "if", "inline",
+      "int", "long", "mutable", "namespace", "new", "noexcept", "nullptr",
+      "operator", "private", "protected", "public", "register",
+      "reinterpret_cast", "requires", "return", "short", "signed", "sizeof",
+      "static", "static_assert", "static_cast", "struct", "switch", "template",
+      "this", "thread_local", "throw", "true", "try", "typedef", "typeid",
+      "typename", "union", "unsigned", "using", "virtual", "void", "volatile",
+      "wchar_t", "while"};
+
+  return keywords.count(spelling);
+}
 
-    DVC_ASSERT(dirent.is_regular_file(), "Irregular file: ", dirent.path());
+// The TokenKindInfo of each token id in inv_token_vec, from kind_masks,
+// each with bit 1 << kind set for each TokenKind a token id occurs as.
+std::vector<idx::TokenKindInfo> token_kind_infos(
+    const std::vector<std::vector<uint8_t>>& kind_masks,
+    const std::vector<const std::string*>& inv_token_vec) {
+  std::vector<idx::TokenKindInfo> infos(inv_token_vec.size());
+  for (size_t token_id = 1; token_id < infos.size(); token_id++) {
+    uint8_t mask = 0;
+    for (const std::vector<uint8_t>& masks : kind_masks)
+      mask |= masks[token_id];
+    idx::TokenKindInfo& info = infos[token_id];
+    if (mask & 1 << HEADER_NAME) info.flags |= idx::token_header_name;
+    info.kind = HEADER_NAME;
+    for (uint8_t kind = OPERATOR; kind < HEADER_NAME; kind++)
+      if (mask & 1 << kind) {
+        info.kind = kind;
+        break;
+      }
+    if (is_keyword(*inv_token_vec[token_id])) info.flags |= idx::token_keyword;
+  }
+  return infos;
+}
 
-    if (dirent.file_size() > max_file_size) {
-      skip_file(dirent, "too large");
+// Tokenizes `code` into `output`, with --canonical_tokens replacing each
+// alternative token and digraph with the token it stands for.
+void tokenize(const std::string& code, VectorTokenStream& output) {
+  Tokenize(code, output);
+  if (!canonical_tokens) return;
+  for (Token& token : output.tokens) {
+    std::string_view canonical = CanonicalSpelling(token.spelling);
+    if (canonical.data() != token.spelling.data()) token.spelling = canonical;
+  }
+}
+
+constexpr uint32_t path_bucket_size = 16;
+
+// Writes the paths section (see index.h) of `files` at the current
+// position of `index`.
+void write_path_section(dvc::file_writer& index,
+                        const std::vector<std::filesystem::path>& files) {
+  std::vector<std::string> paths;
+  for (const std::filesystem::path& file : files)
+    paths.push_back(file.string());
+  std::vector<uint32_t> order(paths.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [&](uint32_t a, uint32_t b) { return paths[a] < paths[b]; });
+  std::vector<uint32_t> ranks(paths.size());
+  for (size_t rank = 0; rank < order.size(); rank++) ranks[order[rank]] = rank;
+
+  idx::PathDictionaryHeader header;
+  header.bucket_size = path_bucket_size;
+  header.num_buckets = (paths.size() + path_bucket_size - 1) / path_bucket_size;
+  std::vector<size_t> bucket_offsets;
+  std::string buckets;
+  for (size_t rank = 0; rank < order.size(); rank++) {
+    const std::string& path = paths[order[rank]];
+    size_t shared = 0;
+    if (rank % path_bucket_size == 0) {
+      bucket_offsets.push_back(buckets.size());
+    } else {
+      const std::string& previous = paths[order[rank - 1]];
+      while (shared < path.size() && shared < previous.size() &&
+             path[shared] == previous[shared])
+        shared++;
+      put_varint(buckets, shared);
+    }
+    put_varint(buckets, path.size() - shared);
+    buckets.append(path, shared);
+  }
+  bucket_offsets.push_back(buckets.size());
+  DVC_ASSERT_EQ(bucket_offsets.size(), header.num_buckets + 1);
+
+  size_t buckets_offset = index.tell() + sizeof header +
+                          2 * paths.size() * sizeof(uint32_t) +
+                          bucket_offsets.size() * sizeof(size_t);
+  for (size_t& offset : bucket_offsets) offset += buckets_offset;
+  index.rwrite(header);
+  index.write(ranks.data(), ranks.size() * sizeof(uint32_t));
+  index.write(order.data(), order.size() * sizeof(uint32_t));
+  index.write(bucket_offsets.data(), bucket_offsets.size() * sizeof(size_t));
+  index.write(buckets.data(), buckets.size());
+}
+
+constexpr uint32_t line_checkpoint_interval = 32;
+
+// Appends the line table block (see index.h) of a file with the `num_lines`
+// LineInfo records at `lines` to `out`.
+void encode_line_table(const idx::LineInfo* lines, size_t num_lines,
+                       std::string& out) {
+  size_t num_checkpoints =
+      (num_lines + line_checkpoint_interval - 1) / line_checkpoint_interval;
+  std::vector<idx::LineCheckpoint> checkpoints(num_checkpoints);
+  std::string deltas;
+  for (size_t i = 0; i < num_lines; i++) {
+    if (i % line_checkpoint_interval == 0) {
+      checkpoints[i / line_checkpoint_interval] = {
+          lines[i].file_offset, lines[i].code_offset, uint32_t(deltas.size())};
       continue;
     }
+    DVC_ASSERT_GE(lines[i].file_offset, lines[i - 1].file_offset);
+    DVC_ASSERT_GE(lines[i].code_offset, lines[i - 1].code_offset);
+    put_varint(deltas, lines[i].file_offset - lines[i - 1].file_offset);
+    put_varint(deltas, lines[i].code_offset - lines[i - 1].code_offset);
+  }
+  out.append((const char*)checkpoints.data(),
+             num_checkpoints * sizeof(idx::LineCheckpoint));
+  out += deltas;
+}
 
-    files1.push_back(dirent);
+// Writes the line table section of `file_infos`, whose lines are
+// `line_infos` in file order, at the current position of `index`, and
+// sets each lineinfo_offset.  Blocks are encoded in parallel.
+void write_line_table_section(dvc::file_writer& index,
+                              const std::vector<idx::LineInfo>& line_infos,
+                              std::vector<idx::FileInfo>& file_infos) {
+  index.rwrite(idx::LineTableHeader{line_checkpoint_interval});
+
+  std::vector<size_t> first_lines;
+  size_t num_lines = 0;
+  for (const idx::FileInfo& file_info : file_infos) {
+    first_lines.push_back(num_lines);
+    num_lines += file_info.num_lines;
+  }
+  DVC_ASSERT_EQ(num_lines, line_infos.size());
+
+  std::vector<std::string> blocks(file_infos.size());
+  std::atomic_size_t next_file = 0;
+  auto worker = [&] {
+    for (size_t i = next_file++; i < file_infos.size(); i = next_file++)
+      encode_line_table(line_infos.data() + first_lines[i],
+                        file_infos[i].num_lines, blocks[i]);
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nthreads; i++) threads.emplace_back(worker);
+  worker();
+  for (std::thread& t : threads) t.join();
 
-    if (dvc::is_pow2(files1.size())) {
-      DVC_LOG("Analyzed ", files1.size(), " source files.");
+  static constexpr char padding[alignof(idx::LineCheckpoint)] = {};
+  for (size_t i = 0; i < file_infos.size(); i++) {
+    index.write(padding, -index.tell() % alignof(idx::LineCheckpoint));
+    file_infos[i].lineinfo_offset = index.tell();
+    index.write(blocks[i].data(), blocks[i].size());
+    std::string().swap(blocks[i]);
+  }
+}
+
+constexpr size_t next_token_top_k = 8;  // next tokens kept per context
+constexpr size_t next_token_min_count = 2;
+constexpr size_t next_token_min_pair_count = 64;  // to be a context
+
+// The next_tokens section (see index.h).
+struct NextTokenTable {
+  std::vector<idx::NextTokenContext> contexts;
+  std::vector<uint32_t> offsets;
+  std::vector<idx::NextToken> next;
+};
+
+// Counts the tokens that follow each token in `code` (the code section),
+// and then those that follow each pair of tokens that occurs at least
+// next_token_min_pair_count times, keeping the next_token_top_k most
+// frequent that occur at least next_token_min_count times.  Each thread
+// counts the files in its own slice of the code, and then thread i merges
+// and ranks the counts of the contexts that are i modulo nthreads, so the
+// code is decoded twice in all.
+NextTokenTable count_next_tokens(const std::vector<std::byte>& code) {
+  using Entry = std::pair<idx::NextTokenContext, idx::NextToken>;
+  std::vector<std::vector<Entry>> thread_entries(nthreads);
+
+  // Thread i counts the files from ranges[i] to ranges[i + 1].  Token 0,
+  // which ends each file, is the only code with a 0 byte.
+  std::vector<size_t> ranges = {0};
+  for (size_t i = 1; i < nthreads; i++) {
+    size_t pos = std::max(ranges.back(), code.size() * i / nthreads);
+    while (pos < code.size() && (pos == 0 || code[pos - 1] != std::byte(0)))
+      pos++;
+    ranges.push_back(pos);
+  }
+  ranges.push_back(code.size());
+
+  // Calls f(a, b, c) for each token c in the files of thread
+  // `thread_index`, where a and b are the two tokens before it in its file,
+  // or 0.
+  auto for_each_token = [&](size_t thread_index, auto f) {
+    uint32_t a = 0, b = 0;
+    for (const std::byte* p = code.data() + ranges[thread_index];
+         p < code.data() + ranges[thread_index + 1];) {
+      uint32_t c = decode_token(p);
+      if (c == 0) {
+        a = b = 0;
+        continue;
+      }
+      f(a, b, c);
+      a = b;
+      b = c;
+    }
+  };
+
+  // Runs f(thread_index) on nthreads threads.
+  auto run_threads = [&](auto f) {
+    std::vector<std::thread> threads;
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back(f, thread_index);
+    for (std::thread& t : threads) t.join();
+  };
+
+  // Counts keyed by context index << 32 | next token id.  counts[i][j]
+  // holds thread i's counts of the contexts that are j modulo nthreads.
+  using Counts = std::unordered_map<uint64_t, size_t>;
+  std::vector<std::vector<Counts>> counts(nthreads,
+                                          std::vector<Counts>(nthreads));
+
+  // Sums every thread's counts of the contexts that are `shard` modulo
+  // nthreads.
+  auto merge_counts = [&](size_t shard) {
+    Counts merged;
+    merged.swap(counts[0][shard]);
+    for (size_t i = 1; i < nthreads; i++) {
+      for (const auto& [key, count] : counts[i][shard]) merged[key] += count;
+      Counts().swap(counts[i][shard]);
+    }
+    return merged;
+  };
+
+  // Adds the top counts in `merged`, keyed by context index << 32 | next
+  // token id, to `entries`.
+  auto add_top = [&](const Counts& merged, auto context_of,
+                     std::vector<Entry>& entries) {
+    std::vector<std::pair<uint64_t, size_t>> sorted;
+    for (const auto& [key, count] : merged)
+      if (count >= next_token_min_count) sorted.emplace_back(key, count);
+    // By context, then by count descending, then by token id.
+    std::sort(sorted.begin(), sorted.end(), [](const auto& x, const auto& y) {
+      return std::make_tuple(x.first >> 32, y.second, uint32_t(x.first)) <
+             std::make_tuple(y.first >> 32, x.second, uint32_t(y.first));
+    });
+    size_t kept = 0;
+    for (size_t i = 0; i < sorted.size(); i++) {
+      const auto& [key, count] = sorted[i];
+      if (i == 0 || sorted[i - 1].first >> 32 != key >> 32) kept = 0;
+      if (kept++ >= next_token_top_k) continue;
+      entries.push_back(
+          {context_of(key >> 32),
+           {uint32_t(key), uint32_t(std::min<size_t>(count, UINT32_MAX))}});
+    }
+  };
+
+  run_threads([&](size_t thread_index) {
+    for_each_token(thread_index, [&](uint32_t, uint32_t b, uint32_t c) {
+      if (b != 0) counts[thread_index][b % nthreads][uint64_t(b) << 32 | c]++;
+    });
+  });
+  std::vector<std::vector<idx::NextTokenContext>> thread_pairs(nthreads);
+  run_threads([&](size_t shard) {
+    Counts merged = merge_counts(shard);
+    add_top(
+        merged,
+        [](uint64_t b) { return idx::NextTokenContext{uint32_t(b), 0}; },
+        thread_entries[shard]);
+    for (const auto& [key, count] : merged)
+      if (count >= next_token_min_pair_count)
+        thread_pairs[shard].push_back({uint32_t(key >> 32), uint32_t(key)});
+  });
+
+  std::unordered_map<uint64_t, uint32_t> pair_indexes;
+  std::vector<idx::NextTokenContext> pairs;
+  for (std::vector<idx::NextTokenContext>& part : thread_pairs)
+    for (const idx::NextTokenContext& pair : part) {
+      pair_indexes.emplace(uint64_t(pair.first) << 32 | pair.second,
+                           pairs.size());
+      pairs.push_back(pair);
     }
+  if (!pairs.empty()) {
+    run_threads([&](size_t thread_index) {
+      for_each_token(thread_index, [&](uint32_t a, uint32_t b, uint32_t c) {
+        if (a == 0) return;
+        auto it = pair_indexes.find(uint64_t(a) << 32 | b);
+        if (it != pair_indexes.end())
+          counts[thread_index][it->second % nthreads]
+                [uint64_t(it->second) << 32 | c]++;
+      });
+    });
+    run_threads([&](size_t shard) {
+      add_top(
+          merge_counts(shard), [&](uint64_t pair) { return pairs[pair]; },
+          thread_entries[shard]);
+    });
   }
-  DVC_LOG("Pass 1 of ", srcdir, " complete: ", files1.size(),
-          " source files analyzed.");
-  if (nskipped_files > 0) {
-    DVC_ERROR(nskipped_files, " files were skipped for the following reasons:");
-    for (const auto& [reason, skipped] : skipped_reasons) {
-      DVC_ERROR(skipped, " files were skipped because: ", reason);
+
+  std::vector<Entry> entries;
+  for (std::vector<Entry>& part : thread_entries) {
+    entries.insert(entries.end(), part.begin(), part.end());
+    std::vector<Entry>().swap(part);
+  }
+  // Stable, to keep each context's next tokens most frequent first.
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const Entry& x, const Entry& y) {
+                     return std::tie(x.first.first, x.first.second) <
+                            std::tie(y.first.first, y.first.second);
+                   });
+  NextTokenTable table;
+  for (size_t i = 0; i < entries.size(); i++) {
+    const auto& [context, next] = entries[i];
+    if (i == 0 || entries[i - 1].first.first != context.first ||
+        entries[i - 1].first.second != context.second) {
+      table.contexts.push_back(context);
+      table.offsets.push_back(table.next.size());
     }
+    table.next.push_back(next);
   }
+  table.offsets.push_back(table.next.size());
+  return table;
+}
 
-  std::vector<std::filesystem::path> files2;
-  std::map<std::string, size_t> token_map;
+// Writes the next_tokens section `table` at the current position of
+// `index`.
+void write_next_token_section(dvc::file_writer& index,
+                              const NextTokenTable& table) {
+  index.rwrite(idx::NextTokenHeader{uint32_t(table.contexts.size()),
+                                    uint32_t(table.next.size())});
+  index.write(table.contexts.data(),
+              table.contexts.size() * sizeof(idx::NextTokenContext));
+  index.write(table.offsets.data(), table.offsets.size() * sizeof(uint32_t));
+  index.write(table.next.data(), table.next.size() * sizeof(idx::NextToken));
+}
 
-  DVC_LOG("Pass 2: Analyzing ", srcdir, ".");
-  std::vector<std::thread> threads;
-  std::mutex mu;
-  std::atomic_size_t files_processed = 0;
-  std::atomic_size_t num_tokens = 0;
-  for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
-    threads.emplace_back([&, thread_index] {
-      for (size_t files1_index = 0; files1_index < files1.size();
-           files1_index++)
-        if (files1_index % nthreads == thread_index) {
-          std::string code = dvc::load_file(files1[files1_index]);
+// The path a header name names, as in include_graph (see index.h).
+std::string_view header_path(std::string_view spelling) {
+  std::string_view path = spelling.substr(1, spelling.size() - 2);
+  while (true) {
+    if (path.substr(0, 2) == "./")
+      path.remove_prefix(2);
+    else if (path.substr(0, 3) == "../")
+      path.remove_prefix(3);
+    else
+      return path;
+  }
+}
 
-          std::vector<Token> tokens;
+// Writes the include_graph section (see index.h) of `files`, where
+// file_includes[i] are the ascending header name token ids of files[i].
+void write_include_graph_section(
+    dvc::file_writer& index, const std::vector<std::filesystem::path>& files,
+    const std::vector<std::vector<uint32_t>>& file_includes,
+    const std::vector<const std::string*>& inv_token_vec) {
+  std::vector<uint32_t> include_offsets = {0};
+  std::map<uint32_t, std::vector<uint32_t>> includers;
+  for (size_t i = 0; i < files.size(); i++) {
+    for (uint32_t header : file_includes[i]) includers[header].push_back(i);
+    include_offsets.push_back(include_offsets.back() +
+                              file_includes[i].size());
+  }
 
-          try {
-            VectorTokenStream output;
-            Tokenize(code, output);
-            tokens = std::move(output.tokens);
-            std::lock_guard lock(mu);
-            files2.push_back(files1[files1_index]);
-            num_tokens += tokens.size();
-            for (const Token& token : tokens) token_map[token.spelling]++;
-          } catch (std::exception& e) {
-            std::lock_guard lock(mu);
-            skip_file(files1[files1_index], e.what());
-            continue;
-          }
-          if (dvc::is_pow2(files_processed++))
-            DVC_LOG("Analyzed ", files_processed, " files.");
-        }
-    });
+  std::unordered_map<std::string, std::vector<uint32_t>> by_filename;
+  for (size_t i = 0; i < files.size(); i++)
+    by_filename[files[i].filename().string()].push_back(i);
+
+  std::vector<uint32_t> headers;
+  std::vector<uint32_t> includer_offsets = {0};
+  std::vector<uint32_t> resolved_offsets = {0};
+  std::vector<uint32_t> resolved;
+  for (const auto& [header, files_including] : includers) {
+    headers.push_back(header);
+    includer_offsets.push_back(includer_offsets.back() +
+                               files_including.size());
+    std::string_view path = header_path(*inv_token_vec.at(header));
+    auto it = by_filename.find(
+        std::filesystem::path(path).filename().string());
+    if (it != by_filename.end())
+      for (uint32_t i : it->second) {
+        std::string file = files[i].string();
+        if (file.size() > path.size() &&
+            file.compare(file.size() - path.size(), path.size(), path) == 0 &&
+            file[file.size() - path.size() - 1] == '/')
+          resolved.push_back(i);
+      }
+    resolved_offsets.push_back(resolved.size());
+  }
 
-  for (std::thread& t : threads) t.join();
-  threads.clear();
-  files1.clear();
+  idx::IncludeGraphHeader header;
+  header.num_headers = headers.size();
+  header.num_edges = include_offsets.back();
+  header.num_resolved = resolved.size();
+  index.rwrite(header);
+  index.write(include_offsets.data(),
+              include_offsets.size() * sizeof(uint32_t));
+  for (const std::vector<uint32_t>& includes : file_includes)
+    index.write(includes.data(), includes.size() * sizeof(uint32_t));
+  index.write(headers.data(), headers.size() * sizeof(uint32_t));
+  index.write(includer_offsets.data(),
+              includer_offsets.size() * sizeof(uint32_t));
+  for (const auto& [header, files_including] : includers)
+    index.write(files_including.data(),
+                files_including.size() * sizeof(uint32_t));
+  index.write(resolved_offsets.data(),
+              resolved_offsets.size() * sizeof(uint32_t));
+  index.write(resolved.data(), resolved.size() * sizeof(uint32_t));
+}
 
-  DVC_LOG("Pass 2 of ", srcdir, " complete: ", files2.size(),
-          " source files analyzed.");
+constexpr size_t super_token_max_length = 8;  // tokens
+constexpr size_t super_token_min_count = 32;
+constexpr size_t super_token_rounds = 8;
 
-  if (nskipped_files > 0) {
-    DVC_ERROR(nskipped_files, " files were skipped for the following reasons:");
-    for (const auto& [reason, skipped] : skipped_reasons) {
-      DVC_ERROR(skipped, " files were skipped because: ", reason);
+// A set of super tokens, and the greedy segmentation of lines with them.
+// Units are token ids, or num_tokens + 1 + i for super token i.
+class SuperTokenDictionary {
+ public:
+  explicit SuperTokenDictionary(size_t num_tokens)
+      : num_tokens_(num_tokens), root_(num_tokens + 1), units_(1) {}
+
+  size_t size() const { return runs_.size(); }
+  size_t num_units() const { return num_tokens_ + runs_.size(); }
+
+  // The token ids of super token i.
+  const std::vector<uint32_t>& run(size_t i) const { return runs_[i]; }
+
+  size_t length(uint32_t unit) const {
+    return unit <= num_tokens_ ? 1 : runs_[unit - num_tokens_ - 1].size();
+  }
+
+  // Appends the token ids of `unit` to `run`.
+  void append(uint32_t unit, std::vector<uint32_t>& run) const {
+    if (unit <= num_tokens_)
+      run.push_back(unit);
+    else
+      run.insert(run.end(), runs_[unit - num_tokens_ - 1].begin(),
+                 runs_[unit - num_tokens_ - 1].end());
+  }
+
+  // Adds `run` as a super token, unless it already is one.
+  bool add(const std::vector<uint32_t>& run) {
+    DVC_ASSERT_GE(run.size(), 2);
+    uint32_t node = root_[run[0]];
+    if (node == 0) {
+      node = root_[run[0]] = units_.size();
+      units_.push_back(0);
     }
+    for (size_t i = 1; i < run.size(); i++) {
+      auto [it, inserted] =
+          children_.emplace(uint64_t(node) << 32 | run[i], units_.size());
+      if (inserted) units_.push_back(0);
+      node = it->second;
+    }
+    if (units_[node] != 0) return false;
+    runs_.push_back(run);
+    units_[node] = num_units();
+    return true;
   }
 
-  DVC_LOG("Num tokens: ", num_tokens);
-  DVC_LOG("Unique tokens: ", token_map.size());
-  DVC_LOG("Inverting token counts...");
-  std::multimap<size_t, const std::string*> count_to_token;
-  for (const auto& [k, v] : token_map) count_to_token.insert(std::pair(v, &k));
+  // Calls f(unit) for each unit of the greedy segmentation of the tokens
+  // [begin, end) of a line: the longest super token at each point, or
+  // else the token.
+  template <typename F>
+  void segment(const uint32_t* begin, const uint32_t* end, F f) const {
+    for (const uint32_t* p = begin; p < end;) {
+      uint32_t unit = *p;
+      size_t length = 1;
+      uint32_t node = root_[*p];
+      for (const uint32_t* q = p + 1; node != 0 && q < end; q++) {
+        auto it = children_.find(uint64_t(node) << 32 | *q);
+        if (it == children_.end()) break;
+        node = it->second;
+        if (units_[node] != 0) {
+          unit = units_[node];
+          length = q + 1 - p;
+        }
+      }
+      f(unit);
+      p += length;
+    }
+  }
 
-  std::vector<const std::string*> inv_token_vec;
+ private:
+  size_t num_tokens_;
+  std::vector<std::vector<uint32_t>> runs_;
+  // A trie of the super tokens: root_[t] is the node of the runs starting
+  // with token t, or 0, children_[node << 32 | t] the child of node with
+  // token t, and units_[node] the unit the node ends, or 0.
+  std::vector<uint32_t> root_;
+  std::unordered_map<uint64_t, uint32_t> children_;
+  std::vector<uint32_t> units_;
+};
+
+// The super_tokens section (see index.h).
+struct SuperTokenTable {
+  std::vector<uint32_t> token_codes;
+  std::vector<uint32_t> super_codes;
+  std::vector<uint32_t> code_units;
+  std::vector<uint32_t> super_offsets;
+  std::vector<uint32_t> super_token_ids;
+};
+
+// Calls f(line_begin, line_end) with the code offsets (relative to the
+// file) of each line of a file, whose lines are `line_infos`.
+template <typename F>
+void for_each_line(const idx::FileInfo& file_info,
+                   const idx::LineInfo* line_infos, F f) {
+  for (size_t i = 0; i < file_info.num_lines; i++)
+    f(line_infos[i].code_offset, i + 1 < file_info.num_lines
+                                     ? line_infos[i + 1].code_offset
+                                     : file_info.code_length - 1);
+}
 
-  std::string eof_token;
+// Chooses up to super_tokens super tokens, BPE style: in each of
+// super_token_rounds rounds, segments every line with the super tokens so
+// far and adds the most frequent pairs of adjacent units as super tokens,
+// up to super_token_max_length tokens long.  Then re-encodes `code` (the
+// code section), and the code offsets of `file_infos` and `line_infos`,
+// with code ids in order of frequency, and returns the super_tokens
+// section.  Thread i counts the pairs whose first unit is i modulo
+// nthreads.
+SuperTokenTable encode_super_tokens(std::vector<std::byte>& code,
+                                    std::vector<idx::FileInfo>& file_infos,
+                                    std::vector<idx::LineInfo>& line_infos,
+                                    const std::vector<size_t>& first_lines,
+                                    size_t num_tokens) {
+  // The token ids of each line with tokens, each followed by a 0.
+  std::vector<uint32_t> lines;
+  for (size_t i = 0; i < file_infos.size(); i++) {
+    const std::byte* file_code = code.data() + file_infos[i].code_offset;
+    for_each_line(file_infos[i], line_infos.data() + first_lines[i],
+                  [&](size_t begin, size_t end) {
+                    if (begin == end) return;
+                    for (const std::byte* p = file_code + begin;
+                         p < file_code + end;)
+                      lines.push_back(decode_token(p));
+                    lines.push_back(0);
+                  });
+  }
 
-  inv_token_vec.push_back(&eof_token);
+  // Thread i segments the lines from ranges[i] to ranges[i + 1].
+  std::vector<size_t> ranges = {0};
+  for (size_t i = 1; i < nthreads; i++) {
+    size_t pos = std::max(ranges.back(), lines.size() * i / nthreads);
+    while (pos < lines.size() && (pos == 0 || lines[pos - 1] != 0)) pos++;
+    ranges.push_back(pos);
+  }
+  ranges.push_back(lines.size());
+
+  SuperTokenDictionary dictionary(num_tokens);
+  std::vector<std::vector<uint32_t>> segmented(nthreads);
+  auto segment_lines = [&] {
+    std::vector<std::thread> threads;
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back([&, thread_index] {
+        std::vector<uint32_t>& units = segmented[thread_index];
+        units.clear();
+        const uint32_t* p = lines.data() + ranges[thread_index];
+        const uint32_t* end = lines.data() + ranges[thread_index + 1];
+        while (p < end) {
+          const uint32_t* line_end = std::find(p, end, 0);
+          dictionary.segment(p, line_end,
+                             [&](uint32_t unit) { units.push_back(unit); });
+          units.push_back(0);
+          p = line_end + 1;
+        }
+      });
+    for (std::thread& t : threads) t.join();
+  };
 
-  for (auto it = count_to_token.crbegin(); it != count_to_token.crend(); it++) {
-    inv_token_vec.push_back(it->second);
+  for (size_t round = 0;
+       round < super_token_rounds && dictionary.size() < super_tokens;
+       round++) {
+    segment_lines();
+    size_t wanted = (super_tokens - dictionary.size() +
+                     super_token_rounds - round - 1) /
+                    (super_token_rounds - round);
+
+    using Pair = std::pair<size_t, uint64_t>;  // count, units
+    std::vector<std::vector<Pair>> thread_pairs(nthreads);
+    std::vector<std::thread> threads;
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back([&, thread_index] {
+        std::unordered_map<uint64_t, size_t> counts;
+        for (const std::vector<uint32_t>& units : segmented)
+          for (size_t i = 0; i + 1 < units.size(); i++)
+            if (units[i] != 0 && units[i + 1] != 0 &&
+                units[i] % nthreads == thread_index)
+              counts[uint64_t(units[i]) << 32 | units[i + 1]]++;
+        std::vector<Pair>& pairs = thread_pairs[thread_index];
+        for (const auto& [key, count] : counts)
+          if (count >= super_token_min_count &&
+              dictionary.length(key >> 32) + dictionary.length(uint32_t(key)) <=
+                  super_token_max_length)
+            pairs.emplace_back(count, key);
+        size_t top = std::min(pairs.size(), wanted);
+        std::partial_sort(pairs.begin(), pairs.begin() + top, pairs.end(),
+                          std::greater<Pair>());
+        pairs.resize(top);
+      });
+    for (std::thread& t : threads) t.join();
+
+    std::vector<Pair> pairs;
+    for (const std::vector<Pair>& part : thread_pairs)
+      pairs.insert(pairs.end(), part.begin(), part.end());
+    std::sort(pairs.begin(), pairs.end(), std::greater<Pair>());
+    size_t added = 0;
+    for (size_t i = 0; i < pairs.size() && added < wanted; i++) {
+      std::vector<uint32_t> run;
+      dictionary.append(pairs[i].second >> 32, run);
+      dictionary.append(uint32_t(pairs[i].second), run);
+      added += dictionary.add(run);
+    }
+    DVC_LOG("Super token round ", round, ": ", dictionary.size(),
+            " super tokens");
+    if (added == 0) break;
   }
 
-  if (!output_token_counts.empty()) {
-    dvc::file_writer token_counts_file(output_token_counts, dvc::truncate);
-    for (auto it = count_to_token.crbegin(); it != count_to_token.crend();
-         it++) {
-      size_t count = it->first;
-      const std::string& token = *(it->second);
-      token_counts_file.println(count, " ", token.size(), " ", token);
+  // Code ids in order of frequency in the final segmentation.
+  segment_lines();
+  std::vector<size_t> counts(dictionary.num_units() + 1);
+  for (const std::vector<uint32_t>& units : segmented)
+    for (uint32_t unit : units) counts[unit]++;
+  segmented.clear();
+  lines.clear();
+  lines.shrink_to_fit();
+  std::vector<uint32_t> order(dictionary.num_units());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i + 1;
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return counts[a] > counts[b];
+  });
+  DVC_ASSERT_LT(order.size(), size_t(1) << 28);
+  std::vector<uint32_t> unit_codes(dictionary.num_units() + 1);
+  for (size_t i = 0; i < order.size(); i++) unit_codes[order[i]] = i + 1;
+
+  SuperTokenTable table;
+  table.token_codes.assign(unit_codes.begin(),
+                           unit_codes.begin() + num_tokens + 1);
+  table.super_codes.assign(unit_codes.begin() + num_tokens + 1,
+                           unit_codes.end());
+  table.code_units.push_back(0);
+  for (uint32_t unit : order)
+    table.code_units.push_back(
+        unit <= num_tokens ? unit
+                           : idx::super_token_unit | (unit - num_tokens - 1));
+  table.super_offsets.push_back(0);
+  for (size_t i = 0; i < dictionary.size(); i++) {
+    const std::vector<uint32_t>& run = dictionary.run(i);
+    table.super_token_ids.insert(table.super_token_ids.end(), run.begin(),
+                                 run.end());
+    table.super_offsets.push_back(table.super_token_ids.size());
+  }
+
+  std::vector<std::vector<std::byte>> file_codes(file_infos.size());
+  std::atomic_size_t next_file = 0;
+  auto worker = [&] {
+    std::vector<uint32_t> token_ids;
+    std::vector<std::byte> encoded;
+    for (size_t i = next_file++; i < file_infos.size(); i = next_file++) {
+      const idx::FileInfo& file_info = file_infos[i];
+      const std::byte* file_code = code.data() + file_info.code_offset;
+      idx::LineInfo* file_lines = line_infos.data() + first_lines[i];
+      // Each code is at most 5 bytes and stands for at least one token.
+      encoded.resize(5 * file_info.code_length);
+      std::byte* dest = encoded.data();
+      size_t line = 0;
+      for_each_line(file_info, file_lines, [&](size_t begin, size_t end) {
+        file_lines[line++].code_offset = dest - encoded.data();
+        token_ids.clear();
+        for (const std::byte* p = file_code + begin; p < file_code + end;)
+          token_ids.push_back(decode_token(p));
+        dictionary.segment(
+            token_ids.data(), token_ids.data() + token_ids.size(),
+            [&](uint32_t unit) { encode_token(unit_codes[unit], dest); });
+      });
+      encode_token(0, dest);
+      file_codes[i].assign(encoded.data(), dest);
     }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nthreads; i++) threads.emplace_back(worker);
+  worker();
+  for (std::thread& t : threads) t.join();
+
+  size_t code_length = code.size();
+  size_t code_offset = 0;
+  for (const std::vector<std::byte>& file_code : file_codes)
+    code_offset += file_code.size();
+  code.resize(code_offset);
+  code_offset = 0;
+  for (size_t i = 0; i < file_infos.size(); i++) {
+    std::memcpy(code.data() + code_offset, file_codes[i].data(),
+                file_codes[i].size());
+    file_infos[i].code_offset = code_offset;
+    file_infos[i].code_length = file_codes[i].size();
+    code_offset += file_codes[i].size();
+    std::vector<std::byte>().swap(file_codes[i]);
   }
-  count_to_token.clear();
+  DVC_LOG("Code section: ", code_length, " bytes encoded with ",
+          dictionary.size(), " super tokens in ", code_offset);
+  return table;
+}
 
-  for (size_t i = 1; i < inv_token_vec.size(); i++)
-    token_map.at(*inv_token_vec[i]) = i;
+// Writes the super_tokens section `table` at the current position of
+// `index`.
+void write_super_token_section(dvc::file_writer& index,
+                               const SuperTokenTable& table) {
+  index.rwrite(idx::SuperTokenHeader{uint32_t(table.code_units.size() - 1),
+                                     uint32_t(table.super_codes.size())});
+  for (const std::vector<uint32_t>* array :
+       {&table.token_codes, &table.super_codes, &table.code_units,
+        &table.super_offsets, &table.super_token_ids})
+    index.write(array->data(), array->size() * sizeof(uint32_t));
+}
 
-  DVC_LOG("Shuffling file list...");
-  std::mt19937 rand_engine;
-  std::shuffle(files2.begin(), files2.end(), rand_engine);
+// Writes the code_blocks section (see index.h) of the code section `code`
+// at the current position of `index`, compressing blocks in parallel.
+void write_code_block_section(dvc::file_writer& index,
+                              const std::vector<std::byte>& code) {
+  idx::CodeBlocksHeader header;
+  header.code_length = code.size();
+  header.block_size = code_block_size;
+  header.num_blocks = (code.size() + code_block_size - 1) / code_block_size;
+
+  std::vector<std::string> blocks(header.num_blocks);
+  std::atomic_size_t next_block = 0;
+  auto worker = [&] {
+    for (size_t i = next_block++; i < blocks.size(); i = next_block++) {
+      const char* begin = (const char*)code.data() + i * code_block_size;
+      size_t length =
+          std::min(code_block_size, code.size() - i * code_block_size);
+      lz_compress(begin, length, blocks[i]);
+      if (blocks[i].size() >= length) blocks[i].assign(begin, length);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nthreads; i++) threads.emplace_back(worker);
+  worker();
+  for (std::thread& t : threads) t.join();
 
-  DVC_LOG("Pass 3: Analyzing ", srcdir, ".");
-  files_processed = 0;
-  std::atomic_size_t num_encoded_bytes = 0;
-  std::atomic_size_t num_newlines = 0;
-  std::unordered_map<std::string, size_t> shas;
-  std::atomic_size_t total_tokens = 0;
-  std::atomic_size_t total_bytes = 0;
-  for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
-    threads.emplace_back([&, thread_index] {
-      for (size_t files2_index = 0; files2_index < files2.size();
-           files2_index++)
-        if (files2_index % nthreads == thread_index) {
-          std::string code = dvc::load_file(files2.at(files2_index));
+  std::vector<size_t> block_offsets;
+  size_t block_offset = index.tell() + sizeof header +
+                        (header.num_blocks + 1) * sizeof(size_t);
+  for (const std::string& block : blocks) {
+    block_offsets.push_back(block_offset);
+    block_offset += block.size();
+  }
+  block_offsets.push_back(block_offset);
+  index.rwrite(header);
+  index.write(block_offsets.data(), block_offsets.size() * sizeof(size_t));
+  for (std::string& block : blocks) {
+    index.write(block.data(), block.size());
+    std::string().swap(block);
+  }
+  DVC_LOG("Code section: ", code.size(), " bytes compressed to ",
+          block_offset - block_offsets[0]);
+}
 
-          std::vector<std::byte> encoded;
-          try {
-            VectorTokenStream output;
-            Tokenize(code, output);
-            size_t newlines = output.newlines_tokens.size();
-            encoded.resize(5 * (output.tokens.size() + 1));
-            std::byte* ptr = encoded.data();
-            for (const Token& token : output.tokens) {
-              DVC_ASSERT(!token.spelling.empty());
-              uint32_t token_id = token_map.at(token.spelling);
-              encode_token(token_id, ptr);
-            }
-            encode_token(0, ptr);
-            encoded.resize(ptr - encoded.data());
-            DVC_ASSERT(uint8_t(encoded.back()) == 0);
-            std::string sha =
-                dvc::SHA3({(const char*)encoded.data(), encoded.size()});
-            std::lock_guard lock(mu);
-            auto it = shas.find(sha);
-            if (!output.tokens.empty() && it == shas.end()) {
-              shas.emplace_hint(it, std::move(sha), files2_index);
-              num_encoded_bytes += encoded.size();
-              num_newlines += newlines;
-              total_tokens += output.tokens.size();
-              total_bytes += code.size();
-            } else {
-              if (output.tokens.empty())
-                skip_file(files2.at(files2_index), "no tokens");
-              else
-                skip_file(files2.at(files2_index), "same sha");
-            }
-          } catch (std::exception& e) {
-            DVC_FATAL("Unexpected bad file: ", e.what(), ": ",
-                      files2[files2_index]);
-          }
+// Writes the source section (see index.h) of `files` at the current
+// position of `index`.  Files are read in order, and every batch of
+// blocks is compressed in parallel and then written.
+void write_source_section(dvc::file_writer& index,
+                          const std::vector<std::filesystem::path>& files,
+                          const std::vector<idx::FileInfo>& file_infos) {
+  idx::SourceSectionHeader header;
+  header.text_length = 0;
+  header.block_size = source_block_size;
+  std::vector<size_t> text_offsets;
+  for (const idx::FileInfo& file_info : file_infos) {
+    text_offsets.push_back(header.text_length);
+    header.text_length += file_info.file_length;
+  }
+  header.num_blocks =
+      (header.text_length + header.block_size - 1) / header.block_size;
+  index.rwrite(header);
+  index.write(text_offsets.data(), text_offsets.size() * sizeof(size_t));
+
+  size_t block_offsets_offset = index.tell();
+  DVC_LOG("Padding source block offsets @ ", block_offsets_offset);
+  std::vector<size_t> block_offsets(header.num_blocks + 1);
+  index.write(block_offsets.data(), block_offsets.size() * sizeof(size_t));
+
+  std::string text;  // starting at block `block`
+  size_t next_file = 0;
+  size_t block = 0;
+  while (block < header.num_blocks) {
+    size_t batch = std::min(nthreads * 16, header.num_blocks - block);
+    size_t batch_bytes =
+        std::min(batch * header.block_size,
+                 header.text_length - block * header.block_size);
+    while (text.size() < batch_bytes) {
+      std::string code = dvc::load_file(files.at(next_file));
+      DVC_ASSERT_EQ(code.size(), file_infos.at(next_file).file_length,
+                    "File changed during indexing: ", files.at(next_file));
+      text += code;
+      next_file++;
+    }
 
-          size_t n = files_processed++;
-          if (dvc::is_pow2(n))
-            DVC_LOG("Analyzed ", n,
-                    " files. num_encoded_bytes = ", num_encoded_bytes);
+    std::vector<std::string> compressed(batch);
+    std::atomic_size_t next_block = 0;
+    std::vector<std::thread> threads;
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back([&] {
+        for (size_t i = next_block++; i < batch; i = next_block++) {
+          size_t begin = i * header.block_size;
+          size_t length = std::min(header.block_size, batch_bytes - begin);
+          lz_compress(text.data() + begin, length, compressed[i]);
+          if (compressed[i].size() >= length)
+            compressed[i].assign(text, begin, length);
         }
-    });
-  for (std::thread& t : threads) t.join();
-  threads.clear();
-  DVC_LOG("Pass 3 of ", srcdir, " complete: ", shas.size(),
-          " source files analyzed.");
+      });
+    for (std::thread& t : threads) t.join();
 
-  if (nskipped_files > 0) {
-    DVC_ERROR(nskipped_files, " files were skipped for the following reasons:");
-    for (const auto& [reason, skipped] : skipped_reasons) {
-      DVC_ERROR(skipped, " files were skipped because: ", reason);
+    for (size_t i = 0; i < batch; i++) {
+      block_offsets[block + i] = index.tell();
+      index.write(compressed[i].data(), compressed[i].size());
     }
+    text.erase(0, batch_bytes);
+    block += batch;
+    if (dvc::is_pow2(block))
+      DVC_LOG("Compressed ", block, " of ", header.num_blocks, " blocks.");
+  }
+  DVC_ASSERT_EQ(next_file, files.size());
+  size_t section_end = index.tell();
+  block_offsets[header.num_blocks] = section_end;
+  DVC_LOG("Source section: ", header.text_length, " bytes compressed to ",
+          section_end - block_offsets[0]);
+
+  DVC_LOG("Backpatching source block offsets @ ", block_offsets_offset);
+  index.seek(block_offsets_offset);
+  index.write(block_offsets.data(), block_offsets.size() * sizeof(size_t));
+  index.seek(section_end);
+}
+
+constexpr size_t section_alignment = 4096;
+constexpr size_t code_section_alignment = 2 << 20;
+constexpr size_t checksum_chunk_size = 64 << 20;
+
+// Checksums `sections` of the index file at `path`, then writes them and
+// `header` at its start.
+void write_directory(const std::filesystem::path& path,
+                     idx::IndexHeaderV3 header,
+                     std::vector<idx::SectionEntry> sections) {
+  DVC_LOG("Checksumming ", sections.size(), " sections...");
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  DVC_ASSERT_NE(fd, -1, "Unable to open ", path, ": ", strerror(errno));
+  size_t length = ::lseek(fd, 0, SEEK_END);
+  void* data = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  DVC_ASSERT_NE(data, MAP_FAILED, "Unable to map ", path, ": ",
+                strerror(errno));
+  for (idx::SectionEntry& section : sections) {
+    DVC_ASSERT_LE(section.offset + section.length, length);
+    section.checksum = idx::section_checksum(
+        section.type, (const std::byte*)data + section.offset, section.length,
+        header.checksum_chunk_size, nthreads);
+  }
+  ::munmap(data, length);
+
+  header.num_sections = sections.size();
+  header.directory_checksum =
+      hash64(sections.data(), sections.size() * sizeof(idx::SectionEntry));
+  size_t directory_length = sections.size() * sizeof(idx::SectionEntry);
+  DVC_ASSERT_EQ(::pwrite(fd, &header, sizeof header, 0),
+                ssize_t(sizeof header));
+  DVC_ASSERT_EQ(::pwrite(fd, sections.data(), directory_length, sizeof header),
+                ssize_t(directory_length));
+  ::close(fd);
+}
+
+// A MinHash sketch of the set of token ids of a file: for each of
+// file_sketch_size hash functions, the least hash of its token ids.  Two
+// files have the same value for each with probability the Jaccard
+// similarity of their sets.  Token ids with one-byte codes are left out,
+// as nearly every file has most of them.
+constexpr size_t file_sketch_size = 4;
+using FileSketch = std::array<uint64_t, file_sketch_size>;
+
+constexpr FileSketch empty_sketch = {UINT64_MAX, UINT64_MAX, UINT64_MAX,
+                                     UINT64_MAX};
+
+void add_to_sketch(FileSketch& sketch, uint32_t token_id) {
+  if (token_id < 128) return;
+  for (size_t i = 0; i < file_sketch_size; i++)
+    sketch[i] = std::min(sketch[i], hash_mix(token_id, i));
+}
+
+// A one-permutation MinHash sketch of the set of token 4-grams (shingles)
+// of a file, to find near duplicates: the hash of each shingle goes to
+// one of shingle_sketch_size bins by its top bits, and each bin keeps the
+// least.  The fraction of bins two files agree on estimates the Jaccard
+// similarity of their shingle sets.  Files with fewer than
+// min_sketch_shingles shingles, too few to fill the bins, have none.
+constexpr size_t shingle_length = 4;
+constexpr size_t shingle_sketch_bits = 5;
+constexpr size_t shingle_sketch_size = 1 << shingle_sketch_bits;
+constexpr size_t min_sketch_shingles = 4 * shingle_sketch_size;
+using ShingleSketch = std::array<uint32_t, shingle_sketch_size>;
+
+class ShingleSketcher {
+ public:
+  ShingleSketcher() { sketch_.fill(UINT32_MAX); }
+
+  void add(uint32_t token_id) {
+    // A polynomial rolling hash of the last shingle_length token ids.
+    uint32_t& oldest = window_[num_tokens_++ % shingle_length];
+    rolling_ = (rolling_ - oldest * oldest_weight) * weight + token_id;
+    oldest = token_id;
+    if (num_tokens_ < shingle_length) return;
+    uint64_t h = hash_mix(rolling_, shingle_length);
+    uint32_t& bin = sketch_[h >> (64 - shingle_sketch_bits)];
+    bin = std::min(bin, uint32_t(h));
+  }
+
+  std::optional<ShingleSketch> sketch() const {
+    if (num_tokens_ < min_sketch_shingles + shingle_length - 1) return {};
+    return sketch_;
   }
-  DVC_LOG("Number of encoded bytes: ", num_encoded_bytes);
-  std::vector<std::filesystem::path> files;
-  for (const auto& [k, v] : shas) files.push_back(files2[v]);
-  shas.clear();
-  files2.clear();
 
-  DVC_LOG("Writing index...");
-  dvc::file_writer index(output_index, dvc::truncate);
+ private:
+  static constexpr uint64_t weight = 0x9e3779b97f4a7c15;
+  static constexpr uint64_t oldest_weight = weight * weight * weight;
+  static_assert(shingle_length == 4);
+
+  ShingleSketch sketch_;
+  std::array<uint32_t, shingle_length> window_ = {};
+  uint64_t rolling_ = 0;
+  size_t num_tokens_ = 0;
+};
+
+// The percentage of the bins filled in either sketch that both agree on.
+size_t sketch_similarity(const ShingleSketch& a, const ShingleSketch& b) {
+  size_t filled = 0, agree = 0;
+  for (size_t i = 0; i < shingle_sketch_size; i++) {
+    if (a[i] == UINT32_MAX && b[i] == UINT32_MAX) continue;
+    filled++;
+    agree += a[i] == b[i];
+  }
+  return filled == 0 ? 0 : 100 * agree / filled;
+}
+
+// Locality-sensitive hashing: files whose sketches agree on every bin of
+// one of shingle_bands bands are compared.
+constexpr size_t shingle_bands = 8;
+constexpr size_t shingle_band_size = shingle_sketch_size / shingle_bands;
+
+// Clusters the files with `sketches`: each file, in order, joins the
+// cluster of the first earlier file that is the first of its own cluster,
+// shares a band bucket with it, and has a similarity of at least
+// near_duplicate_percent with it.  Otherwise it starts a cluster.  So
+// every file is a near duplicate of the first file of its cluster, not
+// just of some other file in it.  Returns the cluster of each file, the
+// index of its first file.
+std::vector<uint32_t> cluster_near_duplicates(
+    const std::vector<std::optional<ShingleSketch>>& sketches) {
+  std::vector<uint32_t> clusters(sketches.size());
+  // The first files of clusters in each band bucket, ascending.
+  std::vector<std::unordered_map<uint64_t, std::vector<uint32_t>>> buckets(
+      shingle_bands);
+  std::array<uint64_t, shingle_bands> band_hashes;
+  for (size_t i = 0; i < sketches.size(); i++) {
+    clusters[i] = i;
+    if (!sketches[i]) continue;
+    for (size_t band = 0; band < shingle_bands; band++) {
+      band_hashes[band] =
+          hash64(sketches[i]->data() + band * shingle_band_size,
+                 shingle_band_size * sizeof(uint32_t), band);
+      auto bucket = buckets[band].find(band_hashes[band]);
+      if (bucket == buckets[band].end()) continue;
+      for (uint32_t first : bucket->second) {
+        if (first >= clusters[i]) break;
+        if (sketch_similarity(*sketches[first], *sketches[i]) >=
+            near_duplicate_percent)
+          clusters[i] = first;
+      }
+    }
+    if (clusters[i] != i) continue;
+    for (size_t band = 0; band < shingle_bands; band++)
+      buckets[band][band_hashes[band]].push_back(i);
+  }
+  return clusters;
+}
+
+struct FileTotals {
+  size_t encoded_bytes = 0;
+  size_t newlines = 0;
+  size_t tokens = 0;
+  size_t bytes = 0;
+
+  FileTotals& operator+=(const FileTotals& that) {
+    encoded_bytes += that.encoded_bytes;
+    newlines += that.newlines;
+    tokens += that.tokens;
+    bytes += that.bytes;
+    return *this;
+  }
+};
+
+// Writes an index of `files`, whose sums are `file_totals`, encoded with
+// the dataset-wide token ids in token_map, whose kinds are token_kinds.
+// Files with the same value in `clusters` are near duplicates.
+void write_index(const std::filesystem::path& output_index,
+                 const std::vector<std::filesystem::path>& files,
+                 const FileTotals& file_totals,
+                 const std::map<std::string, size_t>& token_map,
+                 const std::vector<const std::string*>& inv_token_vec,
+                 const std::vector<idx::TokenKindInfo>& token_kinds,
+                 const std::vector<uint32_t>& clusters) {
+  size_t num_encoded_bytes = file_totals.encoded_bytes;
+  size_t num_newlines = file_totals.newlines;
+  std::vector<std::thread> threads;
+  std::atomic_size_t files_processed = 0;
+
+  // Written beside output_index and renamed over it when complete, so
+  // processes watching output_index never map a partial index.
+  std::filesystem::path partial_index = output_index.string() + ".partial";
+  DVC_LOG("Writing index to ", partial_index, "...");
+  std::optional<dvc::file_writer> index_writer;
+  dvc::file_writer& index =
+      index_writer.emplace(partial_index, dvc::truncate);
 
   DVC_LOG("Writing header...");
-  idx::IndexHeader header;
-  header.code_section_length = num_encoded_bytes;
-  header.file_section_offset = sizeof(idx::IndexHeader);
+  idx::IndexHeaderV3 header;
   header.num_files = files.size();
   header.num_tokens = token_map.size();
-  header.total_tokens = total_tokens;
+  header.total_tokens = file_totals.tokens;
   header.total_lines = num_newlines;
-  header.total_bytes = total_bytes;
+  header.total_bytes = file_totals.bytes;
+  header.section_alignment = section_alignment;
+  header.code_section_alignment = code_section_alignment;
+  header.checksum_chunk_size = checksum_chunk_size;
+  header.num_sections = 12 + store_source + (super_tokens > 0) +
+                        (near_duplicate_percent > 0);
+  if (canonical_tokens) header.flags |= idx::canonical_tokens;
   index.rwrite(header);
+  for (size_t i = 0; i < header.num_sections; i++)
+    index.rwrite(idx::SectionEntry{});
+
+  std::vector<idx::SectionEntry> sections;
+  // Starts a section of `type` at the next multiple of `alignment`.
+  auto begin_section = [&](idx::SectionType type, size_t alignment,
+                           uint32_t flags = 0) {
+    index.seek((index.tell() + alignment - 1) / alignment * alignment);
+    sections.push_back({type, flags, index.tell(), 0, 0});
+    return index.tell();
+  };
+  auto end_section = [&] {
+    sections.back().length = index.tell() - sections.back().offset;
+    return index.tell();
+  };
 
-  header.file_section_offset = index.tell();
-  DVC_LOG("Padding file section @ ", header.file_section_offset);
+  size_t file_section_offset =
+      begin_section(idx::SectionType::files, section_alignment);
+  DVC_LOG("Padding file section @ ", file_section_offset);
   for (const std::filesystem::path& file : files) {
     (void)file;
     index.rwrite(idx::FileInfo{});
   }
+  end_section();
 
-  header.token_id_section_offset = index.tell();
-  DVC_LOG("Padding token id section @ ", header.token_id_section_offset);
+  size_t token_id_section_offset =
+      begin_section(idx::SectionType::token_ids, section_alignment);
+  DVC_LOG("Padding token id section @ ", token_id_section_offset);
   for (size_t i = 0; i < header.num_tokens; i++)
     index.rwrite(idx::TokenIdInfo{});
+  end_section();
 
-  header.token_alphabetical_section_offset = index.tell();
+  size_t token_alphabetical_section_offset =
+      begin_section(idx::SectionType::token_alphabetical, section_alignment);
   DVC_LOG("Writing token alphabetical section @ ",
-          header.token_alphabetical_section_offset);
+          token_alphabetical_section_offset);
   for (const auto& [spelling, token_id] : token_map) {
     idx::TokenAlphabeticalInfo info;
     info.token_id = token_id;
     index.rwrite(info);
   }
+  end_section();
+
+  size_t token_hash_offset = begin_section(
+      idx::SectionType::token_hash, section_alignment, idx::section_optional);
+  DVC_LOG("Writing token hash section @ ", token_hash_offset);
+  write_token_hash_section(index, inv_token_vec);
+  end_section();
+
+  size_t token_trigram_offset =
+      begin_section(idx::SectionType::token_trigrams, section_alignment,
+                    idx::section_optional);
+  DVC_LOG("Writing token trigram section @ ", token_trigram_offset);
+  write_token_trigram_section(index, inv_token_vec);
+  end_section();
+
+  if (near_duplicate_percent > 0) {
+    size_t file_cluster_offset =
+        begin_section(idx::SectionType::file_clusters, section_alignment,
+                      idx::section_optional);
+    DVC_LOG("Writing file cluster section @ ", file_cluster_offset);
+    std::unordered_map<uint32_t, uint32_t> first_files;
+    for (size_t i = 0; i < files.size(); i++)
+      index.rwrite(first_files.emplace(clusters[i], i).first->second);
+    end_section();
+  }
 
-  size_t lineinfo_offset = index.tell();
-  DVC_LOG("Padding line info section @ ", lineinfo_offset);
-  void* pad = std::malloc(num_newlines * sizeof(idx::LineInfo));
-  DVC_ASSERT(pad);
-  index.write(pad, num_newlines * sizeof(idx::LineInfo));
-  std::free(pad);
-
-  header.code_section_offset = index.tell();
-  DVC_LOG("Padding code section @ ", header.code_section_offset);
-  pad = std::malloc(num_encoded_bytes);
-  DVC_ASSERT(pad);
-  index.write(pad, num_encoded_bytes);
-  std::free(pad);
-
-  size_t filename_offset = index.tell();
-  DVC_LOG("Writing filenames @ ", filename_offset);
-  for (const std::filesystem::path& file : files) {
-    std::string filename_cstr = file.string();
-    index.write(filename_cstr.c_str(), filename_cstr.size() + 1);
+  size_t token_kind_offset = begin_section(
+      idx::SectionType::token_kinds, section_alignment, idx::section_optional);
+  DVC_LOG("Writing token kind section @ ", token_kind_offset);
+  index.write(token_kinds.data(),
+              token_kinds.size() * sizeof(idx::TokenKindInfo));
+  end_section();
+
+  // A compressed code section, or one with super tokens, is written once
+  // it is known, after the others.
+  bool code_last = compress_code || super_tokens > 0;
+  size_t code_section_offset = 0;
+  if (!code_last) {
+    code_section_offset =
+        begin_section(idx::SectionType::code, code_section_alignment);
+    DVC_LOG("Padding code section @ ", code_section_offset);
+    void* pad = std::malloc(num_encoded_bytes);
+    DVC_ASSERT(pad);
+    index.write(pad, num_encoded_bytes);
+    std::free(pad);
+    end_section();
   }
 
-  size_t spelling_offset = index.tell();
+  size_t path_offset =
+      begin_section(idx::SectionType::paths, section_alignment);
+  DVC_LOG("Writing paths @ ", path_offset);
+  write_path_section(index, files);
+  end_section();
+
+  size_t spelling_offset =
+      begin_section(idx::SectionType::spellings, section_alignment);
   DVC_LOG("Writing spelling offset @ ", spelling_offset);
   for (size_t i = 1; i < inv_token_vec.size(); i++) {
     index.write(inv_token_vec[i]->c_str(), inv_token_vec[i]->size() + 1);
   }
+  size_t spelling_end = end_section();
+  DVC_LOG("Spellings end @ ", spelling_end);
 
-  size_t total_index_size = index.tell();
-  DVC_LOG("Total index size: ", total_index_size);
-
-  DVC_LOG("Backpatching header:");
-  index.seek(0);
-  index.rwrite(header);
-
-  DVC_LOG("Backpatching file info...");
   std::vector<idx::FileInfo> file_infos(files.size());
-  size_t filename_cstr = filename_offset;
-  for (size_t i = 0; i < files.size(); i++) {
-    file_infos[i].filename_cstr = filename_cstr;
-    filename_cstr += files[i].string().size() + 1;
-  }
+  std::vector<std::vector<uint32_t>> file_includes(files.size());
 
   DVC_LOG("Pass 4: Analyzing ", srcdir, ".");
   files_processed = 0;
@@ -335,18 +1382,23 @@ void ppindex(int argc, char** argv) {
           std::vector<std::byte> encoded;
           try {
             VectorTokenStream output;
-            Tokenize(code, output);
+            tokenize(code, output);
             file_info.num_lines = output.newlines_tokens.size();
 
             encoded.resize(5 * (output.tokens.size() + 1));
             std::byte* ptr = encoded.data();
+            std::vector<uint32_t>& includes = file_includes[file_index];
             for (const Token& token : output.tokens) {
               DVC_ASSERT(!token.spelling.empty());
               uint32_t token_id = token_map.at(token.spelling);
               encode_token(token_id, ptr);
+              if (token.kind == HEADER_NAME) includes.push_back(token_id);
             }
             encode_token(0, ptr);
             encoded.resize(ptr - encoded.data());
+            std::sort(includes.begin(), includes.end());
+            includes.erase(std::unique(includes.begin(), includes.end()),
+                           includes.end());
             DVC_ASSERT(uint8_t(encoded.back()) == 0);
             file_info.code_length = encoded.size();
           } catch (std::exception& e) {
@@ -362,23 +1414,22 @@ void ppindex(int argc, char** argv) {
   threads.clear();
   DVC_LOG("Pass 4 of ", srcdir, " complete.");
 
-  DVC_LOG("Backpatching file info...");
-  index.seek(header.file_section_offset);
+  DVC_LOG("Assigning code offsets...");
   size_t code_offset = 0;
-  size_t current_lineinfo_offset = lineinfo_offset;
+  size_t line_offset = 0;
+  std::vector<size_t> first_lines;
   for (idx::FileInfo& file_info : file_infos) {
     file_info.code_offset = code_offset;
-    file_info.lineinfo_offset = current_lineinfo_offset;
-    index.rwrite(file_info);
+    first_lines.push_back(line_offset);
 
     code_offset += file_info.code_length;
-    current_lineinfo_offset += (file_info.num_lines * sizeof(idx::LineInfo));
+    line_offset += file_info.num_lines;
   }
-  DVC_ASSERT_EQ(header.code_section_length, code_offset);
-  DVC_ASSERT_EQ(header.code_section_offset, current_lineinfo_offset);
+  DVC_ASSERT_EQ(num_encoded_bytes, code_offset);
+  DVC_ASSERT_EQ(num_newlines, line_offset);
 
-  DVC_LOG("Backpatching token id section @ ", header.token_id_section_offset);
-  index.seek(header.token_id_section_offset);
+  DVC_LOG("Backpatching token id section @ ", token_id_section_offset);
+  index.seek(token_id_section_offset);
   size_t spelling_cstr = spelling_offset;
   DVC_ASSERT_EQ(header.num_tokens + 1, inv_token_vec.size());
   for (size_t i = 0; i < header.num_tokens; i++) {
@@ -387,10 +1438,9 @@ void ppindex(int argc, char** argv) {
     index.rwrite(id);
     spelling_cstr += inv_token_vec[i + 1]->size() + 1;
   }
-  DVC_ASSERT_EQ(spelling_cstr, total_index_size);
+  DVC_ASSERT_EQ(spelling_cstr, spelling_end);
 
-  DVC_LOG("Backpatching code section @ ", header.code_section_offset);
-  DVC_ASSERT_EQ(num_encoded_bytes, header.code_section_length);
+  DVC_LOG("Encoding code section...");
   std::vector<std::byte> code_section(num_encoded_bytes);
 
   DVC_LOG("Pass 5: Analyzing ", srcdir, ".");
@@ -406,7 +1456,7 @@ void ppindex(int argc, char** argv) {
           std::byte* dest = code_section.data() + file_info.code_offset;
           try {
             VectorTokenStream output;
-            Tokenize(code, output);
+            tokenize(code, output);
             for (const Token& token : output.tokens) {
               DVC_ASSERT(!token.spelling.empty());
               uint32_t token_id = token_map.at(token.spelling);
@@ -428,14 +1478,8 @@ void ppindex(int argc, char** argv) {
   threads.clear();
   DVC_LOG("Pass 5 of ", srcdir, " complete.");
 
-  DVC_LOG("Continuing backpatching code section @ ",
-          header.code_section_offset);
-  index.seek(header.code_section_offset);
-  index.write(code_section.data(), code_section.size());
-  code_section.clear();
-
-  DVC_LOG("Backpatching line info section @ ", lineinfo_offset);
-  index.seek(lineinfo_offset);
+  DVC_LOG("Counting next tokens...");
+  NextTokenTable next_tokens = count_next_tokens(code_section);
 
   DVC_LOG("Creating vector of ", num_newlines);
 
@@ -449,15 +1493,13 @@ void ppindex(int argc, char** argv) {
         if (file_index % nthreads == thread_index) {
           const idx::FileInfo& file_info = file_infos.at(file_index);
           idx::LineInfo* line_info =
-              line_infos.data() +
-              (file_info.lineinfo_offset - lineinfo_offset) /
-                  sizeof(idx::LineInfo);
+              line_infos.data() + first_lines[file_index];
 
           std::string code = dvc::load_file(files[file_index]);
 
           try {
             VectorTokenStream output;
-            Tokenize(code, output);
+            tokenize(code, output);
             size_t num_lines = output.newlines_tokens.size();
             DVC_ASSERT_EQ(num_lines, file_info.num_lines);
             for (size_t i = 0; i < num_lines; i++) {
@@ -492,9 +1534,387 @@ void ppindex(int argc, char** argv) {
   threads.clear();
   DVC_LOG("Pass 6 of ", srcdir, " complete.");
 
-  DVC_LOG("Continuing backpatching line info section @ ", lineinfo_offset);
-  index.write(line_infos.data(), line_infos.size() * sizeof(idx::LineInfo));
-  DVC_ASSERT_EQ(header.code_section_offset, index.tell());
+  std::optional<SuperTokenTable> super_token_table;
+  if (super_tokens > 0) {
+    DVC_LOG("Choosing ", super_tokens, " super tokens...");
+    super_token_table = encode_super_tokens(
+        code_section, file_infos, line_infos, first_lines, header.num_tokens);
+  }
+
+  size_t section_end = spelling_end;
+  if (compress_code) {
+    index.seek(section_end);
+    size_t code_blocks_offset =
+        begin_section(idx::SectionType::code_blocks, section_alignment);
+    DVC_LOG("Writing code block section @ ", code_blocks_offset);
+    write_code_block_section(index, code_section);
+    section_end = end_section();
+  } else if (code_last) {
+    index.seek(section_end);
+    code_section_offset =
+        begin_section(idx::SectionType::code, code_section_alignment);
+    DVC_LOG("Writing code section @ ", code_section_offset);
+    index.write(code_section.data(), code_section.size());
+    section_end = end_section();
+  } else {
+    DVC_LOG("Continuing backpatching code section @ ", code_section_offset);
+    index.seek(code_section_offset);
+    index.write(code_section.data(), code_section.size());
+  }
+  std::vector<std::byte>().swap(code_section);
+
+  if (super_token_table) {
+    index.seek(section_end);
+    size_t super_token_offset =
+        begin_section(idx::SectionType::super_tokens, section_alignment);
+    DVC_LOG("Writing super token section @ ", super_token_offset);
+    write_super_token_section(index, *super_token_table);
+    section_end = end_section();
+  }
+
+  index.seek(section_end);
+  size_t line_table_offset =
+      begin_section(idx::SectionType::line_table, section_alignment);
+  DVC_LOG("Writing line table section @ ", line_table_offset);
+  write_line_table_section(index, line_infos, file_infos);
+  line_infos.clear();
+  line_infos.shrink_to_fit();
+  size_t line_table_end = end_section();
+  DVC_LOG("Line table: ", line_table_end - line_table_offset, " bytes for ",
+          num_newlines, " lines");
+
+  size_t next_token_offset = begin_section(
+      idx::SectionType::next_tokens, section_alignment, idx::section_optional);
+  DVC_LOG("Writing next token section @ ", next_token_offset);
+  write_next_token_section(index, next_tokens);
+  end_section();
+  DVC_LOG("Next tokens: ", next_tokens.contexts.size(), " contexts, ",
+          next_tokens.next.size(), " next tokens");
+
+  size_t include_graph_offset =
+      begin_section(idx::SectionType::include_graph, section_alignment,
+                    idx::section_optional);
+  DVC_LOG("Writing include graph section @ ", include_graph_offset);
+  write_include_graph_section(index, files, file_includes, inv_token_vec);
+  size_t include_graph_end = end_section();
+
+  DVC_LOG("Backpatching file info @ ", file_section_offset);
+  index.seek(file_section_offset);
+  for (const idx::FileInfo& file_info : file_infos) index.rwrite(file_info);
+
+  if (store_source) {
+    DVC_LOG("Writing source section...");
+    index.seek(include_graph_end);
+    begin_section(idx::SectionType::source, section_alignment,
+                  idx::section_optional);
+    write_source_section(index, files, file_infos);
+    end_section();
+  }
+  DVC_ASSERT_EQ(sections.size(), header.num_sections);
+
+  index_writer.reset();
+  write_directory(partial_index, header, sections);
+  DVC_LOG("Renaming ", partial_index, " to ", output_index);
+  std::filesystem::rename(partial_index, output_index);
+}
+
+void ppindex(int argc, char** argv) {
+  dvc::program program(argc, argv);
+
+  DVC_ASSERT(exists(srcdir) && is_directory(srcdir),
+             "No such directory: ", srcdir);
+  file_layout file_order = parse_file_layout(layout);
+
+  std::optional<dvc::file_writer> skipped_files;
+
+  if (!output_skipped_files.empty())
+    skipped_files = dvc::file_writer(output_skipped_files, dvc::truncate);
+
+  size_t nskipped_files = 0;
+
+  std::map<std::string, size_t> skipped_reasons;
+  auto skip_file = [&](const std::filesystem::path& skipped_file,
+                       const std::string& reason) {
+    nskipped_files++;
+    if (skipped_files) skipped_files->println(skipped_file.string());
+    skipped_reasons[reason]++;
+  };
+
+  std::vector<std::filesystem::path> files1;
+
+  DVC_LOG("Pass 1: Analyzing ", srcdir, ".");
+  for (const std::filesystem::directory_entry& dirent :
+       std::filesystem::recursive_directory_iterator(srcdir)) {
+    if (dirent.is_directory()) continue;
+
+    DVC_ASSERT(dirent.is_regular_file(), "Irregular file: ", dirent.path());
+
+    if (dirent.file_size() > max_file_size) {
+      skip_file(dirent, "too large");
+      continue;
+    }
+
+    files1.push_back(dirent);
+
+    if (dvc::is_pow2(files1.size())) {
+      DVC_LOG("Analyzed ", files1.size(), " source files.");
+    }
+  }
+  DVC_LOG("Pass 1 of ", srcdir, " complete: ", files1.size(),
+          " source files analyzed.");
+  if (nskipped_files > 0) {
+    DVC_ERROR(nskipped_files, " files were skipped for the following reasons:");
+    for (const auto& [reason, skipped] : skipped_reasons) {
+      DVC_ERROR(skipped, " files were skipped because: ", reason);
+    }
+  }
+
+  std::vector<std::filesystem::path> files2;
+  std::map<std::string, size_t> token_map;
+
+  DVC_LOG("Pass 2: Analyzing ", srcdir, ".");
+  std::vector<std::thread> threads;
+  std::mutex mu;
+  std::atomic_size_t files_processed = 0;
+  std::atomic_size_t num_tokens = 0;
+  for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+    threads.emplace_back([&, thread_index] {
+      for (size_t files1_index = 0; files1_index < files1.size();
+           files1_index++)
+        if (files1_index % nthreads == thread_index) {
+          std::string code = dvc::load_file(files1[files1_index]);
+
+          std::vector<Token> tokens;
+
+          try {
+            VectorTokenStream output;
+            tokenize(code, output);
+            tokens = std::move(output.tokens);
+            std::lock_guard lock(mu);
+            files2.push_back(files1[files1_index]);
+            num_tokens += tokens.size();
+            for (const Token& token : tokens) token_map[token.spelling]++;
+          } catch (std::exception& e) {
+            std::lock_guard lock(mu);
+            skip_file(files1[files1_index], e.what());
+            continue;
+          }
+          if (dvc::is_pow2(files_processed++))
+            DVC_LOG("Analyzed ", files_processed, " files.");
+        }
+    });
+
+  for (std::thread& t : threads) t.join();
+  threads.clear();
+  files1.clear();
+
+  DVC_LOG("Pass 2 of ", srcdir, " complete: ", files2.size(),
+          " source files analyzed.");
+
+  if (nskipped_files > 0) {
+    DVC_ERROR(nskipped_files, " files were skipped for the following reasons:");
+    for (const auto& [reason, skipped] : skipped_reasons) {
+      DVC_ERROR(skipped, " files were skipped because: ", reason);
+    }
+  }
+
+  DVC_LOG("Num tokens: ", num_tokens);
+  DVC_LOG("Unique tokens: ", token_map.size());
+  DVC_LOG("Inverting token counts...");
+  std::multimap<size_t, const std::string*> count_to_token;
+  for (const auto& [k, v] : token_map) count_to_token.insert(std::pair(v, &k));
+
+  std::vector<const std::string*> inv_token_vec;
+
+  std::string eof_token;
+
+  inv_token_vec.push_back(&eof_token);
+
+  for (auto it = count_to_token.crbegin(); it != count_to_token.crend(); it++) {
+    inv_token_vec.push_back(it->second);
+  }
+
+  if (!output_token_counts.empty()) {
+    dvc::file_writer token_counts_file(output_token_counts, dvc::truncate);
+    for (auto it = count_to_token.crbegin(); it != count_to_token.crend();
+         it++) {
+      size_t count = it->first;
+      const std::string& token = *(it->second);
+      token_counts_file.println(count, " ", token.size(), " ", token);
+    }
+  }
+  count_to_token.clear();
+
+  for (size_t i = 1; i < inv_token_vec.size(); i++)
+    token_map.at(*inv_token_vec[i]) = i;
+
+  DVC_LOG("Shuffling file list...");
+  std::mt19937 rand_engine;
+  std::shuffle(files2.begin(), files2.end(), rand_engine);
+
+  DVC_LOG("Pass 3: Analyzing ", srcdir, ".");
+  files_processed = 0;
+  std::atomic_size_t num_encoded_bytes = 0;
+  std::unordered_map<std::string, size_t> shas;
+  std::vector<FileTotals> files2_totals(files2.size());
+  std::vector<FileSketch> files2_sketches(files2.size());
+  std::vector<std::optional<ShingleSketch>> files2_shingles(files2.size());
+  // Per thread, the kinds each token id occurs as; see token_kind_infos.
+  std::vector<std::vector<uint8_t>> kind_masks(
+      nthreads, std::vector<uint8_t>(inv_token_vec.size()));
+  for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+    threads.emplace_back([&, thread_index] {
+      for (size_t files2_index = 0; files2_index < files2.size();
+           files2_index++)
+        if (files2_index % nthreads == thread_index) {
+          std::string code = dvc::load_file(files2.at(files2_index));
+
+          std::vector<std::byte> encoded;
+          try {
+            VectorTokenStream output;
+            tokenize(code, output);
+            size_t newlines = output.newlines_tokens.size();
+            encoded.resize(5 * (output.tokens.size() + 1));
+            std::byte* ptr = encoded.data();
+            FileSketch sketch = empty_sketch;
+            ShingleSketcher shingles;
+            for (const Token& token : output.tokens) {
+              DVC_ASSERT(!token.spelling.empty());
+              uint32_t token_id = token_map.at(token.spelling);
+              encode_token(token_id, ptr);
+              kind_masks[thread_index][token_id] |= 1 << token.kind;
+              if (file_order == file_layout::similar)
+                add_to_sketch(sketch, token_id);
+              if (near_duplicate_percent > 0) shingles.add(token_id);
+            }
+            encode_token(0, ptr);
+            encoded.resize(ptr - encoded.data());
+            DVC_ASSERT(uint8_t(encoded.back()) == 0);
+            std::string sha =
+                dvc::SHA3({(const char*)encoded.data(), encoded.size()});
+            std::lock_guard lock(mu);
+            auto it = shas.find(sha);
+            if (!output.tokens.empty() && it == shas.end()) {
+              shas.emplace_hint(it, std::move(sha), files2_index);
+              num_encoded_bytes += encoded.size();
+              files2_totals[files2_index] = {encoded.size(), newlines,
+                                             output.tokens.size(), code.size()};
+              files2_sketches[files2_index] = sketch;
+              files2_shingles[files2_index] = shingles.sketch();
+            } else {
+              if (output.tokens.empty())
+                skip_file(files2.at(files2_index), "no tokens");
+              else
+                skip_file(files2.at(files2_index), "same sha");
+            }
+          } catch (std::exception& e) {
+            DVC_FATAL("Unexpected bad file: ", e.what(), ": ",
+                      files2[files2_index]);
+          }
+
+          size_t n = files_processed++;
+          if (dvc::is_pow2(n))
+            DVC_LOG("Analyzed ", n,
+                    " files. num_encoded_bytes = ", num_encoded_bytes);
+        }
+    });
+  for (std::thread& t : threads) t.join();
+  threads.clear();
+  DVC_LOG("Pass 3 of ", srcdir, " complete: ", shas.size(),
+          " source files analyzed.");
+  std::vector<idx::TokenKindInfo> token_kinds =
+      token_kind_infos(kind_masks, inv_token_vec);
+  kind_masks.clear();
+
+  if (nskipped_files > 0) {
+    DVC_ERROR(nskipped_files, " files were skipped for the following reasons:");
+    for (const auto& [reason, skipped] : skipped_reasons) {
+      DVC_ERROR(skipped, " files were skipped because: ", reason);
+    }
+  }
+  DVC_LOG("Number of encoded bytes: ", num_encoded_bytes);
+  // shas is unordered, so its order is already random.
+  std::vector<size_t> order;
+  for (const auto& [k, v] : shas) order.push_back(v);
+  if (file_order == file_layout::path) {
+    DVC_LOG("Sorting files by path...");
+    std::sort(order.begin(), order.end(),
+              [&](size_t a, size_t b) { return files2[a] < files2[b]; });
+  } else if (file_order == file_layout::similar) {
+    DVC_LOG("Sorting files by token set sketch...");
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return std::tie(files2_sketches[a], files2[a]) <
+             std::tie(files2_sketches[b], files2[b]);
+    });
+  }
+  std::vector<uint32_t> clusters(order.size());
+  if (near_duplicate_percent > 0) {
+    DVC_LOG("Clustering near duplicates...");
+    std::vector<std::optional<ShingleSketch>> sketches;
+    for (size_t i : order) sketches.push_back(files2_shingles[i]);
+    clusters = cluster_near_duplicates(sketches);
+  }
+  std::vector<std::filesystem::path> files;
+  std::vector<FileTotals> totals;
+  std::vector<uint32_t> file_clusters;
+  size_t num_near_duplicates = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    if (clusters[i] != i) {
+      num_near_duplicates++;
+      if (drop_near_duplicates) {
+        skip_file(files2[order[i]], "near duplicate");
+        continue;
+      }
+    }
+    files.push_back(files2[order[i]]);
+    totals.push_back(files2_totals[order[i]]);
+    file_clusters.push_back(clusters[i]);
+  }
+  if (near_duplicate_percent > 0)
+    DVC_LOG(num_near_duplicates, " files are near duplicates of others",
+            drop_near_duplicates ? " and were dropped." : ".");
+  shas.clear();
+  files2.clear();
+  files2_totals.clear();
+  files2_sketches.clear();
+  files2_shingles.clear();
+
+  std::vector<std::vector<std::filesystem::path>> shard_files(num_shards);
+  std::vector<FileTotals> shard_totals(num_shards);
+  std::vector<std::vector<uint32_t>> shard_clusters(num_shards);
+  // Each cluster of near duplicates goes to the shard with the fewest
+  // encoded bytes when its first file is placed, and all of it to that
+  // shard, so that it is sampled once rather than once per shard.
+  std::unordered_map<uint32_t, size_t> cluster_shards;
+  for (size_t i = 0; i < files.size(); i++) {
+    auto [cluster_shard, placed_first] =
+        cluster_shards.emplace(file_clusters[i], 0);
+    if (placed_first)
+      cluster_shard->second =
+          std::min_element(shard_totals.begin(), shard_totals.end(),
+                           [](const FileTotals& a, const FileTotals& b) {
+                             return a.encoded_bytes < b.encoded_bytes;
+                           }) -
+          shard_totals.begin();
+    size_t shard = cluster_shard->second;
+    shard_files[shard].push_back(files[i]);
+    shard_totals[shard] += totals[i];
+    shard_clusters[shard].push_back(file_clusters[i]);
+  }
+  files.clear();
+  totals.clear();
+
+  for (size_t shard = 0; shard < num_shards; shard++) {
+    std::filesystem::path shard_index =
+        num_shards == 1 ? output_index
+                        : std::filesystem::path(output_index.string() + "." +
+                                                std::to_string(shard));
+    DVC_LOG("Shard ", shard, " of ", num_shards, ": ",
+            shard_files[shard].size(), " files, ",
+            shard_totals[shard].encoded_bytes, " encoded bytes.");
+    write_index(shard_index, shard_files[shard], shard_totals[shard],
+                token_map, inv_token_vec, token_kinds, shard_clusters[shard]);
+  }
 }
 
 }  // namespace ppt
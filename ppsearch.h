@@ -2,13 +2,21 @@
 
 #include <atomic>
 #include <map>
+#include <optional>
 #include <random>
 #include <thread>
 
 #include "dvc/file.h"
 #include "dvc/sampler.h"
+#include "hash.h"
+#include "highlight.h"
 #include "index_reader.h"
+#include "match_sets.h"
 #include "mmapfile.h"
+#include "query_cache.h"
+#include "snippet_reader.h"
+#include "streamfile.h"
+#include "super_tokens.h"
 #include "token_codec.h"
 #include "tokenize.h"
 #include "vector_token_stream.h"
@@ -17,19 +25,98 @@ namespace ppt {
 
 struct CodeSearchResults {
   std::string error;
+  // If a query token is not in the index, the query with it replaced by
+  // the most similar token that is, if any.
+  std::string suggested_query;
 
   size_t num_files;
   size_t num_matches;
+  // Of num_matches, those not in near duplicates of other files (see
+  // SectionType::file_clusters).  Samples are of these.
+  size_t num_unique_matches;
+
+  residency_stats residency;  // see mmapfile::stats
 
   struct Sample {
+    size_t offset;  // of the match, relative to the code section
     std::filesystem::path file;
     uint32_t first_line, match_line;
     std::vector<std::string> lines;
+    std::vector<Highlight> highlights;  // the matched tokens in lines
   };
 
   std::vector<Sample> samples;
 };
 
+// Byte encoding of successful results, for QueryCache.
+inline std::string serialize(const CodeSearchResults& results) {
+  std::string out;
+  auto put = [&](auto x) { out.append((const char*)&x, sizeof x); };
+  auto put_string = [&](const std::string& s) {
+    put(uint32_t(s.size()));
+    out += s;
+  };
+  put(uint64_t(results.num_files));
+  put(uint64_t(results.num_matches));
+  put(uint64_t(results.num_unique_matches));
+  put(uint32_t(results.samples.size()));
+  for (const CodeSearchResults::Sample& sample : results.samples) {
+    put(uint64_t(sample.offset));
+    put_string(sample.file.string());
+    put(sample.first_line);
+    put(sample.match_line);
+    put(uint32_t(sample.lines.size()));
+    for (const std::string& line : sample.lines) put_string(line);
+    put(uint32_t(sample.highlights.size()));
+    for (const Highlight& highlight : sample.highlights) put(highlight);
+  }
+  return out;
+}
+
+inline CodeSearchResults deserialize_results(std::string_view in) {
+  auto get = [&](auto& x) {
+    DVC_ASSERT_GE(in.size(), sizeof x, "Corrupt serialized results");
+    ::memcpy(&x, in.data(), sizeof x);
+    in.remove_prefix(sizeof x);
+  };
+  auto get_string = [&] {
+    uint32_t size;
+    get(size);
+    DVC_ASSERT_GE(in.size(), size, "Corrupt serialized results");
+    std::string s(in.substr(0, size));
+    in.remove_prefix(size);
+    return s;
+  };
+  CodeSearchResults results;
+  uint64_t num_files, num_matches, num_unique_matches;
+  uint32_t num_samples;
+  get(num_files);
+  get(num_matches);
+  get(num_unique_matches);
+  get(num_samples);
+  results.num_files = num_files;
+  results.num_matches = num_matches;
+  results.num_unique_matches = num_unique_matches;
+  results.samples.resize(num_samples);
+  for (CodeSearchResults::Sample& sample : results.samples) {
+    uint64_t offset;
+    get(offset);
+    sample.offset = offset;
+    sample.file = get_string();
+    get(sample.first_line);
+    get(sample.match_line);
+    uint32_t num_lines;
+    get(num_lines);
+    for (uint32_t i = 0; i < num_lines; i++)
+      sample.lines.push_back(get_string());
+    uint32_t num_highlights;
+    get(num_highlights);
+    sample.highlights.resize(num_highlights);
+    for (Highlight& highlight : sample.highlights) get(highlight);
+  }
+  return results;
+}
+
 template <typename... Args>
 CodeSearchResults make_error(Args&&... args) {
   CodeSearchResults results;
@@ -39,97 +126,562 @@ CodeSearchResults make_error(Args&&... args) {
 
 constexpr size_t num_samples = 100;
 
-inline CodeSearchResults codesearch(const std::filesystem::path& index_file,
-                                    const std::string& query, size_t nthreads,
-                                    size_t block_size) {
-  DVC_ASSERT(exists(index_file), "No such file: ", index_file);
-  mmapfile index_mmap(index_file);
-  idx::IndexReader index(index_mmap.get());
+// Calls on_match(candidate) for each candidate in [start, end) at which
+// the query bytes occur.  Up to query length - 1 bytes past end are read.
+template <typename F>
+inline void scan_block(const std::byte* start, const std::byte* end,
+                       const std::byte* query_begin,
+                       const std::byte* query_end, F&& on_match) {
+  for (const std::byte* candidate = start; candidate < end; candidate++) {
+    bool found = true;
+    const std::byte* p = candidate;
+    for (const std::byte* q = query_begin; q < query_end; q++) {
+      if (*p != *q) {
+        found = false;
+        break;
+      }
+      p++;
+    }
+    if (found) {
+      on_match(candidate);
+    }
+  }
+}
+
+// An index mapped and made resident once, for any number of searches.
+struct Index {
+  Index(const std::filesystem::path& path, const mmap_options& options = {})
+      : path(path),
+        options(options),
+        mmap(path, options),
+        reader(mmap.get()),
+        snippets(&reader) {
+    // Version 3 section checksums identify the content, so copies of an
+    // index share cached results.  Version 2 has none, but ppindex always
+    // renames a fresh file into place, so the inode and mtime change with
+    // every rebuild.
+    if (reader.version >= 3) {
+      identity = reader.directory_checksum;
+      return;
+    }
+    struct stat st;
+    DVC_ASSERT_EQ(0, ::stat(path.c_str(), &st), "Unable to stat ", path, ": ",
+                  strerror(errno));
+    uint64_t file_id[] = {st.st_dev, st.st_ino, uint64_t(st.st_size),
+                          uint64_t(st.st_mtim.tv_sec),
+                          uint64_t(st.st_mtim.tv_nsec)};
+    identity = hash64(mmap.get().substr(0, sizeof(idx::IndexHeader)),
+                      hash64(file_id, sizeof file_id));
+  }
+
+  const std::filesystem::path path;
+  const mmap_options options;
+  mmapfile mmap;
+  idx::IndexReader reader;
+  uint64_t identity;  // changes whenever the index is rebuilt
+  SnippetReader snippets;
+  // Only kept by those who open the index for many queries; see
+  // refine_matches.
+  std::optional<MatchSetCache> match_sets;
+};
 
-  if (query.empty()) return make_error("Empty query string.");
+// Tokenizes `query` and encodes it with the token ids of `index`.
+// Returns an error message, empty on success.  If a token is not in the
+// index, sets `suggested_query` (if given) as CodeSearchResults does.
+inline std::string encode_query(idx::IndexReader& index,
+                                const std::string& query,
+                                std::vector<std::byte>& encoded,
+                                std::string* suggested_query = nullptr) {
+  if (query.empty()) return "Empty query string.";
 
-  VectorTokenStream output;
+  PositionedTokenStream output;
   try {
     Tokenize(query, output);
   } catch (std::exception& e) {
-    return make_error("Could not tokenize query string `", query,
-                      "` because: ", e.what());
+    return dvc::concat("Could not tokenize query string `", query,
+                       "` because: ", e.what());
   }
-  if (output.tokens.empty())
-    return make_error("Query string contains no C++ tokens.");
+  if (output.tokens.empty()) return "Query string contains no C++ tokens.";
 
-  std::vector<std::byte> encoded(5 * (output.tokens.size() + 1));
+  encoded.resize(5 * (output.tokens.size() + 1));
   std::byte* ptr = encoded.data();
-  for (const Token& token : output.tokens) {
+  for (size_t i = 0; i < output.tokens.size(); i++) {
+    const Token& token = output.tokens[i];
     uint32_t token_id = index.token_id(token.spelling);
-    if (token_id == 0)
-      return make_error("No matches found.  (No such token in dataset `",
-                        token.spelling, "`)");
-    encode_token(token_id, ptr);
+    if (token_id != 0) {
+      encode_token(token_id, ptr);
+      continue;
+    }
+    std::string error =
+        dvc::concat("No matches found.  (No such token in dataset `",
+                    token.spelling, "`)");
+    std::vector<idx::IndexReader::SimilarToken> similar =
+        index.similar_tokens(token.spelling, 1);
+    if (similar.empty()) return error;
+    std::string_view suggestion = index.spelling(similar[0].token_id);
+    error += dvc::concat("  Did you mean `", suggestion, "`?");
+    if (suggested_query && i < output.ranges.size()) {
+      auto [begin, end] = output.ranges[i];
+      *suggested_query = query;
+      suggested_query->replace(begin, end - begin, suggestion);
+    }
+    return error;
   }
   encoded.resize(ptr - encoded.data());
   DVC_ASSERT_GT(encoded.size(), 0);
+  return "";
+}
+
+// Up to `max_results` completions of `query` as typed so far, most likely
+// first, each the whole query with one more token.  If `query` ends in an
+// identifier or keyword, with no space after it, that is taken to be
+// partly typed and is completed, first to the tokens that most often
+// follow the tokens before it and then to the most frequent tokens it
+// begins.  Otherwise the tokens that most often follow its last one or two
+// are appended.  Reads only the token dictionary and next_tokens section.
+inline std::vector<std::string> complete_query(idx::IndexReader& index,
+                                               const std::string& query,
+                                               size_t max_results) {
+  auto tokenize = [](const std::string& text) {
+    VectorTokenStream output;
+    try {
+      Tokenize(text, output);
+    } catch (std::exception& e) {
+      return std::optional<std::vector<Token>>();
+    }
+    return std::optional(std::move(output.tokens));
+  };
+  std::optional<std::vector<Token>> tokens = tokenize(query);
+  if (!tokens) return {};
+
+  std::string base = query, partial;
+  if (!tokens->empty()) {
+    const std::string& last = tokens->back().spelling;
+    if (has_trigrams(last) && query.size() >= last.size() &&
+        query.compare(query.size() - last.size(), last.size(), last) == 0) {
+      partial = last;
+      base.resize(query.size() - last.size());
+      tokens->pop_back();
+    }
+  }
+
+  std::vector<uint32_t> token_ids;
+  size_t n = tokens->size();
+  uint32_t last = n >= 1 ? index.token_id((*tokens)[n - 1].spelling) : 0;
+  uint32_t before_last =
+      n >= 2 ? index.token_id((*tokens)[n - 2].spelling) : 0;
+  for (const idx::NextToken& next : index.next_tokens(before_last, last))
+    if (index.spelling(next.token_id).substr(0, partial.size()) == partial)
+      token_ids.push_back(next.token_id);
+  if (!partial.empty() || n == 0)
+    for (uint32_t token_id : index.tokens_with_prefix(partial, max_results))
+      if (std::find(token_ids.begin(), token_ids.end(), token_id) ==
+          token_ids.end())
+        token_ids.push_back(token_id);
+  if (token_ids.size() > max_results) token_ids.resize(max_results);
+
+  std::vector<std::string> completions;
+  for (uint32_t token_id : token_ids) {
+    std::string_view spelling = index.spelling(token_id);
+    std::string completion = dvc::concat(base, spelling);
+    // Separated by a space if it would otherwise join the token before.
+    std::optional<std::vector<Token>> completed = tokenize(completion);
+    if (!completed || completed->size() != n + 1 ||
+        completed->back().spelling != spelling)
+      completion = dvc::concat(base, " ", spelling);
+    completions.push_back(std::move(completion));
+  }
+  return completions;
+}
+
+struct Matches {
+  size_t num_matches;
+  std::vector<const std::byte*> samples;  // into the primary code section
+  // Of num_matches, those in near duplicates of other files, which are
+  // not sampled; see IndexReader::duplicate_ranges.
+  size_t num_duplicates = 0;
+};
+
+using MatchSampler = dvc::sampler<const std::byte*, num_samples>;
 
-  static const std::byte* query_begin = encoded.data();
-  static const std::byte* query_end = encoded.data() + encoded.size();
-  const std::byte* code_section_end = index.code + index.code_length;
+// Takes the matches that a scan of one block finds, in ascending order,
+// and samples them, except that those in near duplicates of other files
+// are only counted.  The duplicate range of the first is searched for,
+// and later ones step forward from there.  All are recorded in `recorded`
+// (if given) once the block is done.
+class BlockMatches {
+ public:
+  BlockMatches(idx::IndexReader& index, MatchSampler& sampler,
+               std::atomic_size_t& num_duplicates, MatchSetBuilder* recorded)
+      : code_(index.code),
+        ranges_(index.duplicate_ranges()),
+        sampler_(sampler),
+        num_duplicates_(num_duplicates),
+        recorded_(recorded),
+        record_offsets_(recorded && !recorded->overflowed()) {}
 
-  dvc::sampler<const std::byte*, num_samples> matches;
+  ~BlockMatches() {
+    num_duplicates_ += count_;
+    if (recorded_) recorded_->add(num_matches_, offsets_, match_ranges_);
+  }
+
+  void operator()(const std::byte* match) {
+    size_t offset = match - code_;
+    if (recorded_) record(offset);
+    if (ranges_.empty()) return sampler_(match);
+    const std::pair<size_t, size_t>* end = ranges_.data() + ranges_.size();
+    if (!range_)
+      range_ = std::partition_point(
+          ranges_.data(), end, [&](const std::pair<size_t, size_t>& range) {
+            return range.second <= offset;
+          });
+    while (range_ < end && range_->second <= offset) range_++;
+    if (range_ < end && range_->first <= offset)
+      count_++;
+    else
+      sampler_(match);
+  }
+
+ private:
+  void record(size_t offset) {
+    num_matches_++;
+    if (record_offsets_ && offsets_.size() < max_match_set_offsets)
+      offsets_.push_back(offset);
+    size_t range = offset / recorded_->range_size();
+    if (match_ranges_.empty() || match_ranges_.back() != range)
+      match_ranges_.push_back(range);
+  }
+
+  const std::byte* code_;
+  const std::vector<std::pair<size_t, size_t>>& ranges_;
+  MatchSampler& sampler_;
+  std::atomic_size_t& num_duplicates_;
+  const std::pair<size_t, size_t>* range_ = nullptr;
+  size_t count_ = 0;
+  MatchSetBuilder* recorded_;
+  bool record_offsets_;
+  size_t num_matches_ = 0;
+  std::vector<size_t> offsets_;
+  std::vector<size_t> match_ranges_;  // ascending, of MatchSet::range_size
+};
+
+// Counts the occurrences of `encoded` in the code section and samples up
+// to num_samples of them uniformly.  With super tokens, each occurrence is
+// found at the start of the code it starts in; see SuperTokenQuery.
+// Occurrences in near duplicates of other files are counted but not
+// sampled; see BlockMatches.
+//
+// Where the occurrences were found is stored in `recorded`, if given.  If
+// `previous`, the MatchSet of a query that `encoded` starts with, is
+// given, only where that query was found is searched: at each of its
+// offsets, or in each range of code it was found in.  These are read from
+// the primary mapping, or decompressed a code block at a time, whatever
+// the placement and residency.  Otherwise:
+//
+// With numa_placement::replicate, worker i is pinned to online node
+// i % num_nodes and scans the copy of the code section local to it.
+// Interleaved pages alternate nodes within every block, so workers are
+// not pinned.
+//
+// A compressed code section is scanned a code block at a time instead of
+// in block_size pieces.  Each worker decompresses the block into its own
+// buffer, which is small enough to stay in cache while it is scanned, and
+// then decompresses after it just the bytes that a match starting in the
+// block can extend into.
+inline Matches find_matches(Index& open_index,
+                            const std::vector<std::byte>& encoded,
+                            size_t nthreads, size_t block_size,
+                            const MatchSet* previous = nullptr,
+                            MatchSet* recorded = nullptr) {
+  const std::filesystem::path& index_file = open_index.path;
+  const mmap_options& mmap = open_index.options;
+  mmapfile& index_mmap = open_index.mmap;
+  idx::IndexReader& index = open_index.reader;
+
+  std::optional<SuperTokenQuery> super_query;
+  if (index.has_super_tokens()) super_query.emplace(index, encoded);
+  // The most bytes a match spans.
+  size_t max_length = super_query ? super_query->max_length() : encoded.size();
+
+  // Calls on_match(candidate) for each match at a candidate in [start,
+  // end), reading no bytes at or after `limit`.
+  auto scan = [&](const std::byte* start, const std::byte* end,
+                  const std::byte* limit, auto&& on_match) {
+    if (super_query) return super_query->scan(start, end, limit, on_match);
+    size_t verifiable = limit - start >= ptrdiff_t(encoded.size())
+                            ? limit - start - (encoded.size() - 1)
+                            : 0;
+    scan_block(start, std::min(end, start + verifiable), encoded.data(),
+               encoded.data() + encoded.size(), on_match);
+  };
+
+  MatchSampler matches;
+  std::atomic_size_t num_duplicates = 0;
+  std::optional<MatchSetBuilder> builder;
+  if (recorded)
+    builder.emplace(index.code_length, index.code_compressed()
+                                           ? index.code_block_size()
+                                           : match_set_range_size);
+  MatchSetBuilder* recording = builder ? &*builder : nullptr;
 
   std::vector<std::thread> threads;
   std::atomic_size_t next_block = 0;
   std::atomic_size_t bytes_searched = 0;
-  for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
-    threads.emplace_back([&, thread_index] {
-      while (true) {
-        size_t block = next_block++;
-        const std::byte* start = index.code + block * block_size;
-        if (start >= code_section_end) return;
-        const std::byte* end = start + block_size;
-        if (end > code_section_end) end = code_section_end;
-
-        for (const std::byte* candidate = start; candidate < end; candidate++) {
-          bool found = true;
-          const std::byte* p = candidate;
-          for (const std::byte* q = query_begin; q < query_end; q++) {
-            if (*p != *q) {
-              found = false;
-              break;
-            }
-            p++;
-          }
-          if (found) {
-            matches(candidate);
+  if (previous && previous->exact()) {
+    // Each worker verifies a slice of the offsets, each offset once.
+    const std::vector<size_t>& offsets = previous->offsets;
+    size_t group_size = index.code_compressed() ? index.code_block_size()
+                                                : index.code_length;
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back([&, thread_index] {
+        size_t i = offsets.size() * thread_index / nthreads;
+        size_t end = offsets.size() * (thread_index + 1) / nthreads;
+        while (i > 0 && i < end && offsets[i] == offsets[i - 1]) i++;
+        BlockMatches block_matches(index, matches, num_duplicates, recording);
+        std::vector<std::byte> buffer;
+        while (i < end) {
+          size_t first = offsets[i];
+          size_t length =
+              std::min(group_size + max_length - 1, index.code_length - first);
+          const std::byte* code = index.code_bytes(first, length, buffer);
+          for (; i < end && offsets[i] - first < group_size; i++) {
+            if (i > 0 && offsets[i] == offsets[i - 1]) continue;
+            const std::byte* p = code + (offsets[i] - first);
+            scan(p, p + 1, code + length, [&](const std::byte* candidate) {
+              block_matches(index.code + first + (candidate - code));
+            });
           }
         }
-      }
-    });
-  for (std::thread& t : threads) t.join();
-  threads.clear();
+      });
+    for (std::thread& t : threads) t.join();
+    threads.clear();
+  } else if (previous) {
+    size_t range_size = previous->range_size;
+    std::vector<size_t> ranges;
+    for (size_t range = 0; range * range_size < index.code_length; range++)
+      if (previous->in_range(range)) ranges.push_back(range);
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back([&] {
+        std::vector<std::byte> buffer;
+        while (true) {
+          size_t i = next_block++;
+          if (i >= ranges.size()) return;
+          size_t begin = ranges[i] * range_size;
+          size_t length = std::min(range_size, index.code_length - begin);
+          size_t overlap = std::min(max_length - 1,
+                                    index.code_length - (begin + length));
+          const std::byte* code =
+              index.code_bytes(begin, length + overlap, buffer);
+          BlockMatches block_matches(index, matches, num_duplicates,
+                                     recording);
+          scan(code, code + length, code + length + overlap,
+               [&](const std::byte* candidate) {
+                 block_matches(index.code + begin + (candidate - code));
+               });
+        }
+      });
+    for (std::thread& t : threads) t.join();
+    threads.clear();
+  } else if (index.code_compressed()) {
+    size_t code_block_size = index.code_block_size();
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back([&, thread_index] {
+        size_t node = thread_index % index_mmap.num_nodes();
+        if (index_mmap.num_nodes() > 1)
+          numa::pin_to_node(index_mmap.node_id(node));
+        const char* local_index = index_mmap.get(node).data();
+        std::vector<std::byte> buffer(code_block_size + max_length - 1);
+        while (true) {
+          size_t begin = next_block++ * code_block_size;
+          if (begin >= index.code_length) return;
+          size_t length = std::min(code_block_size, index.code_length - begin);
+          size_t overlap = std::min(max_length - 1,
+                                    index.code_length - (begin + length));
+          index.read_code(begin, length + overlap, buffer.data(),
+                          local_index);
+          BlockMatches block_matches(index, matches, num_duplicates,
+                                     recording);
+          scan(buffer.data(), buffer.data() + length,
+               buffer.data() + length + overlap,
+               [&](const std::byte* candidate) {
+                 block_matches(index.code + begin +
+                               (candidate - buffer.data()));
+               });
+        }
+      });
+    for (std::thread& t : threads) t.join();
+    threads.clear();
+  } else if (mmap.residency == residency_policy::stream) {
+    // Chunks overlap by the longest match - 1 so no match spans two chunks.
+    size_t code_section_offset =
+        index.code - (const std::byte*)index_mmap.get().data();
+    streamfile code_stream(index_file);
+    code_stream.scan(
+        code_section_offset, index.code_length, mmap.stream_chunk_size,
+        max_length - 1, nthreads,
+        [&](size_t chunk_begin, const std::byte* data, size_t chunk_length,
+            size_t readable) {
+          BlockMatches block_matches(index, matches, num_duplicates,
+                                     recording);
+          scan(data, data + chunk_length, data + readable,
+               [&](const std::byte* candidate) {
+                 block_matches(index.code + chunk_begin + (candidate - data));
+               });
+        });
+  } else {
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back([&, thread_index] {
+        size_t node = thread_index % index_mmap.num_nodes();
+        if (index_mmap.num_nodes() > 1)
+          numa::pin_to_node(index_mmap.node_id(node));
+        const std::byte* local_code =
+            index.code +
+            (index_mmap.get(node).data() - index_mmap.get().data());
+        const std::byte* local_code_end = local_code + index.code_length;
+        while (true) {
+          size_t block = next_block++;
+          const std::byte* start = local_code + block * block_size;
+          if (start >= local_code_end) return;
+          const std::byte* end = start + block_size;
+          if (end > local_code_end) end = local_code_end;
+
+          BlockMatches block_matches(index, matches, num_duplicates,
+                                     recording);
+          scan(start, end, local_code_end, [&](const std::byte* candidate) {
+            block_matches(index.code + (candidate - local_code));
+          });
+        }
+      });
+    for (std::thread& t : threads) t.join();
+    threads.clear();
+  }
+
+  if (recorded) *recorded = builder->build();
+  return {matches.size() + num_duplicates, matches.build_samples(),
+          num_duplicates};
+}
+
+// Key under which a QueryCache holds the MatchSet of `encoded`, beside its
+// results.  Codes never start with a zero byte, so results keys do not.
+inline std::string match_set_key(const std::byte* encoded, size_t length) {
+  std::string key(1, '\0');
+  key.append((const char*)encoded, length);
+  return key;
+}
+
+// find_matches, refined from the MatchSet of the longest query that
+// `encoded` starts with that the MatchSetCache of `open_index` (if it
+// keeps one) or `cache` (if given) holds, and recording its own there.
+// Without either, no MatchSet is recorded.
+inline Matches refine_matches(Index& open_index,
+                              const std::vector<std::byte>& encoded,
+                              size_t nthreads, size_t block_size,
+                              QueryCache* cache = nullptr) {
+  idx::IndexReader& index = open_index.reader;
+  if (!open_index.match_sets && !cache)
+    return find_matches(open_index, encoded, nthreads, block_size);
+
+  std::shared_ptr<const MatchSet> previous;
+  if (open_index.match_sets)
+    previous = open_index.match_sets->find_prefix(encoded);
+  if (!previous && cache) {
+    std::vector<size_t> lengths = query_prefix_lengths(encoded);
+    for (auto length = lengths.rbegin(); length != lengths.rend(); length++)
+      if (std::optional<std::string> cached = cache->lookup(
+              open_index.identity, match_set_key(encoded.data(), *length)))
+        if (std::optional<MatchSet> set =
+                deserialize_match_set(*cached, index.code_length)) {
+          previous = std::make_shared<const MatchSet>(std::move(*set));
+          break;
+        }
+  }
+
+  MatchSet recorded;
+  Matches matches = find_matches(open_index, encoded, nthreads, block_size,
+                                 previous.get(), &recorded);
+  if (cache)
+    cache->insert(open_index.identity,
+                  match_set_key(encoded.data(), encoded.size()),
+                  serialize_match_set(recorded, index.code_length,
+                                      index.code_compressed()
+                                          ? index.code_block_size()
+                                          : match_set_range_size));
+  if (open_index.match_sets)
+    open_index.match_sets->insert(encoded, std::move(recorded));
+  return matches;
+}
+
+// Results found in `cache` (if given) are returned without scanning, and
+// otherwise the matches are refined from those of earlier queries there;
+// see refine_matches.
+inline CodeSearchResults codesearch(Index& open_index, const std::string& query,
+                                    size_t nthreads, size_t block_size,
+                                    QueryCache* cache = nullptr) {
+  mmapfile& index_mmap = open_index.mmap;
+  idx::IndexReader& index = open_index.reader;
+
+  std::vector<std::byte> encoded;
+  std::string suggested_query;
+  std::string error = encode_query(index, query, encoded, &suggested_query);
+  if (!error.empty()) {
+    CodeSearchResults results = make_error(error);
+    results.suggested_query = std::move(suggested_query);
+    return results;
+  }
+
+  std::string cache_key((const char*)encoded.data(), encoded.size());
+  if (cache) {
+    if (std::optional<std::string> cached =
+            cache->lookup(open_index.identity, cache_key)) {
+      CodeSearchResults results = deserialize_results(*cached);
+      results.residency = index_mmap.stats();
+      return results;
+    }
+  }
+
+  Matches matches =
+      refine_matches(open_index, encoded, nthreads, block_size, cache);
 
   CodeSearchResults results;
   results.num_files = index.num_files;
-  results.num_matches = matches.size();
-  std::vector<const std::byte*> samples = matches.build_samples();
-  for (const std::byte* sample : samples) {
+  results.num_matches = matches.num_matches;
+  results.num_unique_matches = matches.num_matches - matches.num_duplicates;
+  results.residency = index_mmap.stats();
+  std::vector<MatchExtent> extents =
+      match_extents(index, matches.samples, encoded);
+  std::vector<uint32_t> lengths;
+  for (const MatchExtent& extent : extents) lengths.push_back(extent.length);
+  std::vector<idx::IndexReader::FileLines> symbolized =
+      index.symbolize(matches.samples, lengths, 2);
+  std::vector<SnippetReader::Request> requests;
+  for (const idx::IndexReader::FileLines& file_lines : symbolized)
+    requests.push_back({index.filename(file_lines.file_info), file_lines});
+  std::vector<std::vector<std::string>> snippets =
+      open_index.snippets.read(requests, nthreads);
+  for (size_t i = 0; i < matches.samples.size(); i++) {
     CodeSearchResults::Sample out_sample;
-    idx::IndexReader::FileLines file_lines =
-        index.symbolize(sample, encoded.size(), 2);
-    out_sample.file = index.filename(file_lines.file_info);
-    out_sample.first_line = file_lines.first_lineno;
-    out_sample.match_line = file_lines.match_lineno;
-    dvc::file_reader file(out_sample.file);
-    if (file_lines.num_lines > 0) file.seek(file_lines.lines[0].file_offset);
-    for (uint32_t i = 0; i < file_lines.num_lines; i++) {
-      out_sample.lines.push_back(
-          file.read_string(file_lines.lines[i + 1].file_offset -
-                           file_lines.lines[i].file_offset));
-      std::string& s = out_sample.lines.back();
-      if (!s.empty() && s.back() == '\n') s = s.substr(0, s.size() - 1);
-    }
+    out_sample.offset = matches.samples[i] - index.code;
+    out_sample.file = std::move(requests[i].file);
+    out_sample.first_line = symbolized[i].first_lineno;
+    out_sample.match_line = symbolized[i].match_lineno;
+    out_sample.lines = std::move(snippets[i]);
+    out_sample.highlights =
+        highlight(index, matches.samples[i], extents[i], symbolized[i],
+                  out_sample.lines);
     results.samples.push_back(std::move(out_sample));
   }
+  if (cache) cache->insert(open_index.identity, cache_key, serialize(results));
   return results;
 }
 
+inline CodeSearchResults codesearch(const std::filesystem::path& index_file,
+                                    const std::string& query, size_t nthreads,
+                                    size_t block_size,
+                                    const mmap_options& mmap = {},
+                                    QueryCache* cache = nullptr) {
+  DVC_ASSERT(exists(index_file), "No such file: ", index_file);
+  Index index(index_file, mmap);
+  return codesearch(index, query, nthreads, block_size, cache);
+}
+
 }  // namespace ppt
@@ -0,0 +1,121 @@
+#include "ppsearch_c.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "libppsearch.h"
+
+struct ppt_searcher {
+  ppt::Searcher searcher;
+};
+
+struct ppt_results {
+  ppt::SearchResults results;
+  std::vector<ppt::SearchMatch> samples;
+  std::vector<std::string> files;
+};
+
+namespace {
+
+// A malloc'd copy of `s`, or NULL if out of memory.
+char* copy_string(const std::string& s) {
+  char* copy = (char*)std::malloc(s.size() + 1);
+  if (copy) std::memcpy(copy, s.c_str(), s.size() + 1);
+  return copy;
+}
+
+ppt_searcher* open_failed(char** error, const std::string& why) {
+  if (error) *error = copy_string(why);
+  return nullptr;
+}
+
+}  // namespace
+
+ppt_searcher* ppt_open(const char* index_file, const char* residency,
+                       size_t nthreads, size_t block_size, char** error) {
+  if (error) *error = nullptr;
+  ppt::mmap_options options;
+  if (residency) {
+    auto policy = ppt::find_residency_policy(residency);
+    if (!policy)
+      return open_failed(error,
+                         dvc::concat("Unknown residency `", residency, "`"));
+    options.residency = *policy;
+  }
+  // Checked up front because opening a corrupt index would abort the host.
+  std::string why = ppt::check_index_file(index_file, nthreads);
+  if (!why.empty())
+    return open_failed(error, dvc::concat(index_file, ": ", why));
+  try {
+    return new ppt_searcher{
+        ppt::Searcher(index_file, options, nthreads, block_size)};
+  } catch (std::exception& e) {
+    return open_failed(error, dvc::concat(index_file, ": ", e.what()));
+  }
+}
+
+void ppt_close(ppt_searcher* searcher) { delete searcher; }
+
+ppt_results* ppt_search(ppt_searcher* searcher, const char* query) {
+  auto results = new ppt_results{searcher->searcher.search(query), {}, {}};
+  for (size_t i = 0; i < results->results.size(); i++) {
+    results->samples.push_back(results->results[i]);
+    results->files.push_back(results->samples.back().file());
+  }
+  return results;
+}
+
+void ppt_results_free(ppt_results* results) { delete results; }
+
+const char* ppt_results_error(const ppt_results* results) {
+  const std::string& error = results->results.error();
+  return error.empty() ? nullptr : error.c_str();
+}
+
+size_t ppt_results_num_files(const ppt_results* results) {
+  return results->results.error().empty() ? results->results.num_files() : 0;
+}
+
+size_t ppt_results_num_matches(const ppt_results* results) {
+  return results->results.num_matches();
+}
+
+size_t ppt_results_num_unique_matches(const ppt_results* results) {
+  return results->results.num_unique_matches();
+}
+
+size_t ppt_results_num_samples(const ppt_results* results) {
+  return results->samples.size();
+}
+
+const char* ppt_sample_file(const ppt_results* results, size_t i,
+                            size_t* length) {
+  const std::string& file = results->files.at(i);
+  *length = file.size();
+  return file.data();
+}
+
+uint64_t ppt_sample_offset(const ppt_results* results, size_t i) {
+  return results->samples.at(i).offset();
+}
+
+uint32_t ppt_sample_first_line(const ppt_results* results, size_t i) {
+  return results->samples.at(i).first_line();
+}
+
+uint32_t ppt_sample_match_line(const ppt_results* results, size_t i) {
+  return results->samples.at(i).match_line();
+}
+
+char* ppt_sample_lines(const ppt_results* results, size_t i, size_t* length) {
+  std::string joined;
+  for (const std::string& line : results->samples.at(i).lines()) {
+    if (!joined.empty()) joined += '\n';
+    joined += line;
+  }
+  char* s = copy_string(joined);
+  *length = s ? joined.size() : 0;
+  return s;
+}
+
+void ppt_free_string(char* s) { std::free(s); }
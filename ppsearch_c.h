@@ -0,0 +1,50 @@
+/* C ABI over libppsearch.h, for FFI from other languages. */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ppt_searcher ppt_searcher;
+typedef struct ppt_results ppt_results;
+
+/* Opens an index.  residency is a residency_policy name such as "mlock"
+ * or "lazy", or NULL for the default.  Returns NULL if index_file cannot
+ * be opened or is corrupt, or residency is unknown, and then sets *error
+ * (unless error is NULL) to why, to be freed with ppt_free_string. */
+ppt_searcher* ppt_open(const char* index_file, const char* residency,
+                       size_t nthreads, size_t block_size, char** error);
+void ppt_close(ppt_searcher* searcher);
+
+/* Never NULL; check ppt_results_error.  Must be freed with
+ * ppt_results_free, and may outlive the searcher. */
+ppt_results* ppt_search(ppt_searcher* searcher, const char* query);
+void ppt_results_free(ppt_results* results);
+
+/* NULL on success. */
+const char* ppt_results_error(const ppt_results* results);
+size_t ppt_results_num_files(const ppt_results* results);
+size_t ppt_results_num_matches(const ppt_results* results);
+/* Matches not in near duplicates of other files; these are sampled. */
+size_t ppt_results_num_unique_matches(const ppt_results* results);
+size_t ppt_results_num_samples(const ppt_results* results);
+
+/* Not NUL-terminated, valid until the results are freed. */
+const char* ppt_sample_file(const ppt_results* results, size_t i,
+                            size_t* length);
+uint64_t ppt_sample_offset(const ppt_results* results, size_t i);
+uint32_t ppt_sample_first_line(const ppt_results* results, size_t i);
+uint32_t ppt_sample_match_line(const ppt_results* results, size_t i);
+
+/* Reads the snippet of sample i, from the index's stored source if it
+ * has one and otherwise from the source tree: its lines joined with
+ * '\n'.  Free with ppt_free_string.  NULL if out of memory. */
+char* ppt_sample_lines(const ppt_results* results, size_t i, size_t* length);
+void ppt_free_string(char* s);
+
+#ifdef __cplusplus
+}
+#endif
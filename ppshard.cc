@@ -0,0 +1,30 @@
+#include "shard.h"
+
+#include "dvc/opts.h"
+#include "dvc/program.h"
+
+namespace ppt {
+
+std::filesystem::path DVC_OPTION(index_file, -, dvc::required,
+                                 "input index shard file");
+
+std::string DVC_OPTION(port, p, dvc::required, "port to listen on");
+
+size_t DVC_OPTION(connections, -, 4, "number of queries answered at once");
+
+size_t DVC_OPTION(nthreads, n, dvc::required,
+                  "number of threads per query");
+
+size_t DVC_OPTION(block_size, b, dvc::required, "number of blocks");
+
+void ppshard(int argc, char** argv) {
+  dvc::program program(argc, argv);
+
+  IndexHandle handle(index_file);
+  handle.watch();
+  serve_shard(port, handle, connections, nthreads, block_size);
+}
+
+}  // namespace ppt
+
+int main(int argc, char** argv) { ppt::ppshard(argc, argv); }
@@ -11,6 +11,8 @@ std::filesystem::path DVC_OPTION(index_file, -, dvc::required,
 
 bool DVC_OPTION(verbose, v, false, "verbose");
 
+size_t DVC_OPTION(nthreads, -, 8, "number of threads to checksum with");
+
 void ppverify(int argc, char** argv) {
   dvc::program program(argc, argv);
 
@@ -27,12 +29,21 @@ void ppverify(int argc, char** argv) {
   DVC_DUMP(index.total_lines);
   DVC_DUMP(index.total_tokens);
 
-  const std::byte* code = index.code;
+  DVC_DUMP(index.version);
+  DVC_DUMP(index.num_sections);
+  std::vector<std::string> checksum_errors = index.verify(nthreads);
+  for (const std::string& error : checksum_errors) DVC_ERROR(error);
+  DVC_ASSERT(checksum_errors.empty(), "Index checksums do not match");
+
+  size_t code_offset = 0;
+  std::vector<std::byte> code_buffer;
 
   for (size_t i = 0; i < index.num_files; i++) {
     const idx::FileInfo& file_info = index.file_infos[i];
     std::filesystem::path path = index.filename(file_info);
     DVC_ASSERT(exists(path));
+    size_t rank = index.prefix_range(path.string()).first;
+    DVC_ASSERT_EQ(&index.file_by_rank(rank), &file_info);
     size_t file_length = file_size(path);
     if (verbose) {
       DVC_LOG("FILE #", i, ": ", path);
@@ -45,11 +56,14 @@ void ppverify(int argc, char** argv) {
 
     DVC_ASSERT_EQ(file_length, file_info.file_length);
 
-    DVC_ASSERT_EQ(code, index.filecode(file_info));
-    code += file_info.code_length;
+    DVC_ASSERT_EQ(code_offset, file_info.code_offset);
+    code_offset += file_info.code_length;
+    const std::byte* code = index.code_bytes(
+        file_info.code_offset, file_info.code_length, code_buffer);
+    DVC_ASSERT_EQ(uint8_t(code[file_info.code_length - 1]), 0);
 
     DVC_ASSERT_LE(2, file_info.num_lines);
-    const idx::LineInfo* line_infos = index.line_infos(file_info);
+    std::vector<idx::LineInfo> line_infos = index.line_infos(file_info);
     for (size_t j = 0; j < file_info.num_lines; j++) {
       const idx::LineInfo& line_info = line_infos[j];
 
@@ -72,7 +86,7 @@ void ppverify(int argc, char** argv) {
                   file_info.code_length - 1);
   }
 
-  DVC_ASSERT_EQ(code, index.code + index.code_length);
+  DVC_ASSERT_EQ(code_offset, index.code_length);
 
   DVC_DUMP(index.num_tokens);
   for (size_t i = 0; i <= index.num_tokens; i++) {
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "dvc/log.h"
+#include "hash.h"
+
+namespace ppt {
+
+// Size-bounded map from query key to serialized results, in a
+// memory-mapped file so it survives restarts and is shared by concurrent
+// processes (e.g. CGI requests).  All entries belong to one index
+// identity; inserting with a different identity empties it.
+//
+// The file is a Header, a hash table of num_slots Slots, and then an
+// area of data_capacity bytes that entries are appended to.  Lookups
+// probe the table in the mapping under a shared flock on <path>.lock,
+// and copy out only the value found.  Inserts take the flock exclusively,
+// append the entry and point its slot at it, so their work is bounded by
+// the entry.  Only when the area or table fills up is the file compacted,
+// in place, down to the most recently used entries that fill half of it.
+// Opening the cache maps nothing until it is first used.
+class QueryCache {
+ public:
+  // `capacity` bytes of entries, if the cache file is created.  An
+  // existing file keeps its own.
+  QueryCache(const std::filesystem::path& path, size_t capacity)
+      : path(path), capacity(capacity) {
+    lock_fd = ::open((path.string() + ".lock").c_str(),
+                     O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    DVC_ASSERT_NE(lock_fd, -1, "Unable to open lock for ", path, ": ",
+                  strerror(errno));
+  }
+
+  std::optional<std::string> lookup(uint64_t index_id, std::string_view key) {
+    std::lock_guard lock(mu);
+    FileLock file_lock(lock_fd, LOCK_SH, path);
+    if (!map() || header()->compacting || header()->index_id != index_id)
+      return std::nullopt;
+    Slot* slot = find_slot(key, hash64(key));
+    if (!slot || slot->offset == 0) return std::nullopt;
+    EntryHeader* entry = entry_at(slot->offset);
+    if (!entry) return std::nullopt;
+    // Racing hits all store a recent time, so any one of them will do.
+    __atomic_store_n(&entry->last_used, now(), __ATOMIC_RELAXED);
+    return std::string(value_of(entry));
+  }
+
+  void insert(uint64_t index_id, std::string_view key, std::string value) {
+    std::lock_guard lock(mu);
+    FileLock file_lock(lock_fd, LOCK_EX, path);
+    if (!map()) create();
+    Header* h = header();
+    // Left compacting by a process that died doing so.
+    if (h->compacting || h->index_id != index_id) clear(index_id);
+    size_t length = entry_length(key.size(), value.size());
+    // Larger entries would crowd out all the others.
+    if (length > h->data_capacity / 4) return;
+    if (h->data_end + length > mapped_length ||
+        2 * (h->num_entries + 1) > h->num_slots)
+      compact();
+    uint64_t hash = hash64(key);
+    Slot* slot = find_slot(key, hash);
+    if (!slot) {
+      clear(index_id);
+      slot = find_slot(key, hash);
+    }
+    EntryHeader entry_header;
+    entry_header.last_used = now();
+    entry_header.key_length = key.size();
+    entry_header.value_length = value.size();
+    char* p = (char*)mapped + h->data_end;
+    ::memcpy(p, &entry_header, sizeof entry_header);
+    ::memcpy(p + sizeof entry_header, key.data(), key.size());
+    ::memcpy(p + sizeof entry_header + key.size(), value.data(),
+             value.size());
+    // The slot is used once its offset is set, after the entry is there.
+    if (slot->offset == 0) {
+      h->num_entries++;
+      slot->hash = hash;
+    }
+    slot->offset = h->data_end;
+    h->data_end += length;
+  }
+
+  ~QueryCache() {
+    unmap();
+    ::close(lock_fd);
+  }
+
+ private:
+  struct Header {
+    std::array<char, 4> magic = {'p', 'p', 't', 'C'};
+    uint32_t version = 4;  // 4: hash table of appended entries
+    uint64_t index_id = 0;
+    uint64_t num_slots = 0;      // a power of two
+    uint64_t data_capacity = 0;  // bytes after the slots
+    uint64_t data_end = 0;       // start-of-file offset of the next entry
+    uint64_t num_entries = 0;    // slots used
+    uint32_t compacting = 0;     // set while the slots are rewritten
+    uint32_t reserved = 0;
+  };
+
+  // An empty slot has offset 0.  Slots are only emptied by clear() and
+  // compact(), so a probe for a key stops at the first empty one.
+  struct Slot {
+    uint64_t hash;    // of the key
+    uint64_t offset;  // start-of-file offset of its EntryHeader
+  };
+
+  // Followed by key then value bytes, padded to 8.
+  struct EntryHeader {
+    uint64_t last_used;
+    uint32_t key_length;
+    uint32_t value_length;
+  };
+
+  // Holds a flock on the lock file.
+  struct FileLock {
+    FileLock(int fd, int operation, const std::filesystem::path& path)
+        : fd(fd) {
+      DVC_ASSERT_EQ(0, ::flock(fd, operation), "Unable to lock ", path, ": ",
+                    strerror(errno));
+    }
+    ~FileLock() { ::flock(fd, LOCK_UN); }
+    int fd;
+  };
+
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static size_t entry_length(size_t key_length, size_t value_length) {
+    return (sizeof(EntryHeader) + key_length + value_length + 7) & ~size_t(7);
+  }
+
+  Header* header() { return (Header*)mapped; }
+  Slot* slots() { return (Slot*)(header() + 1); }
+  uint64_t data_begin() {
+    return sizeof(Header) + header()->num_slots * sizeof(Slot);
+  }
+
+  // The entry at `offset`, or null if it does not lie within the entries.
+  EntryHeader* entry_at(uint64_t offset) {
+    uint64_t end = header()->data_end;
+    if (offset < data_begin() || offset % 8 != 0 ||
+        end - offset < sizeof(EntryHeader))
+      return nullptr;
+    EntryHeader* entry = (EntryHeader*)((char*)mapped + offset);
+    if (end - offset - sizeof(EntryHeader) <
+        uint64_t(entry->key_length) + entry->value_length)
+      return nullptr;
+    return entry;
+  }
+
+  static std::string_view key_of(const EntryHeader* entry) {
+    return {(const char*)(entry + 1), entry->key_length};
+  }
+
+  static std::string_view value_of(const EntryHeader* entry) {
+    return {(const char*)(entry + 1) + entry->key_length,
+            entry->value_length};
+  }
+
+  // The slot of `key`, or else the empty slot it would go in, or null if
+  // the table is full, which only a corrupt file can be.
+  Slot* find_slot(std::string_view key, uint64_t hash) {
+    size_t mask = header()->num_slots - 1;
+    for (size_t n = 0, i = hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+      Slot* slot = slots() + i;
+      if (slot->offset == 0) return slot;
+      if (slot->hash != hash) continue;
+      EntryHeader* entry = entry_at(slot->offset);
+      if (entry && key_of(entry) == key) return slot;
+    }
+    return nullptr;
+  }
+
+  void unmap() {
+    if (!mapped) return;
+    DVC_ASSERT_EQ(::munmap(mapped, mapped_length), 0, "munmap ", path,
+                  " failed: ", strerror(errno));
+    mapped = nullptr;
+  }
+
+  // Maps the file at `path` unless it is already mapped (it is replaced
+  // only by create(), and never resized).  Returns whether there is one
+  // of this version that is consistent.
+  bool map() {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+      unmap();
+      return false;
+    }
+    if (!mapped || st.st_dev != mapped_dev || st.st_ino != mapped_ino) {
+      unmap();
+      int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+      if (fd == -1) return false;
+      if (::fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+        mapped = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) mapped = nullptr;
+      }
+      ::close(fd);
+      if (!mapped) return false;
+      mapped_length = st.st_size;
+      mapped_dev = st.st_dev;
+      mapped_ino = st.st_ino;
+    }
+    const Header* h = header();
+    return h->magic == Header{}.magic && h->version == Header{}.version &&
+           h->num_slots > 0 && (h->num_slots & (h->num_slots - 1)) == 0 &&
+           h->num_slots <= mapped_length / sizeof(Slot) &&
+           data_begin() + h->data_capacity == mapped_length &&
+           h->data_end >= data_begin() && h->data_end <= mapped_length &&
+           h->num_entries < h->num_slots;
+  }
+
+  // Replaces the file at `path` with an empty one of `capacity` and maps
+  // it.  It is sparse until entries are written.
+  void create() {
+    unmap();
+    Header h;
+    h.num_slots = 1024;
+    while (h.num_slots < capacity / 4096) h.num_slots *= 2;
+    h.data_capacity = capacity;
+    h.data_end = sizeof(Header) + h.num_slots * sizeof(Slot);
+    std::filesystem::path partial = path.string() + ".partial";
+    int fd = ::open(partial.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+    DVC_ASSERT_NE(fd, -1, "Unable to create ", partial, ": ",
+                  strerror(errno));
+    DVC_ASSERT_EQ(0, ::ftruncate(fd, h.data_end + h.data_capacity),
+                  "Unable to size ", partial, ": ", strerror(errno));
+    DVC_ASSERT_EQ(ssize_t(sizeof h), ::pwrite(fd, &h, sizeof h, 0),
+                  "Unable to write ", partial, ": ", strerror(errno));
+    ::close(fd);
+    std::filesystem::rename(partial, path);
+    DVC_ASSERT(map(), "Unable to map new query cache ", path);
+  }
+
+  // Empties the cache for `index_id`.
+  void clear(uint64_t index_id) {
+    Header* h = header();
+    h->compacting = 1;
+    ::memset(slots(), 0, h->num_slots * sizeof(Slot));
+    h->data_end = data_begin();
+    h->num_entries = 0;
+    h->index_id = index_id;
+    h->compacting = 0;
+  }
+
+  // Rewrites the cache with only the most recently used entries that fill
+  // up to half of the data area and a quarter of the slots.
+  void compact() {
+    Header* h = header();
+    struct Live {
+      uint64_t last_used, hash, offset;
+    };
+    std::vector<Live> live;
+    for (size_t i = 0; i < h->num_slots; i++)
+      if (slots()[i].offset != 0)
+        if (EntryHeader* entry = entry_at(slots()[i].offset))
+          live.push_back({entry->last_used, slots()[i].hash,
+                          slots()[i].offset});
+    std::sort(live.begin(), live.end(), [](const Live& a, const Live& b) {
+      return a.last_used > b.last_used;
+    });
+    std::string kept;
+    std::vector<std::pair<uint64_t, uint64_t>> kept_slots;  // hash, offset
+    for (const Live& entry : live) {
+      const EntryHeader* e = entry_at(entry.offset);
+      size_t length = entry_length(e->key_length, e->value_length);
+      if (kept.size() + length > h->data_capacity / 2 ||
+          kept_slots.size() >= h->num_slots / 4)
+        break;
+      kept_slots.emplace_back(entry.hash, data_begin() + kept.size());
+      kept.append((const char*)e, length);
+    }
+    h->compacting = 1;
+    ::memset(slots(), 0, h->num_slots * sizeof(Slot));
+    ::memcpy((char*)mapped + data_begin(), kept.data(), kept.size());
+    size_t mask = h->num_slots - 1;
+    for (const auto& [hash, offset] : kept_slots) {
+      size_t i = hash & mask;
+      while (slots()[i].offset != 0) i = (i + 1) & mask;
+      slots()[i] = {hash, offset};
+    }
+    h->data_end = data_begin() + kept.size();
+    h->num_entries = kept_slots.size();
+    h->compacting = 0;
+  }
+
+  const std::filesystem::path path;
+  const size_t capacity;
+
+  std::mutex mu;
+  int lock_fd = -1;
+  void* mapped = nullptr;
+  size_t mapped_length = 0;
+  dev_t mapped_dev = 0;
+  ino_t mapped_ino = 0;
+
+  QueryCache(QueryCache&&) = delete;
+  QueryCache(const QueryCache&) = delete;
+};
+
+}  // namespace ppt
@@ -0,0 +1,184 @@
+#include "query_cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+#include <string>
+
+#include "dvc/log.h"
+#include "dvc/program.h"
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// Offsets of QueryCache::Header fields in the file.
+constexpr off_t index_id_offset = 8;
+constexpr off_t num_slots_offset = 16;
+constexpr off_t data_end_offset = 32;
+constexpr off_t num_entries_offset = 40;
+constexpr off_t compacting_offset = 48;
+
+template <typename T>
+T read_field(const fs::path& path, off_t offset) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  DVC_ASSERT_NE(fd, -1, path);
+  T x;
+  DVC_ASSERT_EQ(::pread(fd, &x, sizeof x, offset), ssize_t(sizeof x));
+  ::close(fd);
+  return x;
+}
+
+template <typename T>
+void write_field(const fs::path& path, off_t offset, T x) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  DVC_ASSERT_NE(fd, -1, path);
+  DVC_ASSERT_EQ(::pwrite(fd, &x, sizeof x, offset), ssize_t(sizeof x));
+  ::close(fd);
+}
+
+std::string key(size_t i) { return "key" + std::to_string(i); }
+
+// A fresh cache file of 1MB, which has 1024 slots.
+struct TestCache {
+  explicit TestCache(const fs::path& dir, const std::string& name)
+      : path(dir / name), cache(path, 1 << 20) {}
+  fs::path path;
+  ppt::QueryCache cache;
+};
+
+void test_insert_and_lookup(const fs::path& dir) {
+  TestCache t(dir, "basic");
+  DVC_ASSERT(!t.cache.lookup(1, "a"));
+  t.cache.insert(1, "a", "apple");
+  t.cache.insert(1, "b", "banana");
+  t.cache.insert(1, "", "empty key");
+  t.cache.insert(1, "e", "");
+  DVC_ASSERT_EQ(t.cache.lookup(1, "a").value(), "apple");
+  DVC_ASSERT_EQ(t.cache.lookup(1, "b").value(), "banana");
+  DVC_ASSERT_EQ(t.cache.lookup(1, "").value(), "empty key");
+  DVC_ASSERT_EQ(t.cache.lookup(1, "e").value(), "");
+  DVC_ASSERT(!t.cache.lookup(1, "c"));
+  DVC_ASSERT(!t.cache.lookup(2, "a"));
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_slots_offset), 1024);
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 4);
+
+  // Another cache on the same file, as another process would have.
+  ppt::QueryCache other(t.path, 1 << 20);
+  DVC_ASSERT_EQ(other.lookup(1, "b").value(), "banana");
+  other.insert(1, "c", "cherry");
+  DVC_ASSERT_EQ(t.cache.lookup(1, "c").value(), "cherry");
+
+  // Entries over a quarter of the capacity are not kept.
+  t.cache.insert(1, "big", std::string((1 << 18) + 1, 'x'));
+  DVC_ASSERT(!t.cache.lookup(1, "big"));
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 5);
+}
+
+void test_overwrite(const fs::path& dir) {
+  TestCache t(dir, "overwrite");
+  t.cache.insert(1, "a", "first");
+  t.cache.insert(1, "b", "other");
+  uint64_t data_end = read_field<uint64_t>(t.path, data_end_offset);
+  t.cache.insert(1, "a", "second, and longer");
+  DVC_ASSERT_EQ(t.cache.lookup(1, "a").value(), "second, and longer");
+  DVC_ASSERT_EQ(t.cache.lookup(1, "b").value(), "other");
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 2);
+  DVC_ASSERT_GT(read_field<uint64_t>(t.path, data_end_offset), data_end);
+}
+
+// Filling half of the 1024 slots compacts to the 256 most recently used
+// entries, then adds the new one.
+void test_compact_at_slot_limit(const fs::path& dir) {
+  TestCache t(dir, "slots");
+  for (size_t i = 0; i < 512; i++) t.cache.insert(1, key(i), "v" + key(i));
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 512);
+  DVC_ASSERT(t.cache.lookup(1, key(0)));  // now the most recently used
+  t.cache.insert(1, key(512), "v" + key(512));
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 257);
+  for (size_t i = 0; i <= 512; i++) {
+    std::optional<std::string> value = t.cache.lookup(1, key(i));
+    if (i == 0 || i > 256)
+      DVC_ASSERT_EQ(value.value(), "v" + key(i), i);
+    else
+      DVC_ASSERT(!value, i);
+  }
+}
+
+// Entries of 100000 bytes fill the 1MB data area at the eleventh, which
+// compacts to the five most recent that fit in half of it.
+void test_compact_at_data_limit(const fs::path& dir) {
+  TestCache t(dir, "data");
+  auto value = [](size_t i) { return std::string(100000, 'a' + i); };
+  for (size_t i = 0; i < 10; i++) t.cache.insert(1, key(i), value(i));
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 10);
+  t.cache.insert(1, key(10), value(10));
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 6);
+  DVC_ASSERT_LE(read_field<uint64_t>(t.path, data_end_offset),
+                fs::file_size(t.path));
+  for (size_t i = 0; i <= 10; i++) {
+    std::optional<std::string> found = t.cache.lookup(1, key(i));
+    if (i >= 5)
+      DVC_ASSERT(found == value(i), i);
+    else
+      DVC_ASSERT(!found, i);
+  }
+}
+
+// A process that died compacting leaves the flag set: lookups miss, and
+// the next insert starts over.
+void test_compacting_left_set(const fs::path& dir) {
+  TestCache t(dir, "compacting");
+  t.cache.insert(1, "a", "apple");
+  t.cache.insert(1, "b", "banana");
+  write_field<uint32_t>(t.path, compacting_offset, 1);
+  DVC_ASSERT(!t.cache.lookup(1, "a"));
+  t.cache.insert(1, "c", "cherry");
+  DVC_ASSERT_EQ(read_field<uint32_t>(t.path, compacting_offset), 0);
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 1);
+  DVC_ASSERT(!t.cache.lookup(1, "a"));
+  DVC_ASSERT(!t.cache.lookup(1, "b"));
+  DVC_ASSERT_EQ(t.cache.lookup(1, "c").value(), "cherry");
+}
+
+// Inserting for another index empties the cache.
+void test_identity_change(const fs::path& dir) {
+  TestCache t(dir, "identity");
+  t.cache.insert(1, "a", "apple");
+  t.cache.insert(1, "b", "banana");
+  t.cache.insert(2, "a", "avocado");
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, index_id_offset), 2);
+  DVC_ASSERT_EQ(read_field<uint64_t>(t.path, num_entries_offset), 1);
+  DVC_ASSERT(!t.cache.lookup(1, "a"));
+  DVC_ASSERT(!t.cache.lookup(2, "b"));
+  DVC_ASSERT_EQ(t.cache.lookup(2, "a").value(), "avocado");
+}
+
+// A file that is not a cache is replaced on insert.
+void test_corrupt_file(const fs::path& dir) {
+  TestCache t(dir, "corrupt");
+  t.cache.insert(1, "a", "apple");
+  write_field<uint32_t>(t.path, 0, 0);
+  DVC_ASSERT(!t.cache.lookup(1, "a"));
+  t.cache.insert(1, "b", "banana");
+  DVC_ASSERT_EQ(t.cache.lookup(1, "b").value(), "banana");
+  DVC_ASSERT(!t.cache.lookup(1, "a"));
+}
+
+}  // namespace
+
+int main() {
+  dvc::program program;
+
+  fs::path dir = fs::temp_directory_path() /
+                 ("query_cache_test." + std::to_string(::getpid()));
+  fs::create_directories(dir);
+  test_insert_and_lookup(dir);
+  test_overwrite(dir);
+  test_compact_at_slot_limit(dir);
+  test_compact_at_data_limit(dir);
+  test_compacting_left_set(dir);
+  test_identity_change(dir);
+  test_corrupt_file(dir);
+  fs::remove_all(dir);
+}
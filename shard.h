@@ -0,0 +1,273 @@
+#pragma once
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "dvc/log.h"
+#include "index_handle.h"
+#include "ppsearch.h"
+
+namespace ppt {
+
+// Scatter-gather search over index shards written by ppindex --num_shards.
+// Each shard is served by a ppshard worker, local or remote, and the
+// coordinator (shardsearch) fans a query out to all of them over TCP.
+//
+// Wire protocol, one query per connection:
+//   request:  u32 length, query bytes
+//   response: u8 ok, u32 length, serialize(results) if ok else error text
+
+// Longest query a worker reads.
+constexpr size_t max_query_frame = 1 << 20;
+
+// Longest response the coordinator reads.
+constexpr size_t max_response_frame = 256 << 20;
+
+// How long either side waits to connect, or for the other to send or
+// receive, before giving up on the connection.
+constexpr std::chrono::milliseconds shard_timeout = std::chrono::seconds(60);
+
+// Sends all of `data` on socket `fd`.  Returns false if the peer has gone
+// (EPIPE, which does not raise SIGPIPE and kill the process) or timed out.
+inline bool write_full(int fd, const void* data, size_t length) {
+  const char* p = (const char*)data;
+  while (length > 0) {
+    ssize_t n = ::send(fd, p, length, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+inline bool read_full(int fd, void* data, size_t length) {
+  char* p = (char*)data;
+  while (length > 0) {
+    ssize_t n = ::read(fd, p, length);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+inline bool write_frame(int fd, std::string_view data) {
+  uint32_t length = data.size();
+  return write_full(fd, &length, sizeof length) &&
+         write_full(fd, data.data(), data.size());
+}
+
+// Fails on frames longer than `max_length`, so a peer cannot make us
+// allocate up to 4GB.
+inline bool read_frame(int fd, std::string& data, size_t max_length) {
+  uint32_t length;
+  if (!read_full(fd, &length, sizeof length) || length > max_length)
+    return false;
+  data.resize(length);
+  return read_full(fd, data.data(), length);
+}
+
+// Splits "host:port", or returns nullopt if there is no port.
+inline std::optional<std::pair<std::string, std::string>> split_endpoint(
+    const std::string& endpoint) {
+  size_t colon = endpoint.rfind(':');
+  if (colon == std::string::npos) return std::nullopt;
+  return std::pair(endpoint.substr(0, colon), endpoint.substr(colon + 1));
+}
+
+// Makes reads and writes of `fd` fail after `timeout` without progress.
+inline void set_socket_timeout(int fd, std::chrono::milliseconds timeout) {
+  timeval tv;
+  tv.tv_sec = timeout.count() / 1000;
+  tv.tv_usec = timeout.count() % 1000 * 1000;
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+// Connects `fd` to `addr`, giving up after `timeout`.  Returns 0 or the
+// errno of the failure.
+inline int connect_with_timeout(int fd, const addrinfo* addr,
+                                std::chrono::milliseconds timeout) {
+  int flags = ::fcntl(fd, F_GETFL);
+  if (flags == -1 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return errno;
+  int err = 0;
+  if (::connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+    err = errno;
+    if (err == EINPROGRESS) {
+      pollfd p = {fd, POLLOUT, 0};
+      int n;
+      while ((n = ::poll(&p, 1, timeout.count())) == -1 && errno == EINTR) {
+      }
+      socklen_t length = sizeof err;
+      if (n == 0)
+        err = ETIMEDOUT;
+      else if (n == -1)
+        err = errno;
+      else if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &length) != 0)
+        err = errno;
+    }
+  }
+  if (err == 0 && ::fcntl(fd, F_SETFL, flags) == -1) err = errno;
+  return err;
+}
+
+// Combines per-shard results as if they came from one index: counts are
+// summed exactly, and samples are drawn without replacement from the
+// union of all matches.  Shard i holds a uniform sample of its
+// num_unique_matches_i matches, so each draw picks shard i with probability
+// proportional to its matches not yet drawn, then takes that shard's
+// next sample (in random order).
+inline CodeSearchResults merge_results(
+    std::vector<CodeSearchResults> shard_results) {
+  CodeSearchResults results;
+  results.num_files = 0;
+  results.num_matches = 0;
+  results.num_unique_matches = 0;
+  std::mt19937_64 rand_engine(std::random_device{}());
+  std::vector<size_t> remaining;
+  for (CodeSearchResults& shard : shard_results) {
+    results.num_files += shard.num_files;
+    results.num_matches += shard.num_matches;
+    results.num_unique_matches += shard.num_unique_matches;
+    remaining.push_back(shard.num_unique_matches);
+    std::shuffle(shard.samples.begin(), shard.samples.end(), rand_engine);
+  }
+  std::vector<size_t> taken(shard_results.size());
+  size_t total_remaining = results.num_unique_matches;
+  while (results.samples.size() < num_samples && total_remaining > 0) {
+    size_t pick = std::uniform_int_distribution<size_t>(
+        0, total_remaining - 1)(rand_engine);
+    size_t shard = 0;
+    while (pick >= remaining[shard]) pick -= remaining[shard++];
+    DVC_ASSERT_LT(taken[shard], shard_results[shard].samples.size());
+    results.samples.push_back(
+        std::move(shard_results[shard].samples[taken[shard]++]));
+    remaining[shard]--;
+    total_remaining--;
+  }
+  return results;
+}
+
+// Sends `query` to every endpoint in parallel and merges the answers.  A
+// shard that does not connect or answer within `timeout` fails the query.
+inline CodeSearchResults shardsearch(
+    const std::vector<std::string>& endpoints, const std::string& query,
+    std::chrono::milliseconds timeout = shard_timeout) {
+  std::vector<CodeSearchResults> shard_results(endpoints.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < endpoints.size(); i++)
+    threads.emplace_back([&, i] {
+      const std::string& endpoint = endpoints[i];
+      auto fail = [&](auto... why) {
+        shard_results[i] = make_error("Shard ", endpoint, " failed: ", why...);
+      };
+      auto host_port = split_endpoint(endpoint);
+      if (!host_port) return fail("expected host:port");
+      const auto& [host, port] = *host_port;
+      addrinfo hints = {};
+      hints.ai_socktype = SOCK_STREAM;
+      addrinfo* addrs;
+      if (int err = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs))
+        return fail(gai_strerror(err));
+      int fd = -1;
+      int err = 0;
+      for (addrinfo* a = addrs; a && fd == -1; a = a->ai_next) {
+        fd = ::socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                      a->ai_protocol);
+        if (fd == -1)
+          err = errno;
+        else if ((err = connect_with_timeout(fd, a, timeout)) != 0) {
+          ::close(fd);
+          fd = -1;
+        }
+      }
+      ::freeaddrinfo(addrs);
+      if (fd == -1) return fail("connect: ", strerror(err));
+      set_socket_timeout(fd, timeout);
+      uint8_t ok;
+      std::string response;
+      if (!write_frame(fd, query) || !read_full(fd, &ok, 1) ||
+          !read_frame(fd, response, max_response_frame)) {
+        ::close(fd);
+        return fail("connection lost");
+      }
+      ::close(fd);
+      if (ok)
+        shard_results[i] = deserialize_results(response);
+      else
+        shard_results[i] = make_error(response);
+    });
+  for (std::thread& t : threads) t.join();
+
+  for (CodeSearchResults& shard : shard_results)
+    if (!shard.error.empty()) return std::move(shard);
+  return merge_results(std::move(shard_results));
+}
+
+// Answers shardsearch requests for the index held by `handle`, up to
+// `num_workers` at once, each scanning with `nthreads` threads.  Further
+// connections wait in the listen backlog.  Never returns.
+inline void serve_shard(const std::string& port, IndexHandle& handle,
+                        size_t num_workers, size_t nthreads,
+                        size_t block_size) {
+  DVC_ASSERT_GT(num_workers, 0);
+  addrinfo hints = {};
+  hints.ai_family = AF_INET6;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* addr;
+  int err = ::getaddrinfo(nullptr, port.c_str(), &hints, &addr);
+  DVC_ASSERT_EQ(err, 0, "getaddrinfo: ", gai_strerror(err));
+  int listen_fd = ::socket(addr->ai_family, addr->ai_socktype, 0);
+  DVC_ASSERT_NE(listen_fd, -1, "socket: ", strerror(errno));
+  int one = 1;
+  ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  DVC_ASSERT_EQ(0, ::bind(listen_fd, addr->ai_addr, addr->ai_addrlen),
+                "Unable to bind port ", port, ": ", strerror(errno));
+  ::freeaddrinfo(addr);
+  DVC_ASSERT_EQ(0, ::listen(listen_fd, 64), "listen: ", strerror(errno));
+  DVC_LOG("Serving shard on port ", port);
+
+  auto worker = [listen_fd, &handle, nthreads, block_size] {
+    while (true) {
+      int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd == -1) {
+        DVC_ERROR("accept: ", strerror(errno));
+        continue;
+      }
+      set_socket_timeout(fd, shard_timeout);
+      std::string query;
+      if (read_frame(fd, query, max_query_frame)) {
+        std::shared_ptr<Index> index = handle.get();
+        CodeSearchResults results =
+            codesearch(*index, query, nthreads, block_size);
+        uint8_t ok = results.error.empty();
+        if (!write_full(fd, &ok, 1) ||
+            !write_frame(fd, ok ? serialize(results) : results.error))
+          DVC_ERROR("Lost connection answering `", query, "`");
+      }
+      ::close(fd);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_workers; i++) workers.emplace_back(worker);
+  for (std::thread& t : workers) t.join();
+}
+
+}  // namespace ppt
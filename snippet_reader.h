@@ -0,0 +1,137 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "dvc/log.h"
+#include "index_reader.h"
+
+namespace ppt {
+
+// Reads match snippets, from the index's source section if it has one,
+// otherwise from the source tree.  Each snippet from the source tree is
+// fetched with a single pread of the byte range its LineInfo entries
+// span, and a batch is fetched by a pool of threads so that on a cold
+// page cache the disk sees all reads at once rather than one after
+// another.  The most recently used source files are kept open.
+class SnippetReader {
+ public:
+  struct Request {
+    std::filesystem::path file;
+    idx::IndexReader::FileLines file_lines;
+  };
+
+  explicit SnippetReader(idx::IndexReader* index = nullptr,
+                         size_t max_open_files = 256)
+      : index(index), max_open_files(max_open_files) {}
+
+  // The lines of `file_lines` in `file`, without newlines.
+  std::vector<std::string> read(const std::filesystem::path& file,
+                                const idx::IndexReader::FileLines& file_lines) {
+    const std::vector<idx::LineInfo>& lines = file_lines.lines;
+    uint32_t num_lines = file_lines.num_lines;
+    if (num_lines == 0) return {};
+    size_t begin = lines[0].file_offset;
+    size_t end = lines[num_lines].file_offset;
+    std::string text = index && index->has_source()
+                           ? index->source(file_lines.file_info, begin, end)
+                           : pread(file, begin, end);
+
+    std::vector<std::string> result;
+    for (uint32_t i = 0; i < num_lines; i++) {
+      result.emplace_back(text, lines[i].file_offset - begin,
+                          lines[i + 1].file_offset - lines[i].file_offset);
+      std::string& s = result.back();
+      if (!s.empty() && s.back() == '\n') s.pop_back();
+    }
+    return result;
+  }
+
+  // read() for each request, on up to `nthreads` threads.
+  std::vector<std::vector<std::string>> read(
+      const std::vector<Request>& requests, size_t nthreads) {
+    std::vector<std::vector<std::string>> result(requests.size());
+    std::atomic_size_t next = 0;
+    auto worker = [&] {
+      for (size_t i = next++; i < requests.size(); i = next++)
+        result[i] = read(requests[i].file, requests[i].file_lines);
+    };
+    std::vector<std::thread> threads;
+    nthreads = std::min(nthreads, requests.size());
+    for (size_t i = 1; i < nthreads; i++) threads.emplace_back(worker);
+    worker();
+    for (std::thread& t : threads) t.join();
+    return result;
+  }
+
+ private:
+  // Closed when evicted and no longer being read.
+  struct OpenFile {
+    int fd;
+    ~OpenFile() { ::close(fd); }
+  };
+
+  std::string pread(const std::filesystem::path& file, size_t begin,
+                    size_t end) {
+    std::string text(end - begin, '\0');
+    std::shared_ptr<OpenFile> open_file = open(file);
+    size_t done = 0;
+    while (done < text.size()) {
+      ssize_t n = ::pread(open_file->fd, text.data() + done,
+                          text.size() - done, begin + done);
+      if (n < 0 && errno == EINTR) continue;
+      DVC_ASSERT_GT(n, 0, "Unable to read ", file, ": ",
+                    n == 0 ? "unexpected end of file" : strerror(errno));
+      done += n;
+    }
+    return text;
+  }
+
+  std::shared_ptr<OpenFile> open(const std::filesystem::path& file) {
+    {
+      std::lock_guard lock(mu);
+      auto it = open_files.find(file.native());
+      if (it != open_files.end()) {
+        lru.splice(lru.begin(), lru, it->second.second);
+        return it->second.first;
+      }
+    }
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    DVC_ASSERT_NE(fd, -1, "Unable to open ", file, ": ", strerror(errno));
+    std::shared_ptr<OpenFile> open_file(new OpenFile{fd});
+
+    std::lock_guard lock(mu);
+    auto [it, inserted] = open_files.try_emplace(file.native());
+    if (!inserted) return it->second.first;  // another thread opened it
+    lru.push_front(file.native());
+    it->second = {open_file, lru.begin()};
+    if (open_files.size() > max_open_files) {
+      open_files.erase(lru.back());
+      lru.pop_back();
+    }
+    return open_file;
+  }
+
+  idx::IndexReader* const index;
+  const size_t max_open_files;
+
+  std::mutex mu;
+  std::list<std::string> lru;  // most recently used first
+  std::unordered_map<std::string,
+                     std::pair<std::shared_ptr<OpenFile>,
+                               std::list<std::string>::iterator>>
+      open_files;
+};
+
+}  // namespace ppt
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "dvc/log.h"
+
+namespace ppt {
+
+// Reads a range of a file sequentially in large chunks, bypassing the
+// page cache with O_DIRECT where the filesystem supports it.  For files
+// that do not fit in memory.
+class streamfile {
+ public:
+  streamfile(const std::filesystem::path& path) : path(path) {
+    DVC_ASSERT(exists(path), "File not found: ", path);
+    fd = ::open(path.string().c_str(), O_RDONLY | O_DIRECT);
+    if (fd == -1) {
+      // e.g. tmpfs, which has no direct I/O
+      fd = ::open(path.string().c_str(), O_RDONLY);
+      DVC_ASSERT_NE(fd, -1, "Unable to open ", path, ": ", strerror(errno));
+      ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    length = file_size(path);
+  }
+
+  // Splits [offset, offset + range_length) into chunks of chunk_size and
+  // calls f(chunk_begin, data, chunk_length, readable) once per chunk,
+  // from nthreads threads.  chunk_begin is relative to offset.  data
+  // holds readable >= chunk_length bytes: the chunk plus up to `overlap`
+  // bytes of whatever follows it, so a match starting in the chunk can be
+  // verified without seeing the next chunk.  Each thread double-buffers:
+  // its next chunk is read while f runs on the current one.
+  template <typename F>
+  void scan(size_t offset, size_t range_length, size_t chunk_size,
+            size_t overlap, size_t nthreads, F f) {
+    std::atomic_size_t next_chunk = 0;
+    size_t num_chunks = (range_length + chunk_size - 1) / chunk_size;
+    size_t buffer_size = align_up(chunk_size + overlap + 2 * alignment);
+
+    std::vector<std::thread> threads;
+    for (size_t thread_index = 0; thread_index < nthreads; thread_index++)
+      threads.emplace_back([&] {
+        buffer buffers[2] = {make_buffer(buffer_size),
+                             make_buffer(buffer_size)};
+        auto fetch = [&](size_t chunk, std::byte* buf) {
+          return std::async(std::launch::async, [=] {
+            return read_chunk(offset, range_length, chunk, chunk_size, overlap,
+                              buf);
+          });
+        };
+        size_t chunk = next_chunk++;
+        if (chunk >= num_chunks) return;
+        std::future<chunk_view> current = fetch(chunk, buffers[0].get());
+        for (size_t i = 1;; i++) {
+          size_t next = next_chunk++;
+          std::future<chunk_view> prefetch;
+          if (next < num_chunks) prefetch = fetch(next, buffers[i % 2].get());
+          chunk_view view = current.get();
+          f(chunk * chunk_size, view.data, view.chunk_length, view.readable);
+          if (next >= num_chunks) return;
+          chunk = next;
+          current = std::move(prefetch);
+        }
+      });
+    for (std::thread& t : threads) t.join();
+  }
+
+  ~streamfile() {
+    DVC_ASSERT_EQ(::close(fd), 0, "close ", path,
+                  " failed: ", ::strerror(errno));
+  }
+
+ private:
+  static constexpr size_t alignment = 4096;
+
+  static size_t align_up(size_t x) {
+    return (x + alignment - 1) & ~(alignment - 1);
+  }
+
+  struct buffer_deleter {
+    void operator()(std::byte* p) { std::free(p); }
+  };
+  using buffer = std::unique_ptr<std::byte[], buffer_deleter>;
+
+  static buffer make_buffer(size_t size) {
+    void* p = std::aligned_alloc(alignment, size);
+    DVC_ASSERT(p, "Unable to allocate ", size, " byte read buffer");
+    return buffer((std::byte*)p);
+  }
+
+  struct chunk_view {
+    const std::byte* data;
+    size_t chunk_length;
+    size_t readable;
+  };
+
+  chunk_view read_chunk(size_t offset, size_t range_length, size_t chunk,
+                        size_t chunk_size, size_t overlap, std::byte* buf) {
+    size_t begin = offset + chunk * chunk_size;
+    size_t end = std::min(begin + chunk_size, offset + range_length);
+    size_t read_end = std::min(end + overlap, length);
+    size_t aligned_begin = begin & ~(alignment - 1);
+    size_t want = align_up(read_end) - aligned_begin;
+    size_t got = 0;
+    while (aligned_begin + got < read_end) {
+      ssize_t n = ::pread(fd, buf + got, want - got, aligned_begin + got);
+      DVC_ASSERT_GE(n, 0, "Unable to read ", path, ": ", strerror(errno));
+      if (n == 0) break;
+      got += n;
+    }
+    DVC_ASSERT_GE(aligned_begin + got, end, "Short read of ", path);
+    size_t readable = std::min(aligned_begin + got, read_end) - begin;
+    return {buf + (begin - aligned_begin), end - begin, readable};
+  }
+
+  std::filesystem::path path;
+  int fd = -1;
+  size_t length = 0;
+
+  streamfile(streamfile&&) = delete;
+  streamfile(const streamfile&) = delete;
+};
+
+}  // namespace ppt
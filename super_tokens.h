@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "index_reader.h"
+#include "token_codec.h"
+
+namespace ppt {
+
+// The token ids of a query encoded with them (see encode_query).
+inline std::vector<uint32_t> query_token_ids(
+    const std::vector<std::byte>& encoded) {
+  std::vector<uint32_t> token_ids;
+  const std::byte* end = encoded.data() + encoded.size();
+  for (const std::byte* p = encoded.data(); p < end;)
+    token_ids.push_back(decode_token(p));
+  return token_ids;
+}
+
+// A match found at a position in the code section spans `length` bytes
+// from there, and is the `num_tokens` tokens after the first `skip` tokens
+// of those bytes.
+struct MatchExtent {
+  size_t length;
+  uint32_t skip;
+  uint32_t num_tokens;
+};
+
+// Finds a query in a code section of super tokens (see SuperTokenHeader).
+// A match can start partway through one super token and end partway
+// through another, and since super tokens do not span lines but matches
+// can, which codes a match is encoded with depends on where its lines
+// break as well as on the query.  So rather than encode the query, this
+// finds each code that can start a match, one whose tokens end with a
+// prefix of the query or contain all of it, and checks the codes after it
+// token by token.  A match is found at the start of its first code, once
+// for each place that code can hold the start of the query.
+class SuperTokenQuery {
+ public:
+  SuperTokenQuery(idx::IndexReader& index,
+                  const std::vector<std::byte>& encoded)
+      : index_(index), query_(query_token_ids(encoded)) {
+    DVC_ASSERT(!query_.empty());
+    std::byte max_code[5];
+    std::byte* end = max_code;
+    encode_token(index.max_code(), end);
+    max_length_ = query_.size() * (end - max_code);
+    for (uint32_t token_id : query_)
+      query_codes_.push_back(index.token_code(token_id));
+    is_super_.resize(index.max_code() + 1);
+    std::vector<uint32_t> super_codes = index.super_token_codes();
+    for (uint32_t code : super_codes) is_super_[code] = true;
+    super_starts_.resize(super_codes.size());
+    add_start(query_codes_[0]);
+    for (uint32_t code : super_codes) add_start(code);
+  }
+
+  // The most bytes a match spans.
+  size_t max_length() const { return max_length_; }
+
+  // Calls on_match(p) for each match at a p in [start, end), reading no
+  // bytes at or after `limit`.
+  template <typename F>
+  void scan(const std::byte* start, const std::byte* end,
+            const std::byte* limit, F&& on_match) const {
+    // The byte before limit is tested as if 0 came after it, which is as
+    // good as any byte after a code of one byte, and no longer code fits.
+    const std::byte* pair_end = std::min(end, limit - 1);
+    const std::byte* p = start;
+    for (; p < pair_end; p++)
+      if (first_bytes_[pair(p[0], p[1])]) check(p, limit, on_match);
+    for (; p < end; p++)
+      if (first_bytes_[pair(p[0], std::byte(0))]) check(p, limit, on_match);
+  }
+
+  // The extent of the match at `p` that scan() found first.
+  MatchExtent extent(const std::byte* p, const std::byte* limit) const {
+    MatchExtent extent = {0, 0, uint32_t(query_.size())};
+    const std::byte* next = p;
+    uint32_t code = decode_token(next);
+    for_each_start(code, [&](uint32_t skip, uint32_t matched) {
+      const std::byte* match_end = match_rest(next, limit, matched);
+      if (!match_end || extent.length != 0) return;
+      extent.length = match_end - p;
+      extent.skip = skip;
+    });
+    DVC_ASSERT_NE(extent.length, 0, "No match where scan() found one");
+    return extent;
+  }
+
+ private:
+  static size_t pair(std::byte first, std::byte second) {
+    return uint8_t(first) | uint8_t(second) << 8;
+  }
+
+  // Calls f(skip, matched) for each place `code` can hold the start of the
+  // query, after its first `skip` tokens, with the first `matched` tokens
+  // of the query.
+  template <typename F>
+  void for_each_start(uint32_t code, F&& f) const {
+    if (code == query_codes_[0]) return f(0, 1);
+    if (code >= is_super_.size() || !is_super_[code]) return;
+    for (auto [skip, matched] : super_starts_[index_.super_token(code)])
+      f(skip, matched);
+  }
+
+  // Calls on_match(p) for each match at `p`, where first_bytes_ matched.
+  template <typename F>
+  void check(const std::byte* p, const std::byte* limit, F&& on_match) const {
+    if (p + encoded_length(*p) > limit) return;
+    const std::byte* next = p;
+    uint32_t code = decode_token(next);
+    for_each_start(code, [&](uint32_t, uint32_t matched) {
+      if (match_rest(next, limit, matched)) on_match(p);
+    });
+  }
+
+  // Adds `code` to the codes that start a match, if it can.
+  void add_start(uint32_t code) {
+    std::vector<std::pair<uint32_t, uint32_t>> starts;
+    auto [begin, end] = index_.code_tokens(code);
+    for (const uint32_t* t = begin; t < end; t++) {
+      size_t n = std::min<size_t>(end - t, query_.size());
+      if (std::equal(t, t + n, query_.begin()))
+        starts.emplace_back(t - begin, n);
+    }
+    if (starts.empty()) return;
+    if (is_super_[code])
+      super_starts_[index_.super_token(code)] = std::move(starts);
+    std::byte encoded[5];
+    std::byte* encoded_end = encoded;
+    encode_token(code, encoded_end);
+    // The second byte is the next code's if this one is a single byte.
+    if (encoded_end - encoded == 1)
+      for (size_t second = 0; second < 256; second++)
+        first_bytes_[pair(encoded[0], std::byte(second))] = true;
+    else
+      first_bytes_[pair(encoded[0], encoded[1])] = true;
+  }
+
+  // The end of the codes from `p` that hold the rest of the query after
+  // its first `matched` tokens, or null if they do not.  Only super tokens
+  // need looking up, which keeps this to the small part of the
+  // super_tokens section that is theirs.
+  const std::byte* match_rest(const std::byte* p, const std::byte* limit,
+                              size_t matched) const {
+    while (matched < query_.size()) {
+      if (p >= limit || p + encoded_length(*p) > limit) return nullptr;
+      uint32_t code = decode_token(p);
+      if (code == query_codes_[matched]) {
+        matched++;
+        continue;
+      }
+      if (code >= is_super_.size() || !is_super_[code]) return nullptr;
+      auto [begin, end] = index_.code_tokens(code);
+      size_t n = std::min<size_t>(end - begin, query_.size() - matched);
+      if (!std::equal(begin, begin + n, query_.begin() + matched))
+        return nullptr;
+      matched += n;
+    }
+    return p;
+  }
+
+  idx::IndexReader& index_;
+  std::vector<uint32_t> query_;
+  std::vector<uint32_t> query_codes_;  // of each query token alone
+  size_t max_length_;
+  std::vector<bool> is_super_;  // by code
+  // Whether the first two bytes at a code (see pair()) can be those of a
+  // code that starts a match, a byte per entry as that tests faster than
+  // a bit.
+  std::vector<uint8_t> first_bytes_ = std::vector<uint8_t>(1 << 16);
+  // For each super token, each place it can hold the start of the query:
+  // the number of its tokens before the query, and then the number of
+  // query tokens it holds.
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> super_starts_;
+};
+
+// The extents of matches of `encoded` that find_matches found at
+// `positions`, in the same order.
+inline std::vector<MatchExtent> match_extents(
+    idx::IndexReader& index, const std::vector<const std::byte*>& positions,
+    const std::vector<std::byte>& encoded) {
+  std::vector<MatchExtent> extents;
+  if (!index.has_super_tokens()) {
+    uint32_t num_tokens = query_token_ids(encoded).size();
+    extents.assign(positions.size(), {encoded.size(), 0, num_tokens});
+    return extents;
+  }
+  SuperTokenQuery query(index, encoded);
+  std::vector<std::byte> buffer;
+  for (const std::byte* position : positions) {
+    size_t offset = position - index.code;
+    size_t length = std::min(query.max_length(), index.code_length - offset);
+    const std::byte* code = index.code_bytes(offset, length, buffer);
+    extents.push_back(query.extent(code, code + length));
+  }
+  return extents;
+}
+
+inline MatchExtent match_extent(idx::IndexReader& index,
+                                const std::byte* position,
+                                const std::vector<std::byte>& encoded) {
+  return match_extents(index, {position}, encoded)[0];
+}
+
+}  // namespace ppt
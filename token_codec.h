@@ -66,6 +66,13 @@ inline void encode_token(uint32_t input, std::byte*& output) {
   }
 }
 
+// The length of the encoding that starts with byte `leading`.
+inline size_t encoded_length(std::byte leading) {
+  uint8_t first = uint8_t(leading);
+  if (!(first & 0b10000000)) return 1;
+  return 2 + ((first >> 4) & 0b11);
+}
+
 inline uint32_t decode_token(const std::byte*& input) {
   uint32_t first = read_byte(input);
   if (!(first & 0b10000000)) {
@@ -22,6 +22,12 @@ struct TokenStream {
   virtual void emit_raw_newline(uint32_t pos) = 0;
   virtual void emit_eof(uint32_t pos) = 0;
 
+  // Called before each token (header name through op or punc) is emitted,
+  // with the raw input bytes [begin, end) it was decoded from.  These are
+  // exact, and include any trigraphs, universal character names and line
+  // splices within the token, so they may be longer than its spelling.
+  virtual void emit_token_range(uint32_t /*begin*/, uint32_t /*end*/) {}
+
   virtual ~TokenStream() {}
 };
 
@@ -34,6 +34,18 @@ bool IsDigraphKeyword(const std::string& s) {
   return S.count(s);
 }
 
+std::string_view CanonicalSpelling(std::string_view spelling) {
+  static std::unordered_map<std::string_view, std::string_view> M = {
+      {"and", "&&"},   {"and_eq", "&="}, {"bitand", "&"}, {"bitor", "|"},
+      {"compl", "~"},  {"not", "!"},     {"not_eq", "!="}, {"or", "||"},
+      {"or_eq", "|="}, {"xor", "^"},     {"xor_eq", "^="}, {"<:", "["},
+      {":>", "]"},     {"<%", "{"},      {"%>", "}"},      {"%:", "#"},
+      {"%:%:", "##"}};
+
+  auto it = M.find(spelling);
+  return it == M.end() ? spelling : it->second;
+}
+
 bool IsSimpleEscapeChar(int c) {
   static std::unordered_set<int> simple_escape_chars = {
       '\'', '"', '?', '\\', 'a', 'b', 'f', 'n', 'r', 't', 'v'};
@@ -41,11 +53,17 @@ bool IsSimpleEscapeChar(int c) {
   return simple_escape_chars.count(c);
 }
 
+// A decoded character and the raw input bytes [begin, end) it came from.
+struct RawChar {
+  int c;
+  uint32_t begin, end;
+};
+
 struct UniversalCharacterNameDecoder {
-  std::vector<int> decode(int input) {
+  std::vector<RawChar> decode(RawChar input) {
     switch (state) {
       case 0:
-        if (input == '\\') {
+        if (input.c == '\\') {
           acc.clear();
           acc.push_back(input);
           state = 1;
@@ -56,40 +74,41 @@ struct UniversalCharacterNameDecoder {
       case 1:
         acc.push_back(input);
 
-        if (input == 'u') {
+        if (input.c == 'u') {
           digits = 4;
           state = 2;
           code_point = 0;
           return {};
-        } else if (input == 'U') {
+        } else if (input.c == 'U') {
           digits = 8;
           state = 2;
           code_point = 0;
           return {};
-        } else if (input == '\\') {
+        } else if (input.c == '\\') {
+          RawChar backslash = acc[0];
           state = 1;
           acc.clear();
-          acc.push_back('\\');
-          return {'\\'};
+          acc.push_back(input);
+          return {backslash};
         } else {
           state = 0;
-          return {'\\', input};
+          return acc;
         }
 
       case 2:
         acc.push_back(input);
 
-        if (!IsHexDigit(input)) {
+        if (!IsHexDigit(input.c)) {
           state = 0;
           return acc;
         } else {
-          code_point = (code_point << 4) + HexCharToValue(input);
+          code_point = (code_point << 4) + HexCharToValue(input.c);
           digits--;
 
           if (digits == 0) {
             state = 0;
 
-            return {code_point};
+            return {{code_point, acc[0].begin, input.end}};
           } else
             return {};
         }
@@ -104,44 +123,49 @@ struct UniversalCharacterNameDecoder {
   int state = 0;
   int code_point = 0;
 
-  std::vector<int> acc;
+  std::vector<RawChar> acc;
 };
 
 struct TrigraphDecoder {
-  std::vector<int> decode(int input) {
+  std::vector<RawChar> decode(RawChar input) {
     static std::unordered_map<int, int> trigraphs = {
         {'=', '#'}, {'/', '\\'}, {'\'', '^'}, {'(', '['}, {')', ']'},
         {'!', '|'}, {'<', '{'},  {'>', '}'},  {'-', '~'}};
 
     switch (state) {
       case 0:
-        if (input == '?') {
+        if (input.c == '?') {
+          held[0] = input;
           state = 1;
           return {};
         } else
           return {input};
 
       case 1:
-        if (input == '?') {
+        if (input.c == '?') {
+          held[1] = input;
           state = 2;
           return {};
         } else {
           state = 0;
-          return {'?', input};
+          return {held[0], input};
         }
 
       case 2:
-        if (input == '?') {
+        if (input.c == '?') {
+          RawChar first = held[0];
+          held[0] = held[1];
+          held[1] = input;
           state = 2;
-          return {'?'};
+          return {first};
         } else {
           state = 0;
 
-          auto it = trigraphs.find(input);
+          auto it = trigraphs.find(input.c);
           if (it == trigraphs.end()) {
-            return {'?', '?', input};
+            return {held[0], held[1], input};
           } else
-            return {it->second};
+            return {{it->second, held[0].begin, input.end}};
         }
 
       default:
@@ -151,39 +175,44 @@ struct TrigraphDecoder {
 
  private:
   int state = 0;
+  RawChar held[2];  // the '?'s seen
 };
 
 struct LineSplicer {
-  std::vector<int> decode(int input) {
+  std::vector<RawChar> decode(RawChar input) {
     switch (state) {
       case 0:
-        if (input == '\\') {
+        if (input.c == '\\') {
+          backslash = input;
           state = 1;
           return {};
         } else
           return {input};
 
       case 1:
-        if (input == '\n') {
+        if (input.c == '\n') {
           state = 0;
           return {};
-        } else if (input == '\r') {
+        } else if (input.c == '\r') {
+          carriage_return = input;
           state = 2;
           return {};
-        } else if (input == '\\')
-          return {'\\'};
-        else {
+        } else if (input.c == '\\') {
+          RawChar released = backslash;
+          backslash = input;
+          return {released};
+        } else {
           state = 0;
-          return {'\\', input};
+          return {backslash, input};
         }
 
       case 2:
-        if (input == '\n') {
+        if (input.c == '\n') {
           state = 0;
           return {};
         } else {
           state = 0;
-          return {'\\', '\r', input};
+          return {backslash, carriage_return, input};
         }
 
       default:
@@ -193,15 +222,16 @@ struct LineSplicer {
 
  private:
   int state = 0;
+  RawChar backslash, carriage_return;
 };
 
 struct NewlineEnder {
-  std::vector<int> decode(int input) {
+  std::vector<RawChar> decode(RawChar input) {
     switch (state) {
       case 0:
-        if (input == -1)
-          return {-1};
-        else if (input == '\n') {
+        if (input.c == -1)
+          return {input};
+        else if (input.c == '\n') {
           state = 2;
           return {input};
         } else {
@@ -210,19 +240,19 @@ struct NewlineEnder {
         }
 
       case 1:
-        if (input == '\n') {
+        if (input.c == '\n') {
           state = 2;
           return {input};
-        } else if (input == -1) {
-          return {'\n', -1};
+        } else if (input.c == -1) {
+          return {{'\n', input.begin, input.begin}, input};
         } else
           return {input};
 
       case 2:
-        if (input == '\n')
+        if (input.c == '\n')
+          return {input};
+        else if (input.c == -1) {
           return {input};
-        else if (input == -1) {
-          return {-1};
         } else {
           state = 1;
           return {input};
@@ -255,6 +285,7 @@ struct Tokenizer {
   void emit_header_name(const std::string& data) {
     header_name_state = 0;
 
+    emit_token_range(data);
     output.emit_header_name(data);
   }
 
@@ -264,36 +295,42 @@ struct Tokenizer {
     else
       header_name_state = 0;
 
+    emit_token_range(data);
     output.emit_identifier(data);
   }
 
   void emit_pp_number(const std::string& data) {
     header_name_state = 0;
 
+    emit_token_range(data);
     output.emit_pp_number(data);
   }
 
   void emit_character_literal(const std::string& data) {
     header_name_state = 0;
 
+    emit_token_range(data);
     output.emit_character_literal(data);
   }
 
   void emit_user_defined_character_literal(const std::string& data) {
     header_name_state = 0;
 
+    emit_token_range(data);
     output.emit_user_defined_character_literal(data);
   }
 
   void emit_string_literal(const std::string& data) {
     header_name_state = 0;
 
+    emit_token_range(data);
     output.emit_string_literal(data);
   }
 
   void emit_user_defined_string_literal(const std::string& data) {
     header_name_state = 0;
 
+    emit_token_range(data);
     output.emit_user_defined_string_literal(data);
   }
 
@@ -303,6 +340,7 @@ struct Tokenizer {
     else
       header_name_state = 0;
 
+    emit_token_range(data);
     output.emit_preprocessing_op_or_punc(data);
   }
 
@@ -318,6 +356,23 @@ struct Tokenizer {
     output.emit_eof(rawpos);
   }
 
+  // How many characters of the accumulator have been emitted as tokens.
+  size_t accumulator_emitted = 0;
+
+  // A token's characters are the next ones of the accumulator not yet
+  // emitted, followed by the lookahead if it runs out.
+  void emit_token_range(const std::string& data) {
+    size_t length = 0;  // in characters
+    for (char c : data) length += (c & 0xc0) != 0x80;
+    size_t first = accumulator_emitted;
+    size_t last = first + length - 1;
+    accumulator_emitted += length;
+    auto raw = [&](size_t i) {
+      return i < accumulator_raw.size() ? accumulator_raw[i] : lookahead_raw;
+    };
+    output.emit_token_range(raw(first).begin, raw(last).end);
+  }
+
   Tokenizer(TokenStream& output) : output(output) {}
 
   enum states {
@@ -382,19 +437,27 @@ struct Tokenizer {
   std::string filename = "<stdin>";
   size_t linenum = 1;
 
+  // Raw offset of the first byte of the character being decoded.
+  uint32_t char_begin = 0;
+
   void process(int c0) {
+    // A multibyte UTF-8 character is decoded at its last byte.
+    if (c0 == -1 || (c0 & 0xc0) != 0x80) char_begin = rawpos;
+    uint32_t char_end = c0 == -1 ? rawpos : rawpos + 1;
     if (!raw_mode) {
       for (int c1 : utf8_decoder.decode(c0))
-        for (int c2 : trigraph_decoder.decode(c1))
-          for (int c3 : ucn_decoder.decode(c2))
-            for (int c4 : line_splicer.decode(c3))
-              for (int c5 : line_ender.decode(c4)) {
-                lookahead = c5;
+        for (RawChar c2 : trigraph_decoder.decode({c1, char_begin, char_end}))
+          for (RawChar c3 : ucn_decoder.decode(c2))
+            for (RawChar c4 : line_splicer.decode(c3))
+              for (RawChar c5 : line_ender.decode(c4)) {
+                lookahead = c5.c;
+                lookahead_raw = c5;
                 next_state();
               }
     } else {
       for (int c1 : utf8_decoder.decode(c0)) {
         lookahead = c1;
+        lookahead_raw = {c1, char_begin, char_end};
         next_state();
       }
     }
@@ -405,7 +468,9 @@ struct Tokenizer {
   }
 
   int lookahead;
+  RawChar lookahead_raw;
   std::vector<int> accumulator;
+  std::vector<RawChar> accumulator_raw;  // where each character came from
 
   std::string accumulator_utf8() { return EncodeUtf8(accumulator); }
 
@@ -413,7 +478,9 @@ struct Tokenizer {
 
   // add lookahead to accumulator, wait for next character
   action_t keep_wait(states s) {
+    if (accumulator.empty()) accumulator_emitted = 0;
     accumulator.push_back(lookahead);
+    accumulator_raw.push_back(lookahead_raw);
     state = s;
     return action_t();
   }
@@ -421,6 +488,7 @@ struct Tokenizer {
   // discard accumulator and lookahead, wait for next character
   action_t clear_wait(states s) {
     accumulator.clear();
+    accumulator_raw.clear();
     state = s;
     return action_t();
   }
@@ -434,6 +502,7 @@ struct Tokenizer {
   // discard accumulator, goto state s
   action_t clear_redirect(states s) {
     accumulator.clear();
+    accumulator_raw.clear();
     state = s;
     return next_state();
   }
@@ -838,8 +907,9 @@ struct Tokenizer {
       case dot2:
         if (IsDigit(lookahead)) {
           emit_preprocessing_op_or_punc(".");
-          accumulator.clear();
-          accumulator.push_back('.');
+          accumulator.erase(accumulator.begin());
+          accumulator_raw.erase(accumulator_raw.begin());
+          accumulator_emitted = 0;
           return keep_wait(pp_number);
         }
 
@@ -1091,6 +1161,7 @@ struct Tokenizer {
         switch (lookahead) {
           case '>':
             accumulator.push_back('>');
+            accumulator_raw.push_back(lookahead_raw);
             emit_header_name(accumulator_utf8());
             return clear_wait(start);
 
@@ -1106,6 +1177,7 @@ struct Tokenizer {
         switch (lookahead) {
           case '"':
             accumulator.push_back('"');
+            accumulator_raw.push_back(lookahead_raw);
             emit_header_name(accumulator_utf8());
             return clear_wait(start);
 
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <string_view>
+
 #include "token_stream.h"
 
 namespace ppt {
 
 void Tokenize(const std::string& input, TokenStream& output);
 
+// The spelling of the token that an alternative token or digraph stands
+// for, such as "&&" for "and" or "[" for "<:", or else `spelling`.
+std::string_view CanonicalSpelling(std::string_view spelling);
+
 }  // namespace ppt
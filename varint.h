@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace ppt {
+
+// LEB128: seven bits per byte, least significant first, high bit set on
+// all but the last byte.
+
+inline void put_varint(std::string& out, uint32_t x) {
+  while (x >= 0x80) {
+    out += char(x | 0x80);
+    x >>= 7;
+  }
+  out += char(x);
+}
+
+inline uint32_t get_varint(const uint8_t*& in) {
+  uint32_t x = *in & 0x7f;
+  for (int shift = 7; *in++ & 0x80; shift += 7)
+    x |= uint32_t(*in & 0x7f) << shift;
+  return x;
+}
+
+inline void put_varint64(std::string& out, uint64_t x) {
+  while (x >= 0x80) {
+    out += char(x | 0x80);
+    x >>= 7;
+  }
+  out += char(x);
+}
+
+// As get_varint, for 64 bits, but reads nothing at or after `end`.
+// Returns false if the varint is longer than that or than 64 bits.
+inline bool get_varint64(const uint8_t*& in, const uint8_t* end,
+                         uint64_t& x) {
+  x = 0;
+  for (int shift = 0; in < end && shift < 64; shift += 7) {
+    x |= uint64_t(*in & 0x7f) << shift;
+    if (!(*in++ & 0x80)) return true;
+  }
+  return false;
+}
+
+}  // namespace ppt
@@ -0,0 +1,57 @@
+#include "varint.h"
+
+#include "dvc/log.h"
+#include "dvc/program.h"
+
+namespace {
+
+// Checks that `x` round trips, and that every truncation of its encoding
+// is rejected without reading past the end.
+void test_varint64(uint64_t x) {
+  std::string s;
+  ppt::put_varint64(s, x);
+  DVC_ASSERT_LE(s.size(), 10);
+  const uint8_t* begin = (const uint8_t*)s.data();
+  const uint8_t* in = begin;
+  uint64_t y;
+  DVC_ASSERT(ppt::get_varint64(in, begin + s.size(), y), x);
+  DVC_ASSERT_EQ(x, y);
+  DVC_ASSERT(in == begin + s.size());
+  for (size_t length = 0; length < s.size(); length++) {
+    in = begin;
+    DVC_ASSERT(!ppt::get_varint64(in, begin + length, y), x, " ", length);
+    DVC_ASSERT(in <= begin + length);
+  }
+
+  if (x <= UINT32_MAX) {
+    std::string s32;
+    ppt::put_varint(s32, x);
+    DVC_ASSERT(s32 == s);
+    in = (const uint8_t*)s32.data();
+    DVC_ASSERT_EQ(ppt::get_varint(in), x);
+  }
+}
+
+}  // namespace
+
+int main() {
+  dvc::program program;
+
+  for (int bits = 0; bits <= 64; bits++) {
+    uint64_t x = bits == 64 ? UINT64_MAX : (uint64_t(1) << bits) - 1;
+    test_varint64(x);
+    test_varint64(x + 1);
+    test_varint64(x / 3);
+  }
+
+  // Continuation bits beyond 64 bits of value are rejected, even with
+  // bytes left to read.
+  std::string s(11, char(0x80));
+  s.back() = 0;
+  const uint8_t* in = (const uint8_t*)s.data();
+  uint64_t x;
+  DVC_ASSERT(!ppt::get_varint64(in, in + s.size(), x));
+  in = (const uint8_t*)s.data() + 1;
+  DVC_ASSERT(ppt::get_varint64(in, in + 10, x));
+  DVC_ASSERT_EQ(x, 0);
+}